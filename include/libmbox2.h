@@ -9,6 +9,7 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,6 +21,27 @@ typedef unsigned char mboxChar;
 
 typedef struct _mboxMsgLite mboxMsgLite;
 
+/* The fields of a message that can be left in the file until asked for, see
+ * mboxSetLazy */
+#define MBOX_FIELD_FROM (0)
+#define MBOX_FIELD_SUBJECT (1)
+#define MBOX_FIELD_DATE (2)
+#define MBOX_FIELD_MSG_ID (3)
+#define MBOX_FIELD_FROM_LINE (4)
+#define MBOX_FIELD_PREVIEW (5)
+#define MBOX_FIELD_COUNT (6)
+
+/* Where a field is in the raw message. For a header this is the whole of it,
+ * name and any lines carrying it on included */
+typedef struct mboxMsgSpan {
+    uint32_t offset; /* From the start of the message */
+    uint32_t len;    /* 0 if the message doesn't have it */
+} mboxMsgSpan;
+
+/* Each distinct sender address and domain once, with a small integer id */
+typedef struct mboxIntern mboxIntern;
+#define MBOX_INTERN_NONE (UINT32_MAX)
+
 typedef int mboxListFindCallback(void *data, void *needle);
 typedef void mboxListFreeData(void *data);
 typedef int mboxListCmp(void *data, void *needle);
@@ -67,6 +89,15 @@ struct _mboxMsgLite {
      * friends */
     size_t start; /* The start of this offset in the file */
     size_t end;   /* The end of the offset in the file */
+    int in_arena; /* It and its strings were allocated together in an arena,
+                     mboxMsgLiteRelease leaves it to be freed with that */
+    /* The sender's address and its domain in a dictionary of them, see
+     * mboxSenders. MBOX_INTERN_NONE until interned */
+    uint32_t sender_id;
+    uint32_t domain_id;
+    /* NULL unless parsed lazily, then MBOX_FIELD_COUNT spans and the fields
+     * above stay NULL until they are decoded. unix_timestamp is always set */
+    mboxMsgSpan *spans;
 };
 
 mboxList *mboxListNew(void);
@@ -93,14 +124,290 @@ void mboxListRelease(mboxList *l);
 void mboxMsgListSortByDate(mboxList *msglist);
 void mboxMsgListSortBySender(mboxList *msglist);
 mboxList *mboxMsgListFilterBySender(mboxList *l, char *sender);
+/* Give every message in the list the ids of its sender and domain in `d`,
+ * adding them if need be. Messages parsed by an mbox already have ids in
+ * mboxSenders, this is for those that weren't such as a list loaded from an
+ * index */
+void mboxMsgListIntern(mboxList *l, mboxIntern *d);
+/* Like mboxMsgListFilterBySender but `sender` is matched against each
+ * distinct address in `d` once, then each message by its id. Only looks at
+ * the address, not the name in front of it, and keeps the list's order */
+mboxList *mboxMsgListFilterBySenderInterned(mboxList *l, mboxIntern *d,
+        char *sender);
+/* Messages from exactly `domain`, ignoring case */
+mboxList *mboxMsgListFilterByDomain(mboxList *l, mboxIntern *d, char *domain);
+
+mboxIntern *mboxInternNew(void);
+void mboxInternRelease(mboxIntern *d);
+/* How many distinct strings it holds, their ids are 0 to this - 1 */
+size_t mboxInternLen(mboxIntern *d);
+/* NULL for an id it didn't hand out */
+const char *mboxInternGet(mboxIntern *d, uint32_t id);
+/* Where the last message in the list ends, somewhere to pick up from with
+ * mboxParseAppended */
+size_t mboxMsgListEndOffset(mboxList *l);
+
+/* The same as a list of mboxMsgLite but a column for each field, so a scan
+ * over one field reads only that field and reads it in order. Rows are in
+ * the order the messages were added */
+#define MBOX_TABLE_NONE (UINT64_MAX)
+
+typedef struct mboxStrColumn {
+    uint64_t *offsets; /* Into `heap`, MBOX_TABLE_NONE if there isn't one */
+    uint32_t *lens;
+    char *heap;
+    size_t heap_len;
+    size_t heap_capacity;
+} mboxStrColumn;
+
+typedef struct mboxMsgTable {
+    size_t len;
+    size_t capacity;
+    size_t *start;
+    size_t *end;
+    long *unix_timestamp;
+    mboxStrColumn from;
+    mboxStrColumn subject;
+    mboxStrColumn msg_id;
+} mboxMsgTable;
+
+mboxMsgTable *mboxMsgTableNew(void);
+/* Copies what it needs, the list and its messages are untouched */
+mboxMsgTable *mboxMsgTableFromList(mboxList *l);
+void mboxMsgTableAdd(mboxMsgTable *t, mboxMsgLite *msg);
+void mboxMsgTableRelease(mboxMsgTable *t);
+
+size_t mboxMsgTableLen(mboxMsgTable *t);
+size_t mboxMsgTableStart(mboxMsgTable *t, size_t row);
+size_t mboxMsgTableEnd(mboxMsgTable *t, size_t row);
+long mboxMsgTableTimestamp(mboxMsgTable *t, size_t row);
+/* NULL if the message didn't have one */
+const char *mboxMsgTableFrom(mboxMsgTable *t, size_t row);
+const char *mboxMsgTableSubject(mboxMsgTable *t, size_t row);
+const char *mboxMsgTableMsgId(mboxMsgTable *t, size_t row);
+
+/* Each writes the rows that match to `rows`, which must have room for every
+ * row in the table, and returns how many there were. Sent in [from, to) */
+size_t mboxMsgTableFilterByDate(mboxMsgTable *t, long from, long to,
+        size_t *rows);
+/* Case insensitive, anywhere in the From header like
+ * mboxMsgListFilterBySender */
+size_t mboxMsgTableFilterBySender(mboxMsgTable *t, char *sender,
+        size_t *rows);
 
 mbox *mboxReadOpen(char *file_path, int perms);
+/* Same as mboxReadOpen but memory maps the file, messages are parsed straight
+ * out of the mapping without being copied */
+mbox *mboxReadOpenMapped(char *file_path, int perms);
+
+/* Same as mboxReadOpen but reads with O_DIRECT, bypassing the page cache. For
+ * one off scans of large files that would otherwise evict everything else
+ * from the cache. Falls back to normal reads if the filesystem refuses */
+mbox *mboxReadOpenDirect(char *file_path, int perms);
+
+/* Open a gzipped mbox. Without checkpoints it can only be inflated from the
+ * start so is parsed by one io thread. If `checkpoint_path` is given the
+ * first parse saves checkpoints there and later opens use them to parse in
+ * parallel. Returns NULL if built without zlib */
+mbox *mboxReadOpenGzip(char *file_path, char *checkpoint_path, int perms);
 
 void mboxMsgLitePrint(mboxMsgLite *m);
 
+/* How the file is read when parsing, auto uses io_uring if the kernel
+ * supports it and falls back to pread */
+#define MBOX_IO_ENGINE_PREAD (0)
+#define MBOX_IO_ENGINE_URING (1)
+#define MBOX_IO_ENGINE_AUTO (2)
+void mboxSetIOEngine(mbox *m, int engine);
+
+/* The threads every parse and index load runs on, started once and shared.
+ * Anything not given a runtime uses the default one, which has a thread for
+ * each cpu we may run on capped by any cgroup cpu quota */
+typedef struct mboxRuntime mboxRuntime;
+
+typedef struct mboxRuntimeConfig {
+    size_t threads; /* 0 for mboxRuntimeDefaultThreads() */
+    int *cpus;      /* Cpus the workers may run on, NULL for any we are
+                       allowed */
+    size_t cpu_count;
+    int pin; /* Each worker on a single cpu, round robin over `cpus` */
+} mboxRuntimeConfig;
+
+/* `config` can be NULL for the defaults */
+mboxRuntime *mboxRuntimeNew(mboxRuntimeConfig *config);
+/* Every mbox using it must have been released first */
+void mboxRuntimeRelease(mboxRuntime *rt);
+size_t mboxRuntimeThreadCount(mboxRuntime *rt);
+mboxRuntime *mboxRuntimeDefault(void);
+size_t mboxRuntimeDefaultThreads(void);
+
+/* What a runtime's threads have been up to since it started or the stats
+ * were last reset. Counting costs a few atomic adds per job, configure with
+ * --disable-worker-stats to leave it out */
+#define MBOX_WORKER_LANES (2)
+#define MBOX_WORKER_HIST_LEN (40)
+
+typedef struct mboxWorkerCounters {
+    uint64_t jobs;    /* Jobs run */
+    uint64_t busy_ns; /* Running them, not counting jobs they ran while they
+                         waited which are counted once by themselves */
+    uint64_t idle_ns; /* Looking for work or asleep */
+    uint64_t steals;  /* Jobs taken from another thread */
+    uint64_t wait_ns; /* How long the jobs sat queued before starting */
+    uint64_t wait_hist[MBOX_WORKER_HIST_LEN]; /* Jobs by how long they sat
+                                                 queued, bucket i is
+                                                 [2^i, 2^(i+1)) ns */
+} mboxWorkerCounters;
+
+typedef struct mboxWorkerPoolCounters {
+    size_t worker_count;
+    /* One for each thread and then one more for jobs run by threads outside
+     * the runtime helping while they wait */
+    mboxWorkerCounters *workers;
+    /* Most jobs there have been waiting at once, interactive then bulk */
+    size_t high_water[MBOX_WORKER_LANES];
+} mboxWorkerPoolCounters;
+
+/* A copy read without stopping anything, so counters may be a job or two
+ * apart from each other. NULL if built without stats */
+mboxWorkerPoolCounters *mboxRuntimeStats(mboxRuntime *rt);
+/* Start counting again from 0, say before the parse you want to look at */
+void mboxRuntimeStatsReset(mboxRuntime *rt);
+void mboxRuntimeStatsRelease(mboxWorkerPoolCounters *stats);
+
+/* How a parse splits its threads between reading and parsing headers.
+ * Adaptive (the default) moves threads to whichever is falling behind as it
+ * goes, fixed reads with half of them throughout. Fused doesn't split them,
+ * every thread parses each message it finds while it is still in its
+ * cache */
+#define MBOX_BALANCE_ADAPTIVE (0)
+#define MBOX_BALANCE_FIXED (1)
+#define MBOX_BALANCE_FUSED (2)
+void mboxSetBalance(mbox *m, int balance);
+
+/* Most bytes of messages read and waiting to be parsed, 64MB by default or 0
+ * for no limit. When the parsers fall behind the threads reading parse what
+ * they find themselves until it drops, so the memory a parse needs does not
+ * grow with the size of the file */
+void mboxSetBacklogLimit(mbox *m, size_t bytes);
+
+/* Which lane of the runtime a parse runs in. Threads run anything
+ * MBOX_PRIORITY_INTERACTIVE before any MBOX_PRIORITY_BULK (the default), and
+ * long bulk jobs stop between messages to let it in. For searching one
+ * mailbox while others are being indexed in the background. Must not be
+ * called while a parse is running */
+#define MBOX_PRIORITY_INTERACTIVE (0)
+#define MBOX_PRIORITY_BULK (1)
+void mboxSetPriority(mbox *m, int priority);
+
+/* Parse on `rt`'s threads rather than the default runtime's. Must not be
+ * called while a parse is running */
+void mboxSetRuntime(mbox *m, mboxRuntime *rt);
+
+/* Every sender address and domain parsed from the file so far, each parsed
+ * message's sender_id and domain_id are in here. Lives as long as the mbox */
+mboxIntern *mboxSenders(mbox *m);
+
+/* With `lazy` set parsing only finds where the From, Subject, Date and
+ * Message-ID headers, the from line and the preview are in each message and
+ * leaves them in the file. Messages then have those fields NULL and their
+ * spans set, only unix_timestamp is worked out up front. Fetch the fields
+ * with mboxMsgLiteField, as nothing is decoded the senders are not interned
+ * while parsing. Ignored for a gzipped mbox which is always parsed in full.
+ * Must not be called while a parse is running */
+void mboxSetLazy(mbox *m, int lazy);
+
+/* One of a message's MBOX_FIELD_*, decoded from the file the first time it is
+ * asked for and then kept on the message. Safe to call for the same message
+ * from more than one thread. For a message that wasn't parsed lazily this is
+ * the field as it is. NULL if the message doesn't have it, the buf belongs to
+ * the message */
+mboxBuf *mboxMsgLiteField(mbox *m, mboxMsgLite *msg, int field);
+
+/* The same but the message is left alone and a copy of the field is
+ * returned for the caller to release, for one off reads of messages that
+ * are not going to be looked at again */
+mboxBuf *mboxMsgLiteReadField(mbox *m, mboxMsgLite *msg, int field);
+
+/* `thread_count` is how many of the runtime's threads this parse tries to
+ * keep busy, 0 for all of them */
 mboxList *mboxParse(mbox *m, size_t thread_count);
+
+/* Parse only the messages starting at or after `*offset`, which is usually
+ * the end offset of the last message already seen (see mboxMsgListEndOffset,
+ * works for lists from an index too) or what the last call set it to. Sets
+ * `*offset` to the size of the file that was parsed and returns a list of just
+ * the new messages. The list is the caller's to release, the messages belong
+ * to `m` and are freed with it. Returns NULL if the file has shrunk since, it
+ * needs a full parse */
+mboxList *mboxParseAppended(mbox *m, size_t *offset, size_t thread_count);
+
+/* Called with each message as soon as it has been parsed, the message is
+ * the callee's to release with mboxMsgLiteRelease. Return non-zero to stop
+ * the parse early */
+typedef int mboxParseStreamCallback(void *ctx, mboxMsgLite *msg);
+
+/* Parse without holding every message in memory, the callback is called
+ * from the calling thread in no particular order. Only a fixed number of
+ * messages are ever in flight, the parse waits for the callback if it falls
+ * behind. Returns how many messages were delivered */
+size_t mboxParseStream(mbox *m, size_t thread_count,
+        mboxParseStreamCallback *callback, void *ctx);
+
+/* The same as a pull iterator, mboxParseIterNext blocks until the next
+ * message is parsed and returns NULL once they have all been seen. Close
+ * must always be called and can be called early */
+int mboxParseIterOpen(mbox *m, size_t thread_count);
+mboxMsgLite *mboxParseIterNext(mbox *m);
+void mboxParseIterClose(mbox *m);
+
+/* A parse running in the background, for event loops that can't block for
+ * the length of mboxParse */
+typedef struct mboxAsync mboxAsync;
+
+#define MBOX_ASYNC_RUNNING (0)
+#define MBOX_ASYNC_DONE (1)
+#define MBOX_ASYNC_CANCELLED (2)
+
+/* Start parsing and return straight away, NULL if the parse couldn't be
+ * started. Nothing else may be done with `m` until it is released */
+mboxAsync *mboxParseAsync(mbox *m, size_t thread_count);
+
+/* Becomes readable each time the parse gets further through the file and
+ * once more when it is over. An eventfd, or a pipe where there are none, to
+ * go in a poll or epoll set. mboxAsyncPoll makes it unreadable again */
+int mboxAsyncFd(mboxAsync *async);
+
+/* Returns MBOX_ASYNC_*. If given `done` is set to how many bytes of the file
+ * have been read and `total` to its size, 0 for a gzipped file whose size
+ * isn't known yet */
+int mboxAsyncPoll(mboxAsync *async, size_t *done, size_t *total);
+
+/* Stop early. Readers stop at their next message and messages waiting to be
+ * parsed are dropped, the state becomes MBOX_ASYNC_CANCELLED once every
+ * thread has let go */
+void mboxAsyncCancel(mboxAsync *async);
+
+/* The messages in the same way as mboxParse returns them, NULL until the
+ * state is MBOX_ASYNC_DONE */
+mboxList *mboxAsyncResult(mboxAsync *async);
+
+/* Cancels the parse if it is still running and waits for it to stop */
+void mboxAsyncRelease(mboxAsync *async);
+
 void mboxRelease(mbox *m);
 
+/* Returns a descriptor which becomes readable whenever a writer closes the
+ * file, which is when an MTA has finished delivering. Returns -1 if watching
+ * files is not supported. The descriptor can go in a poll set of your own */
+int mboxWatchOpen(char *file_path);
+
+/* Wait up to `timeout_ms` (-1 for ever) for the file to be written to,
+ * returns 1 if it was, 0 on timeout and -1 on error */
+int mboxWatchWait(int fd, int timeout_ms);
+
+void mboxWatchClose(int fd);
+
 /* Save a linked list of lite messages to a simple file format that will allow
  * quickly loading in all of the messages again without having to scan the raw
  * mbox file to find all off the messages
@@ -109,7 +416,10 @@ void mboxRelease(mbox *m);
  * */
 int mboxIdxSave(char *filename, mboxList *l);
 
+/* Loads on the default runtime, `thread_count` is no longer used */
 mboxList *mboxIdxLoad(char *idxfile, char *mboxfile, unsigned int thread_count);
+mboxList *mboxIdxLoadWithRuntime(char *idxfile, char *mboxfile,
+        mboxRuntime *rt);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,889 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+/* For O_DIRECT */
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "mbox-buf.h"
+#include "mbox-intern.h"
+#include "mbox-io.h"
+#include "mbox-memory.h"
+#include "mbox-runtime.h"
+#include "mbox-scan.h"
+#include "mbox-table.h"
+#include "mbox-timing.h"
+#include "mbox-worker.h"
+#include "mbox.h"
+
+/* Microbenchmarks, build against the static library:
+ *
+ *   cc -O2 -I. bench.c .libs/libmbox2.a -lpthread -lz -o bench
+ *   ./bench [mbox file]
+ *
+ * Given a file the cold read and parse speed of buffered and O_DIRECT reads
+ * is compared, the file is dropped from the page cache before each run */
+
+#define BENCH_SCAN_SIZE (256 * 1024 * 1024)
+#define BENCH_SCAN_RUNS (5)
+#define BENCH_PARSE_THREADS (4)
+#define BENCH_POOL_JOBS (2000000)
+#define BENCH_POOL_WORKERS (4)
+#define BENCH_POOL_BATCH (64)
+#define BENCH_POOL_FANOUT (15)
+#define BENCH_OPEN_RUNS (200)
+#define BENCH_OPEN_SIZE (64 * 1024)
+#define BENCH_BALANCE_SIZE (16 * 1024 * 1024)
+#define BENCH_BALANCE_RUNS (3)
+#define BENCH_TABLE_MSGS (1000000)
+#define BENCH_MEM_OPS (10000000)
+#define BENCH_MEM_LIVE (4096)
+#define BENCH_MEM_THREADS (4)
+#define BENCH_TABLE_SENDERS (40000)
+#define BENCH_TABLE_DOMAINS (1000)
+#define BENCH_TABLE_RUNS (5)
+#define BENCH_LAZY_SIZE (64 * 1024 * 1024)
+#define BENCH_LAZY_RUNS (3)
+
+/* Looks enough like an mbox for the scanner, lines of text with the odd
+ * line starting with 'F' and a 'From ' line every few kilobytes */
+static mboxChar *
+benchMakeMbox(size_t size)
+{
+    static const char *lines[] = {
+        "From 1754173012221210512@xxx Thu Jan 05 09:09:08 +0000 2023\n",
+        "X-Gmail-Labels: Inbox,Category Updates\n",
+        "From: Hacker Noon <support@hackernoon.com>\n",
+        "Subject: Finally, the newsletter you have been waiting for\n",
+        "\n",
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do\n",
+        "eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim\n",
+        "For more information follow the link below, or don't.\n",
+        "ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut\n",
+    };
+    mboxChar *data = malloc(size + 1);
+    size_t offset = 0;
+    unsigned int seed = 42;
+
+    while (offset < size) {
+        /* roughly one message every 4k */
+        int idx = (rand_r(&seed) % 64) == 0 ? 0 :
+                                              1 + rand_r(&seed) % 8;
+        size_t len = strlen(lines[idx]);
+        if (offset + len > size) {
+            len = size - offset;
+        }
+        memcpy(data + offset, lines[idx], len);
+        offset += len;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+static void
+benchScanOne(char *name, mboxScanFn *fn, mboxChar *data, size_t size)
+{
+    struct timeval timer;
+    double best = 0;
+    size_t found = 0;
+
+    if (fn == NULL) {
+        printf("scan %-8s unsupported on this cpu\n", name);
+        return;
+    }
+
+    for (int run = 0; run < BENCH_SCAN_RUNS; ++run) {
+        size_t idx = 0;
+        found = 0;
+
+        mboxTimerStart(&timer);
+        while ((idx = fn(data, idx, size)) < size) {
+            found++;
+            idx++;
+        }
+        double ms = mboxTimerEnd(&timer);
+
+        if (run == 0 || ms < best) {
+            best = ms;
+        }
+    }
+
+    printf("scan %-8s %8.2f GB/s (%zu from lines, best of %d)\n", name,
+            ((double)size / (1024 * 1024 * 1024)) / (best / 1000.0), found,
+            BENCH_SCAN_RUNS);
+}
+
+static void
+benchScan(void)
+{
+    mboxChar *data = benchMakeMbox(BENCH_SCAN_SIZE);
+
+    benchScanOne("scalar", mboxScanFromLineScalar, data, BENCH_SCAN_SIZE);
+    benchScanOne("sse2", mboxScanGetSSE2(), data, BENCH_SCAN_SIZE);
+    benchScanOne("avx2", mboxScanGetAVX2(), data, BENCH_SCAN_SIZE);
+    printf("scan dispatch picks: %s\n", mboxScanImplName());
+    free(data);
+}
+
+typedef struct benchProducer {
+    pthread_t th;
+    mboxWorkerPool *pool;
+    size_t jobs;
+    size_t batch; /* Jobs per enqueue */
+} benchProducer;
+
+/* As little work as a job can do so all we measure is the pool */
+static void
+benchPoolJob(void *priv_data, void *argv)
+{
+    (void)argv;
+    __atomic_add_fetch((size_t *)priv_data, 1, __ATOMIC_RELAXED);
+}
+
+/* Runs in the pool and splits into more jobs, which stay on this worker
+ * unless someone steals them */
+static void
+benchPoolSpawn(void *priv_data, void *argv)
+{
+    void *children[BENCH_POOL_FANOUT] = { NULL };
+
+    benchPoolJob(priv_data, argv);
+    mboxWorkerPoolEnqueueBatch((mboxWorkerPool *)argv, benchPoolJob, children,
+            BENCH_POOL_FANOUT);
+}
+
+static void *
+benchPoolProducer(void *argv)
+{
+    benchProducer *producer = (benchProducer *)argv;
+    void *batch[BENCH_POOL_BATCH] = { NULL };
+
+    for (size_t i = 0; i < producer->jobs; i += producer->batch) {
+        if (producer->batch == 1) {
+            mboxWorkerPoolEnqueue(producer->pool, benchPoolJob, NULL);
+        } else {
+            mboxWorkerPoolEnqueueBatch(producer->pool, benchPoolJob, batch,
+                    producer->batch);
+        }
+    }
+    return NULL;
+}
+
+/* Many threads pushing tiny jobs at once, which is what the io threads do to
+ * the parse pool with every message they find */
+static void
+benchPoolOne(size_t producer_count, size_t batch)
+{
+    struct timeval timer;
+    benchProducer producers[8];
+    mboxWorkerPool *pool = mboxWorkerPoolNew(BENCH_POOL_WORKERS);
+    size_t done = 0;
+
+    mboxWorkerPoolSetPrivData(pool, &done);
+
+    mboxTimerStart(&timer);
+    for (size_t i = 0; i < producer_count; ++i) {
+        producers[i].pool = pool;
+        producers[i].jobs = BENCH_POOL_JOBS / producer_count;
+        producers[i].batch = batch;
+        pthread_create(&producers[i].th, NULL, benchPoolProducer,
+                &producers[i]);
+    }
+    for (size_t i = 0; i < producer_count; ++i) {
+        pthread_join(producers[i].th, NULL);
+    }
+    mboxWorkerPoolWait(pool);
+    double ms = mboxTimerEnd(&timer);
+
+    printf("pool %zu producers, batches of %-3zu %8.1f ns/job (%zu jobs, %d "
+           "workers)\n",
+            producer_count, batch, (ms * 1000000.0) / done, done,
+            BENCH_POOL_WORKERS);
+    mboxWorkerPoolRelease(pool);
+}
+
+/* Jobs enqueueing jobs, these go on the workers' own deques */
+static void
+benchPoolFanout(void)
+{
+    struct timeval timer;
+    mboxWorkerPool *pool = mboxWorkerPoolNew(BENCH_POOL_WORKERS);
+    size_t roots = BENCH_POOL_JOBS / (BENCH_POOL_FANOUT + 1);
+    size_t done = 0;
+
+    mboxWorkerPoolSetPrivData(pool, &done);
+
+    mboxTimerStart(&timer);
+    for (size_t i = 0; i < roots; ++i) {
+        mboxWorkerPoolEnqueue(pool, benchPoolSpawn, pool);
+    }
+    mboxWorkerPoolWait(pool);
+    double ms = mboxTimerEnd(&timer);
+
+    printf("pool fan out of %d from inside    %8.1f ns/job (%zu jobs, %d "
+           "workers)\n",
+            BENCH_POOL_FANOUT, (ms * 1000000.0) / done, done,
+            BENCH_POOL_WORKERS);
+    mboxWorkerPoolRelease(pool);
+}
+
+static void
+benchPool(void)
+{
+    benchPoolOne(1, 1);
+    benchPoolOne(2, 1);
+    benchPoolOne(4, 1);
+    benchPoolOne(1, BENCH_POOL_BATCH);
+    benchPoolOne(4, BENCH_POOL_BATCH);
+    benchPoolFanout();
+}
+
+static void
+benchOpenOne(char *name, char *path, int own_runtime)
+{
+    struct timeval timer;
+    mboxRuntimeConfig config = { .threads = BENCH_PARSE_THREADS };
+    size_t count = 0;
+
+    mboxTimerStart(&timer);
+    for (int run = 0; run < BENCH_OPEN_RUNS; ++run) {
+        mboxRuntime *rt = own_runtime ? mboxRuntimeNew(&config) : NULL;
+        mbox *m = mboxReadOpen(path, 0666);
+
+        if (rt) {
+            mboxSetRuntime(m, rt);
+        }
+        count = mboxParse(m, BENCH_PARSE_THREADS)->len;
+        mboxRelease(m);
+        mboxRuntimeRelease(rt);
+    }
+    double ms = mboxTimerEnd(&timer);
+
+    printf("open %-8s %8.1f us/mailbox (%zu messages, %d mailboxes)\n", name,
+            (ms * 1000.0) / BENCH_OPEN_RUNS, count, BENCH_OPEN_RUNS);
+}
+
+/* A mailbox of small messages that parse like real ones, returns 0 if the
+ * file couldn't be made. `path` is a mkstemp template */
+static int
+benchWriteMbox(char *path, long size)
+{
+    int fd = mkstemp(path);
+    FILE *fp = fd != -1 ? fdopen(fd, "w") : NULL;
+
+    if (fp == NULL) {
+        printf("failed to create %s\n", path);
+        return 0;
+    }
+
+    for (int i = 0; ftell(fp) < size; ++i) {
+        fprintf(fp,
+                "From %d@xxx Thu Jan 05 09:09:08 +0000 2023\n"
+                "From: Hacker Noon <support@hackernoon.com>\n"
+                "Subject: Issue %d\n"
+                "Date: Thu, 05 Jan 2023 09:09:08 +0000\n"
+                "\n"
+                "Lorem ipsum dolor sit amet, consectetur adipiscing elit\n"
+                "\n",
+                i, i);
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* Many small mailboxes one after another, on the shared runtime and on a
+ * runtime started for each which is what every mbox used to do */
+static void
+benchOpen(void)
+{
+    char path[] = "/tmp/mbox-bench-XXXXXX";
+
+    if (benchWriteMbox(path, BENCH_OPEN_SIZE)) {
+        benchOpenOne("shared", path, 0);
+        benchOpenOne("own", path, 1);
+        unlink(path);
+    }
+}
+
+typedef struct benchBalanceMode {
+    char *name;
+    mbox *(*openfn)(char *, int);
+    int balance;
+    double best;
+    size_t count;
+} benchBalanceMode;
+
+/* Handing each message to another thread to parse against parsing it on the
+ * thread that found it, with the file in the page cache. The modes take
+ * turns so none of them is always run on a heap the others have grown */
+static void
+benchBalance(void)
+{
+    char path[] = "/tmp/mbox-bench-XXXXXX";
+    benchBalanceMode modes[] = {
+        { "split fixed", mboxReadOpen, MBOX_BALANCE_FIXED, 0, 0 },
+        { "split adaptive", mboxReadOpen, MBOX_BALANCE_ADAPTIVE, 0, 0 },
+        { "fused", mboxReadOpen, MBOX_BALANCE_FUSED, 0, 0 },
+        { "map split", mboxReadOpenMapped, MBOX_BALANCE_ADAPTIVE, 0, 0 },
+        { "map fused", mboxReadOpenMapped, MBOX_BALANCE_FUSED, 0, 0 },
+    };
+    struct timeval timer;
+
+    if (!benchWriteMbox(path, BENCH_BALANCE_SIZE)) {
+        return;
+    }
+
+    for (int run = 0; run < BENCH_BALANCE_RUNS; ++run) {
+        for (size_t i = 0; i < static_sizeof(modes); ++i) {
+            mbox *m = modes[i].openfn(path, 0666);
+
+            mboxSetBalance(m, modes[i].balance);
+            mboxTimerStart(&timer);
+            modes[i].count = mboxParse(m, BENCH_PARSE_THREADS)->len;
+            double ms = mboxTimerEnd(&timer);
+
+            if (run == 0 || ms < modes[i].best) {
+                modes[i].best = ms;
+            }
+            mboxRelease(m);
+        }
+    }
+
+    for (size_t i = 0; i < static_sizeof(modes); ++i) {
+        printf("parse %-14s %8.2f ms (%zu messages, best of %d)\n",
+                modes[i].name, modes[i].best, modes[i].count,
+                BENCH_BALANCE_RUNS);
+    }
+    unlink(path);
+}
+
+/* The upper end of the bucket the `pct`th percentile of queue waits is in */
+static uint64_t
+benchWaitPercentile(mboxWorkerCounters *c, double pct)
+{
+    uint64_t want = (uint64_t)(c->jobs * pct / 100.0);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < MBOX_WORKER_HIST_LEN; ++i) {
+        seen += c->wait_hist[i];
+        if (seen > want) {
+            return (uint64_t)2 << i;
+        }
+    }
+    return 0;
+}
+
+/* Where the time went in one parse, per thread */
+static void
+benchStats(void)
+{
+    char path[] = "/tmp/mbox-bench-XXXXXX";
+    mboxRuntimeConfig config = { .threads = BENCH_PARSE_THREADS };
+    mboxRuntime *rt = NULL;
+    mboxWorkerPoolCounters *stats = NULL;
+    mbox *m = NULL;
+
+    if (!benchWriteMbox(path, BENCH_BALANCE_SIZE)) {
+        return;
+    }
+
+    rt = mboxRuntimeNew(&config);
+    m = mboxReadOpen(path, 0666);
+    mboxSetRuntime(m, rt);
+    mboxRuntimeStatsReset(rt);
+    mboxParse(m, 0);
+
+    if ((stats = mboxRuntimeStats(rt)) == NULL) {
+        printf("stats not built in, --disable-worker-stats\n");
+    } else {
+        for (size_t i = 0; i <= stats->worker_count; ++i) {
+            mboxWorkerCounters *c = &stats->workers[i];
+            printf("stats %-7s %7lu jobs %8.2f ms busy %8.2f ms idle %5lu "
+                   "steals, waits p50 < %lu ns p99 < %lu ns\n",
+                    i < stats->worker_count ? "worker" : "outside",
+                    (unsigned long)c->jobs, c->busy_ns / 1000000.0,
+                    c->idle_ns / 1000000.0, (unsigned long)c->steals,
+                    (unsigned long)benchWaitPercentile(c, 50),
+                    (unsigned long)benchWaitPercentile(c, 99));
+        }
+        printf("stats most queued %zu interactive %zu bulk\n",
+                stats->high_water[MBOX_WORKER_INTERACTIVE],
+                stats->high_water[MBOX_WORKER_BULK]);
+        mboxRuntimeStatsRelease(stats);
+    }
+
+    mboxRelease(m);
+    mboxRuntimeRelease(rt);
+    unlink(path);
+}
+
+/* Drop the file from the page cache so every run starts cold */
+#define BENCH_YEAR_MS (365L * 24 * 60 * 60 * 1000)
+
+/* A year of mail from tens of thousands of senders at a thousand domains,
+ * messages parsed from a file would look much the same */
+static void
+benchMakeMessages(mboxList *l)
+{
+    srand(42);
+    for (size_t i = 0; i < BENCH_TABLE_MSGS; ++i) {
+        mboxMsgLite *msg = (mboxMsgLite *)calloc(1, sizeof(mboxMsgLite));
+        int sender = rand() % BENCH_TABLE_SENDERS;
+        msg->from = mboxBufAlloc(64);
+        mboxBufCatPrintf(msg->from, "User %d <user%d@domain%d.com>", sender,
+                sender, sender % BENCH_TABLE_DOMAINS);
+        msg->subject = mboxBufAlloc(64);
+        mboxBufCatPrintf(msg->subject, "Issue %zu", i);
+        msg->unix_timestamp = ((long)rand() * 1000) % BENCH_YEAR_MS;
+        msg->start = i * 1024;
+        msg->end = msg->start + 1024;
+        msg->sender_id = MBOX_INTERN_NONE;
+        msg->domain_id = MBOX_INTERN_NONE;
+        mboxListAddTail(l, msg);
+    }
+}
+
+/* Date range and sender scans over a list of messages against the same
+ * messages in a table, best of a few runs. The range is about a month and
+ * the sender one domain */
+static void
+benchTable(void)
+{
+    struct timeval timer;
+    mboxList *l = mboxListNew();
+    mboxMsgTable *t = NULL;
+    size_t *rows = (size_t *)malloc(sizeof(size_t) * BENCH_TABLE_MSGS);
+    long from = BENCH_YEAR_MS / 2, to = from + BENCH_YEAR_MS / 12;
+    char *sender = "@domain7.com";
+    double best[4] = { 0, 0, 0, 0 };
+    size_t counts[4] = { 0, 0, 0, 0 };
+
+    benchMakeMessages(l);
+    mboxTimerStart(&timer);
+    t = mboxMsgTableFromList(l);
+    double build_ms = mboxTimerEnd(&timer);
+
+    for (int run = 0; run < BENCH_TABLE_RUNS; ++run) {
+        double ms[4];
+        mboxLNode *n = l->root;
+        size_t count = 0;
+
+        mboxTimerStart(&timer);
+        for (size_t i = 0; i < l->len; ++i) {
+            mboxMsgLite *msg = (mboxMsgLite *)n->data;
+            if (msg->unix_timestamp >= from && msg->unix_timestamp < to) {
+                rows[count++] = i;
+            }
+            n = n->next;
+        }
+        ms[0] = mboxTimerEnd(&timer);
+        counts[0] = count;
+
+        mboxTimerStart(&timer);
+        counts[1] = mboxMsgTableFilterByDate(t, from, to, rows);
+        ms[1] = mboxTimerEnd(&timer);
+
+        mboxTimerStart(&timer);
+        mboxList *filtered = mboxMsgListFilterBySender(l, sender);
+        ms[2] = mboxTimerEnd(&timer);
+        counts[2] = filtered->len;
+        mboxListRelease(filtered);
+
+        mboxTimerStart(&timer);
+        counts[3] = mboxMsgTableFilterBySender(t, sender, rows);
+        ms[3] = mboxTimerEnd(&timer);
+
+        for (int i = 0; i < 4; ++i) {
+            if (run == 0 || ms[i] < best[i]) {
+                best[i] = ms[i];
+            }
+        }
+    }
+
+    printf("table build        %8.2f ms (%zu messages)\n", build_ms, t->len);
+    printf("date   list %8.2f ms table %8.2f ms (%zu matched)\n", best[0],
+            best[1], counts[1]);
+    printf("sender list %8.2f ms table %8.2f ms (%zu matched)\n", best[2],
+            best[3], counts[3]);
+    if (counts[0] != counts[1] || counts[2] != counts[3]) {
+        printf("table scans disagree with the list\n");
+    }
+
+    mboxMsgTableRelease(t);
+    mboxListSetFreedata(l, (mboxListFreeData *)mboxMsgLiteRelease);
+    mboxListRelease(l);
+    free(rows);
+}
+
+/* Filtering by sender with a substring search of every message's From
+ * header against matching each distinct address once and comparing ids */
+static void
+benchIntern(void)
+{
+    struct timeval timer;
+    mboxList *l = mboxListNew();
+    mboxIntern *d = mboxInternNew();
+    char *sender = "@domain7.com";
+    double best[3] = { 0, 0, 0 };
+    size_t counts[3] = { 0, 0, 0 };
+
+    benchMakeMessages(l);
+    mboxTimerStart(&timer);
+    mboxMsgListIntern(l, d);
+    double intern_ms = mboxTimerEnd(&timer);
+
+    for (int run = 0; run < BENCH_TABLE_RUNS; ++run) {
+        mboxList *filtered[3];
+        double ms[3];
+
+        mboxTimerStart(&timer);
+        filtered[0] = mboxMsgListFilterBySender(l, sender);
+        ms[0] = mboxTimerEnd(&timer);
+
+        mboxTimerStart(&timer);
+        filtered[1] = mboxMsgListFilterBySenderInterned(l, d, sender);
+        ms[1] = mboxTimerEnd(&timer);
+
+        mboxTimerStart(&timer);
+        filtered[2] = mboxMsgListFilterByDomain(l, d, sender + 1);
+        ms[2] = mboxTimerEnd(&timer);
+
+        for (int i = 0; i < 3; ++i) {
+            counts[i] = filtered[i]->len;
+            mboxListRelease(filtered[i]);
+            if (run == 0 || ms[i] < best[i]) {
+                best[i] = ms[i];
+            }
+        }
+    }
+
+    printf("intern             %8.2f ms (%zu messages, %zu distinct)\n",
+            intern_ms, l->len, mboxInternLen(d));
+    printf("sender kmp %8.2f ms interned %8.2f ms domain %8.2f ms (%zu "
+           "matched)\n",
+            best[0], best[1], best[2], counts[1]);
+    if (counts[0] != counts[1] || counts[1] != counts[2]) {
+        printf("interned filters disagree with the list\n");
+    }
+
+    mboxInternRelease(d);
+    mboxListSetFreedata(l, (mboxListFreeData *)mboxMsgLiteRelease);
+    mboxListRelease(l);
+}
+
+typedef struct benchMemThread {
+    pthread_t th;
+    int pool; /* mboxMemPool rather than malloc */
+    size_t ops;
+    /* Freed on the next thread along, like a message parsed on one thread
+     * and released on another */
+    void **handoff;
+} benchMemThread;
+
+/* Sizes like a parse asks for: mostly list nodes, headers and small buffers
+ * and now and then a preview or a longer header */
+static size_t
+benchMemSize(unsigned int *seed)
+{
+    unsigned int r = rand_r(seed);
+    if ((r & 7) == 0) {
+        return 256 + (r >> 8) % 768;
+    }
+    return 16 + (r >> 8) % 112;
+}
+
+/* Keep BENCH_MEM_LIVE objects alive, replacing one at random each op */
+static void *
+benchMemChurn(void *argv)
+{
+    benchMemThread *t = (benchMemThread *)argv;
+    void *live[BENCH_MEM_LIVE];
+    unsigned int seed = 42;
+
+    for (size_t i = 0; i < BENCH_MEM_LIVE; ++i) {
+        size_t size = benchMemSize(&seed);
+        live[i] = t->pool ? mboxMemPoolAlloc(size) : malloc(size);
+    }
+    for (size_t i = 0; i < t->ops; ++i) {
+        size_t slot = rand_r(&seed) % BENCH_MEM_LIVE;
+        size_t size = benchMemSize(&seed);
+        if (t->pool) {
+            mboxMemPoolFree(live[slot]);
+            live[slot] = mboxMemPoolAlloc(size);
+        } else {
+            free(live[slot]);
+            live[slot] = malloc(size);
+        }
+        ((char *)live[slot])[0] = 1;
+    }
+    for (size_t i = 0; i < BENCH_MEM_LIVE; ++i) {
+        if (t->handoff) {
+            t->handoff[i] = live[i];
+        } else if (t->pool) {
+            mboxMemPoolFree(live[i]);
+        } else {
+            free(live[i]);
+        }
+    }
+    return NULL;
+}
+
+static void
+benchMemOne(int pool, size_t thread_count)
+{
+    struct timeval timer;
+    benchMemThread threads[BENCH_MEM_THREADS];
+    void **handoff = (void **)malloc(sizeof(void *) * BENCH_MEM_LIVE *
+            thread_count);
+
+    mboxTimerStart(&timer);
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads[i].pool = pool;
+        threads[i].ops = BENCH_MEM_OPS / thread_count;
+        threads[i].handoff = handoff + i * BENCH_MEM_LIVE;
+        pthread_create(&threads[i].th, NULL, benchMemChurn, &threads[i]);
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        pthread_join(threads[i].th, NULL);
+    }
+    /* Everyone's leftovers freed here */
+    for (size_t i = 0; i < BENCH_MEM_LIVE * thread_count; ++i) {
+        if (pool) {
+            mboxMemPoolFree(handoff[i]);
+        } else {
+            free(handoff[i]);
+        }
+    }
+    double ms = mboxTimerEnd(&timer);
+
+    printf("alloc %-6s %zu threads %8.1f ns/op\n", pool ? "pool" : "malloc",
+            thread_count, (ms * 1000000.0) / BENCH_MEM_OPS);
+    free(handoff);
+}
+
+/* Replacing small objects at random against glibc malloc, on one thread and
+ * several */
+static void
+benchMem(void)
+{
+    benchMemOne(0, 1);
+    benchMemOne(1, 1);
+    benchMemOne(0, BENCH_MEM_THREADS);
+    benchMemOne(1, BENCH_MEM_THREADS);
+    printf("alloc pool reserved %zu KB\n", mboxMemPoolReserved() / 1024);
+}
+
+/* Resident set in KB */
+static long
+benchResidentKB(void)
+{
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp) {
+        if (fscanf(fp, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+benchLazyOne(char *name, char *path, mbox *(*openfn)(char *, int), int lazy)
+{
+    struct timeval timer;
+    double best = 0;
+    double fetch = 0;
+    long held = 0;
+    size_t count = 0;
+
+    for (int run = 0; run < BENCH_LAZY_RUNS; ++run) {
+        long before = benchResidentKB();
+        mbox *m = openfn(path, 0666);
+        mboxList *msgs = NULL;
+        mboxLNode *n = NULL;
+
+        mboxSetLazy(m, lazy);
+        mboxTimerStart(&timer);
+        msgs = mboxParse(m, BENCH_PARSE_THREADS);
+        double ms = mboxTimerEnd(&timer);
+        held = benchResidentKB() - before;
+        count = msgs->len;
+
+        /* What it costs when something does want a field */
+        n = msgs->root;
+        mboxTimerStart(&timer);
+        for (size_t i = 0; i < msgs->len; ++i, n = n->next) {
+            mboxMsgLiteField(m, (mboxMsgLite *)n->data, MBOX_FIELD_SUBJECT);
+        }
+        fetch = mboxTimerEnd(&timer);
+
+        if (run == 0 || ms < best) {
+            best = ms;
+        }
+        mboxRelease(m);
+    }
+
+    printf("parse %-12s %8.2f ms %8ld KB held, subjects after %8.2f ms (%zu "
+           "messages)\n",
+            name, best, held, fetch, count);
+}
+
+/* Decoding every field while parsing against only finding where they are,
+ * with the file in the page cache */
+static void
+benchLazy(void)
+{
+    char path[] = "/tmp/mbox-bench-XXXXXX";
+
+    if (benchWriteMbox(path, BENCH_LAZY_SIZE)) {
+        benchLazyOne("eager", path, mboxReadOpen, 0);
+        benchLazyOne("lazy", path, mboxReadOpen, 1);
+        benchLazyOne("eager mapped", path, mboxReadOpenMapped, 0);
+        benchLazyOne("lazy mapped", path, mboxReadOpenMapped, 1);
+        unlink(path);
+    }
+}
+
+static void
+benchEvict(char *path)
+{
+    int fd = open(path, O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/* How much of the file is sitting in the page cache */
+static double
+benchCachedPercent(char *path)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    size_t pages = 0;
+    size_t cached = 0;
+    unsigned char *vec = NULL;
+    void *map = NULL;
+
+    fstat(fd, &st);
+    pages = (st.st_size + page - 1) / page;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    vec = malloc(pages);
+    mincore(map, st.st_size, vec);
+    for (size_t i = 0; i < pages; ++i) {
+        cached += vec[i] & 1;
+    }
+    free(vec);
+    munmap(map, st.st_size);
+    close(fd);
+    return pages ? (100.0 * cached) / pages : 0;
+}
+
+/* Read the whole file front to back the same way the parser does */
+static void
+benchReadOne(char *name, char *path, int direct)
+{
+    struct timeval timer;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    int direct_fd = -1;
+    mboxIOCtx *ioctx = NULL;
+    size_t offset = 0;
+    ssize_t rbytes = 0;
+
+    fstat(fd, &st);
+    ioctx = mboxIONew(fd, st.st_size);
+
+    if (direct) {
+#ifdef O_DIRECT
+        direct_fd = open(path, O_RDONLY | O_DIRECT);
+#endif
+        if (direct_fd == -1) {
+            printf("read %-8s unsupported on this filesystem\n", name);
+            mboxIORelease(ioctx);
+            close(fd);
+            return;
+        }
+        mboxIOSetDirect(ioctx, direct_fd);
+    }
+
+    benchEvict(path);
+    mboxTimerStart(&timer);
+    while ((rbytes = mboxIORead(ioctx, MBOX_IO_READ_SIZE, 0, offset)) > 0) {
+        offset += rbytes;
+        mboxIOReset(ioctx);
+    }
+    double ms = mboxTimerEnd(&timer);
+
+    printf("read %-8s %8.2f MB/s (%zu bytes, %.0f%% of the file left in the "
+           "page cache)\n",
+            name, ((double)offset / (1024 * 1024)) / (ms / 1000.0), offset,
+            benchCachedPercent(path));
+
+    mboxIORelease(ioctx);
+    if (direct_fd != -1) {
+        close(direct_fd);
+    }
+    close(fd);
+}
+
+static void
+benchParseOne(char *name, char *path, mbox *(*openfn)(char *, int))
+{
+    struct timeval timer;
+    mbox *m = NULL;
+    mboxList *msgs = NULL;
+
+    benchEvict(path);
+    mboxTimerStart(&timer);
+    m = openfn(path, 0666);
+    msgs = mboxParse(m, BENCH_PARSE_THREADS);
+    double ms = mboxTimerEnd(&timer);
+
+    printf("parse %-7s %8.2f ms (%zu messages, %.0f%% of the file left in the "
+           "page cache)\n",
+            name, ms, msgs->len, benchCachedPercent(path));
+}
+
+/* Cold reads, buffered against O_DIRECT */
+static void
+benchRead(char *path)
+{
+    benchReadOne("buffered", path, 0);
+    benchReadOne("direct", path, 1);
+    benchParseOne("buffered", path, mboxReadOpen);
+    benchParseOne("direct", path, mboxReadOpenDirect);
+}
+
+int
+main(int argc, char **argv)
+{
+    benchScan();
+    benchPool();
+    benchOpen();
+    benchBalance();
+    benchStats();
+    benchTable();
+    benchIntern();
+    benchMem();
+    benchLazy();
+    if (argc > 1) {
+        benchRead(argv[1]);
+    }
+}
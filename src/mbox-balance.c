@@ -0,0 +1,122 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mbox-balance.h"
+
+size_t
+mboxBalanceInit(mboxBalance *b, int mode, size_t threads, size_t ranges)
+{
+    b->mode = mode;
+    b->threads = threads > 0 ? threads : 1;
+    b->max_readers = ranges < b->threads ? ranges : b->threads;
+    if (b->max_readers < 1) {
+        b->max_readers = 1;
+    }
+    b->readers = b->threads / 2 > 0 ? b->threads / 2 : 1;
+    if (b->readers > b->max_readers || mode == MBOX_BALANCE_FUSED) {
+        b->readers = b->max_readers;
+    }
+    b->backlog = 0;
+    b->io_ns = 0;
+    b->io_msgs = 0;
+    b->parse_ns = 0;
+    b->parse_msgs = 0;
+    return b->readers;
+}
+
+void
+mboxBalanceRead(mboxBalance *b, size_t msgs, uint64_t ns)
+{
+    __atomic_add_fetch(&b->io_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->io_msgs, msgs, __ATOMIC_RELAXED);
+}
+
+void
+mboxBalanceQueued(mboxBalance *b, size_t msgs)
+{
+    __atomic_add_fetch(&b->backlog, msgs, __ATOMIC_RELAXED);
+}
+
+void
+mboxBalanceParsed(mboxBalance *b, uint64_t ns)
+{
+    __atomic_sub_fetch(&b->backlog, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->parse_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->parse_msgs, 1, __ATOMIC_RELAXED);
+}
+
+/* Both stages keep up with each other when the share of threads reading is
+ * the share of the time per message spent reading. A backlog means the
+ * parsers are behind whatever the timings say, they may be sharing the cpus
+ * with something else */
+static size_t
+mboxBalanceTarget(mboxBalance *b, size_t readers)
+{
+    uint64_t io_ns = __atomic_load_n(&b->io_ns, __ATOMIC_RELAXED);
+    uint64_t io_msgs = __atomic_load_n(&b->io_msgs, __ATOMIC_RELAXED);
+    uint64_t parse_ns = __atomic_load_n(&b->parse_ns, __ATOMIC_RELAXED);
+    uint64_t parse_msgs = __atomic_load_n(&b->parse_msgs, __ATOMIC_RELAXED);
+    size_t backlog = __atomic_load_n(&b->backlog, __ATOMIC_RELAXED);
+    size_t high = MBOX_BALANCE_BACKLOG * b->threads;
+    size_t target = readers;
+
+    if (io_msgs > 0 && parse_msgs > 0 && io_ns > 0 && parse_ns > 0) {
+        double io_cost = (double)io_ns / io_msgs;
+        double parse_cost = (double)parse_ns / parse_msgs;
+        target = (size_t)(b->threads * io_cost / (io_cost + parse_cost) +
+                0.5);
+    }
+
+    /* Between half and all of the limit nothing moves either way, otherwise
+     * the timings and the backlog pull it back and forth */
+    if (backlog > high && target >= readers) {
+        target = readers - 1;
+    } else if (backlog > high / 2 && target > readers) {
+        target = readers;
+    }
+
+    if (target < 1) {
+        target = 1;
+    } else if (target > b->max_readers) {
+        target = b->max_readers;
+    }
+    return target;
+}
+
+/* One reader at a time moves over, so a noisy measurement can't swing the
+ * whole parse one way */
+int
+mboxBalanceStep(mboxBalance *b)
+{
+    size_t readers = __atomic_load_n(&b->readers, __ATOMIC_RELAXED);
+    size_t target = 0;
+
+    if (b->mode != MBOX_BALANCE_ADAPTIVE) {
+        return MBOX_BALANCE_KEEP;
+    }
+
+    target = mboxBalanceTarget(b, readers);
+    if (target < readers &&
+            __atomic_compare_exchange_n(&b->readers, &readers, readers - 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return MBOX_BALANCE_RETIRE;
+    }
+    if (target > readers &&
+            __atomic_compare_exchange_n(&b->readers, &readers, readers + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return MBOX_BALANCE_SPAWN;
+    }
+    return MBOX_BALANCE_KEEP;
+}
+
+void
+mboxBalanceReaderExit(mboxBalance *b)
+{
+    __atomic_sub_fetch(&b->readers, 1, __ATOMIC_RELAXED);
+}
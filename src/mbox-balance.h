@@ -0,0 +1,70 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_BALANCE_H
+#define __MBOX_BALANCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How a parse splits its threads between reading the file to find messages
+ * and parsing the headers of what was found. Adaptive watches how long each
+ * takes per message and how many found messages are waiting to be parsed,
+ * and moves threads from one to the other as it goes. Fixed reads with half
+ * of them for the whole parse. Fused doesn't split them, every thread reads
+ * and parses each message it finds straight away while it is still in its
+ * cache */
+#define MBOX_BALANCE_ADAPTIVE (0)
+#define MBOX_BALANCE_FIXED (1)
+#define MBOX_BALANCE_FUSED (2)
+
+/* Found messages waiting to be parsed, per thread, before readers start
+ * handing their threads over to parsing whatever the timings say */
+#define MBOX_BALANCE_BACKLOG (64)
+
+/* What a reader should do after finishing a range */
+#define MBOX_BALANCE_KEEP (0)
+#define MBOX_BALANCE_RETIRE (1) /* Stop, the thread is better off parsing */
+#define MBOX_BALANCE_SPAWN (2)  /* Carry on and start another reader */
+
+typedef struct mboxBalance {
+    int mode;
+    size_t threads;      /* How many threads the parse may keep busy */
+    size_t max_readers;  /* No more than there are ranges */
+    size_t readers;      /* Readers running */
+    size_t backlog;      /* Messages found and not yet parsed */
+    uint64_t io_ns;      /* Time spent reading ranges */
+    uint64_t io_msgs;    /* Messages found in them */
+    uint64_t parse_ns;   /* Time spent parsing messages */
+    uint64_t parse_msgs; /* Messages parsed */
+} mboxBalance;
+
+/* Returns how many readers to start with */
+size_t mboxBalanceInit(mboxBalance *b, int mode, size_t threads,
+        size_t ranges);
+
+/* A reader finished a range */
+void mboxBalanceRead(mboxBalance *b, size_t msgs, uint64_t ns);
+/* Messages handed to be parsed, and one parsed */
+void mboxBalanceQueued(mboxBalance *b, size_t msgs);
+void mboxBalanceParsed(mboxBalance *b, uint64_t ns);
+
+/* Called by a reader between ranges, returns one of MBOX_BALANCE_KEEP,
+ * RETIRE or SPAWN. Retiring or spawning has already been counted */
+int mboxBalanceStep(mboxBalance *b);
+
+/* A reader stopped because there was nothing left to read */
+void mboxBalanceReaderExit(mboxBalance *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,15 +13,16 @@
 
 #include "mbox-buf.h"
 #include "mbox-logger.h"
+#include "mbox-memory.h"
 
 mboxBuf *
 mboxBufAlloc(size_t capacity)
 {
-    mboxBuf *buf = malloc(sizeof(mboxBuf));
+    mboxBuf *buf = mboxMemAlloc(sizeof(mboxBuf));
     buf->capacity = capacity + 10;
     buf->len = 0;
     buf->offset = 0;
-    buf->data = malloc(sizeof(mboxChar) * buf->capacity);
+    buf->data = mboxMemAlloc(sizeof(mboxChar) * buf->capacity);
     return buf;
 }
 
@@ -29,8 +30,8 @@ void
 mboxBufRelease(mboxBuf *buf)
 {
     if (buf) {
-        free(buf->data);
-        free(buf);
+        mboxMemFree(buf->data);
+        mboxMemFree(buf);
     }
 }
 
@@ -148,7 +149,7 @@ mboxBufExtendBuffer(mboxBuf *buf, unsigned int additional)
     }
 
     mboxChar *_str = buf->data;
-    mboxChar *tmp = (mboxChar *)realloc(_str, new_capacity);
+    mboxChar *tmp = (mboxChar *)mboxMemRealloc(_str, new_capacity);
 
     if (tmp == NULL) {
         return 0;
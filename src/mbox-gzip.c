@@ -0,0 +1,600 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbox-gzip.h"
+#include "mbox-logger.h"
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#include <zlib.h>
+
+/* How far back deflate can refer, the history a checkpoint needs */
+#define MBOX_GZ_WINDOW (32768)
+/* Compressed bytes read at a time */
+#define MBOX_GZ_IN_SIZE (256 * 1024)
+/* Inflated bytes kept at a time. The parser reads a chunk to find where a
+ * message starts and then reads again from there, this is big enough that the
+ * second read does not mean starting over */
+#define MBOX_GZ_OUT_SIZE (1024 * 1024)
+
+#define MBOX_GZ_INDEX_MAGIC "MBOXGZ01"
+
+typedef struct mboxGzPoint {
+    uint64_t out; /* Offset in the inflated data */
+    uint64_t in;  /* Offset of the first whole byte of the block in the file */
+    uint32_t bits; /* How many bits of the byte before `in` are in the block */
+    unsigned char window[MBOX_GZ_WINDOW]; /* Inflated data before `out` */
+} mboxGzPoint;
+
+struct mboxGzIndex {
+    mboxGzPoint *points;
+    size_t len;
+    size_t capacity;
+    uint64_t size;     /* Inflated size of the whole file */
+    uint64_t gz_size;  /* So we can tell if the file has changed */
+    int64_t gz_mtime;
+};
+
+struct mboxGzReader {
+    int fd;
+    int raw;   /* Started from a checkpoint so there are no gzip headers until
+                  the next member */
+    int eof;   /* Nothing more will come out */
+    z_stream strm;
+    unsigned char *in;
+    size_t in_offset;    /* Where the next read of the file goes from */
+    unsigned char *out;  /* MBOX_GZ_WINDOW of history then the output */
+    size_t hist_len;     /* History bytes before the output */
+    size_t out_len;      /* Inflated bytes in the output */
+    size_t out_start;    /* Where the output is in the inflated data */
+    mboxGzIndex *index;  /* Checkpoints to start from, borrowed */
+    mboxGzIndex *record; /* Checkpoints being recorded */
+};
+
+static mboxGzIndex *
+mboxGzIndexNew(void)
+{
+    mboxGzIndex *idx = (mboxGzIndex *)malloc(sizeof(mboxGzIndex));
+    idx->points = NULL;
+    idx->len = 0;
+    idx->capacity = 0;
+    idx->size = 0;
+    idx->gz_size = 0;
+    idx->gz_mtime = 0;
+    return idx;
+}
+
+void
+mboxGzIndexRelease(mboxGzIndex *idx)
+{
+    if (idx) {
+        free(idx->points);
+        free(idx);
+    }
+}
+
+size_t
+mboxGzIndexSize(mboxGzIndex *idx)
+{
+    return idx->size;
+}
+
+size_t
+mboxGzIndexLen(mboxGzIndex *idx)
+{
+    return idx->len;
+}
+
+size_t
+mboxGzIndexOffset(mboxGzIndex *idx, size_t i)
+{
+    return idx->points[i].out;
+}
+
+static mboxGzPoint *
+mboxGzIndexAdd(mboxGzIndex *idx)
+{
+    if (idx->len == idx->capacity) {
+        idx->capacity = idx->capacity ? idx->capacity * 2 : 16;
+        idx->points = (mboxGzPoint *)realloc(idx->points,
+                sizeof(mboxGzPoint) * idx->capacity);
+    }
+    return &idx->points[idx->len++];
+}
+
+/* Last checkpoint at or before `offset` */
+static mboxGzPoint *
+mboxGzIndexFind(mboxGzIndex *idx, size_t offset)
+{
+    size_t lo = 0;
+    size_t hi = 0;
+
+    if (idx == NULL || idx->len == 0 || idx->points[0].out > offset) {
+        return NULL;
+    }
+
+    hi = idx->len;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->points[mid].out <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return &idx->points[lo];
+}
+
+int
+mboxGzIndexSave(mboxGzIndex *idx, char *path, int fd)
+{
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp = malloc(tmp_len);
+    struct stat st;
+    uint64_t count = idx->len;
+    FILE *fp = NULL;
+    int ok = 0;
+
+    if (fstat(fd, &st) != 0) {
+        free(tmp);
+        return 0;
+    }
+    idx->gz_size = st.st_size;
+    idx->gz_mtime = st.st_mtime;
+
+    /* Write it to the side and move it over so a reader never sees half a
+     * file */
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+
+    if (fp == NULL) {
+        loggerDebug("Failed to open %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return 0;
+    }
+
+    ok = fwrite(MBOX_GZ_INDEX_MAGIC, 8, 1, fp) == 1 &&
+            fwrite(&idx->gz_size, sizeof(uint64_t), 1, fp) == 1 &&
+            fwrite(&idx->gz_mtime, sizeof(int64_t), 1, fp) == 1 &&
+            fwrite(&idx->size, sizeof(uint64_t), 1, fp) == 1 &&
+            fwrite(&count, sizeof(uint64_t), 1, fp) == 1;
+
+    for (size_t i = 0; ok && i < idx->len; ++i) {
+        mboxGzPoint *p = &idx->points[i];
+        ok = fwrite(&p->out, sizeof(uint64_t), 1, fp) == 1 &&
+                fwrite(&p->in, sizeof(uint64_t), 1, fp) == 1 &&
+                fwrite(&p->bits, sizeof(uint32_t), 1, fp) == 1 &&
+                fwrite(p->window, MBOX_GZ_WINDOW, 1, fp) == 1;
+    }
+
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+
+    if (ok && rename(tmp, path) != 0) {
+        ok = 0;
+    }
+
+    if (!ok) {
+        loggerDebug("Failed to save checkpoints to %s\n", path);
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+mboxGzIndex *
+mboxGzIndexLoad(char *path, int fd)
+{
+    char magic[8];
+    struct stat st;
+    uint64_t count = 0;
+    mboxGzIndex *idx = NULL;
+    FILE *fp = NULL;
+    int ok = 0;
+
+    if (fstat(fd, &st) != 0 || (fp = fopen(path, "rb")) == NULL) {
+        return NULL;
+    }
+
+    idx = mboxGzIndexNew();
+    ok = fread(magic, 8, 1, fp) == 1 &&
+            memcmp(magic, MBOX_GZ_INDEX_MAGIC, 8) == 0 &&
+            fread(&idx->gz_size, sizeof(uint64_t), 1, fp) == 1 &&
+            fread(&idx->gz_mtime, sizeof(int64_t), 1, fp) == 1 &&
+            fread(&idx->size, sizeof(uint64_t), 1, fp) == 1 &&
+            fread(&count, sizeof(uint64_t), 1, fp) == 1;
+
+    /* The gzip file has been replaced since */
+    if (ok && (idx->gz_size != (uint64_t)st.st_size ||
+                      idx->gz_mtime != (int64_t)st.st_mtime)) {
+        loggerDebug("Checkpoints in %s are stale\n", path);
+        ok = 0;
+    }
+
+    for (uint64_t i = 0; ok && i < count; ++i) {
+        mboxGzPoint *p = mboxGzIndexAdd(idx);
+        ok = fread(&p->out, sizeof(uint64_t), 1, fp) == 1 &&
+                fread(&p->in, sizeof(uint64_t), 1, fp) == 1 &&
+                fread(&p->bits, sizeof(uint32_t), 1, fp) == 1 &&
+                fread(p->window, MBOX_GZ_WINDOW, 1, fp) == 1 && p->bits < 8;
+    }
+
+    fclose(fp);
+
+    if (!ok) {
+        mboxGzIndexRelease(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+/* Back to the start of the file */
+static void
+mboxGzReaderRewind(mboxGzReader *r)
+{
+    inflateReset2(&r->strm, 15 + 16);
+    r->raw = 0;
+    r->eof = 0;
+    r->strm.avail_in = 0;
+    r->in_offset = 0;
+    r->hist_len = 0;
+    r->out_len = 0;
+    r->out_start = 0;
+}
+
+/* Pick up from a checkpoint, it is in the middle of the deflate data so there
+ * is no header and we hand over the history it would have built up */
+static int
+mboxGzReaderRestart(mboxGzReader *r, mboxGzPoint *p)
+{
+    unsigned char ch = 0;
+
+    inflateReset2(&r->strm, -15);
+    r->raw = 1;
+    r->eof = 0;
+    r->strm.avail_in = 0;
+    r->in_offset = p->in;
+
+    if (p->bits) {
+        if (pread(r->fd, &ch, 1, p->in - 1) != 1) {
+            return 0;
+        }
+        inflatePrime(&r->strm, p->bits, ch >> (8 - p->bits));
+    }
+    inflateSetDictionary(&r->strm, p->window, MBOX_GZ_WINDOW);
+
+    r->hist_len = 0;
+    r->out_len = 0;
+    r->out_start = p->out;
+    return 1;
+}
+
+mboxGzReader *
+mboxGzReaderNew(int fd, mboxGzIndex *idx, int record)
+{
+    mboxGzReader *r = (mboxGzReader *)malloc(sizeof(mboxGzReader));
+
+    r->fd = fd;
+    r->strm.zalloc = Z_NULL;
+    r->strm.zfree = Z_NULL;
+    r->strm.opaque = Z_NULL;
+    r->strm.next_in = Z_NULL;
+    r->strm.avail_in = 0;
+
+    if (inflateInit2(&r->strm, 15 + 16) != Z_OK) {
+        free(r);
+        return NULL;
+    }
+
+    r->in = (unsigned char *)malloc(MBOX_GZ_IN_SIZE);
+    r->out = (unsigned char *)malloc(MBOX_GZ_WINDOW + MBOX_GZ_OUT_SIZE);
+    r->index = idx;
+    r->record = record ? mboxGzIndexNew() : NULL;
+    mboxGzReaderRewind(r);
+    return r;
+}
+
+void
+mboxGzReaderRelease(mboxGzReader *r)
+{
+    if (r) {
+        inflateEnd(&r->strm);
+        mboxGzIndexRelease(r->record);
+        free(r->in);
+        free(r->out);
+        free(r);
+    }
+}
+
+mboxGzIndex *
+mboxGzReaderTakeIndex(mboxGzReader *r)
+{
+    mboxGzIndex *idx = NULL;
+
+    if (r->record && r->eof) {
+        idx = r->record;
+        r->record = NULL;
+    }
+    return idx;
+}
+
+/* Returns 0 at the end of the file and -1 on error */
+static ssize_t
+mboxGzReaderReadIn(mboxGzReader *r)
+{
+    ssize_t rbytes = pread(r->fd, r->in, MBOX_GZ_IN_SIZE, r->in_offset);
+
+    if (rbytes > 0) {
+        r->in_offset += rbytes;
+        r->strm.next_in = r->in;
+        r->strm.avail_in = rbytes;
+    }
+    return rbytes;
+}
+
+/* If this is a block boundary far enough on from the last one remember how
+ * to start inflating from here */
+static void
+mboxGzReaderMaybeRecord(mboxGzReader *r)
+{
+    mboxGzIndex *idx = r->record;
+    size_t produced = r->strm.next_out - (r->out + MBOX_GZ_WINDOW);
+    size_t out = r->out_start + produced;
+    size_t history = r->hist_len + produced;
+    mboxGzPoint *p = NULL;
+
+    /* Bit 7 is set at the end of a block header, bit 6 if it was the last */
+    if (!(r->strm.data_type & 128) || (r->strm.data_type & 64)) {
+        return;
+    }
+
+    /* Going over old ground after a rewind */
+    if (idx->len > 0 && out < idx->points[idx->len - 1].out + MBOX_GZ_SPAN) {
+        return;
+    }
+
+    p = mboxGzIndexAdd(idx);
+    p->out = out;
+    p->in = r->in_offset - r->strm.avail_in;
+    p->bits = r->strm.data_type & 7;
+
+    /* Near the start there is less history than a window, the front never
+     * gets referred to */
+    if (history >= MBOX_GZ_WINDOW) {
+        memcpy(p->window, r->strm.next_out - MBOX_GZ_WINDOW, MBOX_GZ_WINDOW);
+    } else {
+        memset(p->window, 0, MBOX_GZ_WINDOW - history);
+        memcpy(p->window + MBOX_GZ_WINDOW - history,
+                r->strm.next_out - history, history);
+    }
+}
+
+/* A member has ended, a gzip file can be several of them back to back */
+static int
+mboxGzReaderNextMember(mboxGzReader *r)
+{
+    /* Raw inflate leaves the member's crc and length behind */
+    size_t skip = r->raw ? 8 : 0;
+
+    while (skip > 0) {
+        if (r->strm.avail_in == 0 && mboxGzReaderReadIn(r) <= 0) {
+            return 0;
+        }
+        size_t n = skip < r->strm.avail_in ? skip : r->strm.avail_in;
+        r->strm.next_in += n;
+        r->strm.avail_in -= n;
+        skip -= n;
+    }
+
+    if (r->strm.avail_in == 0 && mboxGzReaderReadIn(r) <= 0) {
+        return 0;
+    }
+
+    /* Anything other than another member is padding */
+    if (r->strm.next_in[0] != 0x1f) {
+        return 0;
+    }
+
+    inflateReset2(&r->strm, 15 + 16);
+    r->raw = 0;
+    return 1;
+}
+
+/* Inflate the next chunk of output, the end of the current one is kept as
+ * history. Returns how much was inflated, 0 at the end and -1 on error */
+static ssize_t
+mboxGzReaderFill(mboxGzReader *r)
+{
+    size_t keep = r->hist_len + r->out_len;
+    int ret = Z_OK;
+
+    if (keep > MBOX_GZ_WINDOW) {
+        keep = MBOX_GZ_WINDOW;
+    }
+    memmove(r->out + MBOX_GZ_WINDOW - keep,
+            r->out + MBOX_GZ_WINDOW + r->out_len - keep, keep);
+    r->hist_len = keep;
+    r->out_start += r->out_len;
+    r->out_len = 0;
+
+    r->strm.next_out = r->out + MBOX_GZ_WINDOW;
+    r->strm.avail_out = MBOX_GZ_OUT_SIZE;
+
+    while (r->strm.avail_out > 0 && !r->eof) {
+        if (r->strm.avail_in == 0) {
+            ssize_t rbytes = mboxGzReaderReadIn(r);
+            if (rbytes < 0) {
+                return -1;
+            } else if (rbytes == 0) {
+                /* Truncated, give back what we have */
+                r->eof = 1;
+                break;
+            }
+        }
+
+        /* Z_BLOCK stops at each block boundary so we get a look at them */
+        ret = inflate(&r->strm, r->record ? Z_BLOCK : Z_NO_FLUSH);
+
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            loggerDebug("Failed to inflate: %s\n",
+                    r->strm.msg ? r->strm.msg : "unknown");
+            return -1;
+        }
+
+        if (r->record) {
+            mboxGzReaderMaybeRecord(r);
+        }
+
+        if (ret == Z_STREAM_END && !mboxGzReaderNextMember(r)) {
+            r->eof = 1;
+        }
+    }
+
+    r->out_len = MBOX_GZ_OUT_SIZE - r->strm.avail_out;
+
+    if (r->eof && r->record) {
+        r->record->size = r->out_start + r->out_len;
+    }
+    return r->out_len;
+}
+
+ssize_t
+mboxGzRead(mboxGzReader *r, void *dst, size_t size, size_t offset)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        size_t pos = offset + done;
+        size_t out_end = r->out_start + r->out_len;
+        mboxGzPoint *p = NULL;
+
+        if (pos >= r->out_start && pos < out_end) {
+            size_t n = out_end - pos;
+            if (n > size - done) {
+                n = size - done;
+            }
+            memcpy((unsigned char *)dst + done,
+                    r->out + MBOX_GZ_WINDOW + (pos - r->out_start), n);
+            done += n;
+            continue;
+        }
+
+        /* Either go back, or skip forward if a checkpoint gets us closer
+         * than inflating from where we are */
+        p = mboxGzIndexFind(r->index, pos);
+        if (pos < r->out_start || (p && p->out > out_end)) {
+            if (p == NULL) {
+                mboxGzReaderRewind(r);
+            } else if (!mboxGzReaderRestart(r, p)) {
+                return done ? (ssize_t)done : -1;
+            }
+        } else if (r->eof) {
+            break;
+        }
+
+        ssize_t filled = mboxGzReaderFill(r);
+        if (filled < 0) {
+            return done ? (ssize_t)done : -1;
+        } else if (filled == 0 && r->eof) {
+            break;
+        }
+    }
+
+    return done;
+}
+#else
+mboxGzIndex *
+mboxGzIndexLoad(char *path, int fd)
+{
+    (void)path;
+    (void)fd;
+    return NULL;
+}
+
+int
+mboxGzIndexSave(mboxGzIndex *idx, char *path, int fd)
+{
+    (void)idx;
+    (void)path;
+    (void)fd;
+    return 0;
+}
+
+size_t
+mboxGzIndexSize(mboxGzIndex *idx)
+{
+    (void)idx;
+    return 0;
+}
+
+size_t
+mboxGzIndexLen(mboxGzIndex *idx)
+{
+    (void)idx;
+    return 0;
+}
+
+size_t
+mboxGzIndexOffset(mboxGzIndex *idx, size_t i)
+{
+    (void)idx;
+    (void)i;
+    return 0;
+}
+
+void
+mboxGzIndexRelease(mboxGzIndex *idx)
+{
+    (void)idx;
+}
+
+mboxGzReader *
+mboxGzReaderNew(int fd, mboxGzIndex *idx, int record)
+{
+    (void)fd;
+    (void)idx;
+    (void)record;
+    return NULL;
+}
+
+ssize_t
+mboxGzRead(mboxGzReader *r, void *dst, size_t size, size_t offset)
+{
+    (void)r;
+    (void)dst;
+    (void)size;
+    (void)offset;
+    return -1;
+}
+
+mboxGzIndex *
+mboxGzReaderTakeIndex(mboxGzReader *r)
+{
+    (void)r;
+    return NULL;
+}
+
+void
+mboxGzReaderRelease(mboxGzReader *r)
+{
+    (void)r;
+}
+#endif
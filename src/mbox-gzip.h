@@ -0,0 +1,67 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_GZIP_H
+#define __MBOX_GZIP_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reading a gzipped mbox. Offsets everywhere are into the inflated data so the
+ * parser does not know the difference.
+ *
+ * Inflating can only go forwards from the start of the file, unless we have
+ * checkpoints. A checkpoint is the state needed to start inflating from the
+ * middle of the file: where a deflate block starts and the 32k of output
+ * before it. They are recorded on a first full pass and saved to a side file
+ * so later runs can start inflating at several places at once */
+
+/* Uncompressed bytes between checkpoints, the most we inflate and throw away
+ * to get to any offset */
+#define MBOX_GZ_SPAN (4 * 1024 * 1024)
+
+typedef struct mboxGzIndex mboxGzIndex;
+typedef struct mboxGzReader mboxGzReader;
+
+/* Load checkpoints from `path`, returns NULL if there are none or they are
+ * for a different version of the gzip file open on `fd` */
+mboxGzIndex *mboxGzIndexLoad(char *path, int fd);
+
+/* Returns 0 on failure */
+int mboxGzIndexSave(mboxGzIndex *idx, char *path, int fd);
+
+/* Size of the inflated file */
+size_t mboxGzIndexSize(mboxGzIndex *idx);
+/* How many checkpoints there are and where in the inflated file each is,
+ * reading from one of these offsets inflates nothing that is thrown away */
+size_t mboxGzIndexLen(mboxGzIndex *idx);
+size_t mboxGzIndexOffset(mboxGzIndex *idx, size_t i);
+void mboxGzIndexRelease(mboxGzIndex *idx);
+
+/* `idx` is borrowed and can be NULL. If `record` is set checkpoints are
+ * recorded as we go, see mboxGzReaderTakeIndex. Returns NULL if zlib was not
+ * compiled in */
+mboxGzReader *mboxGzReaderNew(int fd, mboxGzIndex *idx, int record);
+
+/* Behaves like pread on the inflated file */
+ssize_t mboxGzRead(mboxGzReader *r, void *dst, size_t size, size_t offset);
+
+/* If the reader inflated the whole file while recording, hands back the
+ * checkpoints it recorded. Otherwise NULL */
+mboxGzIndex *mboxGzReaderTakeIndex(mboxGzReader *r);
+
+void mboxGzReaderRelease(mboxGzReader *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
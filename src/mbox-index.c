@@ -20,8 +20,12 @@
 #include "mbox-logger.h"
 #include "mbox-memory.h"
 #include "mbox-msg.h"
+#include "mbox-runtime.h"
 #include "mbox-worker.h"
 
+/* How many batches of messages go to the runtime at a time when loading */
+#define MBOX_IDX_ENQUEUE_BATCH (64)
+
 typedef struct mboxIdxOffset {
     ssize_t start;
     ssize_t end;
@@ -35,6 +39,22 @@ mboxListSortByStartOffset(void *d1, void *d2)
     return start1 < start2 ? -1 : start1 == start2 ? 0 : 1;
 }
 
+/* Lists from a parse or a load are already in file order, only one that has
+ * since been sorted some other way needs sorting again */
+static int
+mboxIdxInFileOrder(mboxList *l)
+{
+    mboxLNode *node = l->root;
+
+    for (size_t i = 1; i < l->len; ++i) {
+        if (mboxListSortByStartOffset(node->data, node->next->data) > 0) {
+            return 0;
+        }
+        node = node->next;
+    }
+    return 1;
+}
+
 static int
 mboxIdxTryWrite(mboxIOCtx *ioctx)
 {
@@ -90,7 +110,9 @@ mboxIdxSave(char *filename, mboxList *l)
         return 0;
     }
 
-    mboxListQSort(l, mboxListSortByStartOffset);
+    if (!mboxIdxInFileOrder(l)) {
+        mboxListQSort(l, mboxListSortByStartOffset);
+    }
     count = l->len;
     node = l->root;
 
@@ -211,6 +233,13 @@ typedef struct mboxIdxCtx {
     mboxList *msgs;
 } mboxIdxCtx;
 
+/* Offsets of messages close together in the file, loaded by one job into
+ * its own list so they can be put back together in file order */
+typedef struct mboxIdxBatch {
+    mboxList *offsets;
+    mboxList *msgs;
+} mboxIdxBatch;
+
 typedef struct mboxIdxMsgCtx {
     mboxBuf *buf;
     size_t bytes_to_read;
@@ -222,7 +251,8 @@ void
 mboxIdxGetMessages(void *privdata, void *data)
 {
     mboxIdxCtx *idxctx = (mboxIdxCtx *)privdata;
-    mboxList *batch = (mboxList *)data;
+    mboxIdxBatch *idxbatch = (mboxIdxBatch *)data;
+    mboxList *batch = idxbatch->offsets;
 
     /* This is so we can translate the offsets to our buffer */
     ssize_t diff = ((ssize_t *)batch->root->data)[0];
@@ -256,56 +286,100 @@ mboxIdxGetMessages(void *privdata, void *data)
         tmp.len = offset[1] - offset[0];
         tmp.offset = 0;
         tmp.capacity = 0;
-        mboxMsgLite *msg = mboxMsgLiteFromBuffer(&tmp, offset[0], offset[1]);
+        mboxMsgLite *msg = mboxMsgLiteFromBuffer(&tmp, offset[0], offset[1],
+                NULL);
 
         if (msg) {
-            mboxListTSAddTail(idxctx->msgs, msg);
+            mboxListAddTail(idxbatch->msgs, msg);
         }
+        /* Loads are bulk work, let anything interactive in between
+         * messages */
+        mboxWorkerYield();
     } while (batch->len > 0);
 
     free(buf);
     mboxListRelease(batch);
+    idxbatch->offsets = NULL;
+}
+
+static mboxIdxBatch *
+mboxIdxBatchNew(void)
+{
+    mboxIdxBatch *idxbatch = (mboxIdxBatch *)malloc(sizeof(mboxIdxBatch));
+    idxbatch->offsets = mboxListNew();
+    idxbatch->msgs = mboxListNew();
+    return idxbatch;
 }
 
 /* ioctx is a handle on the mbox file we are spamming malloc and free */
 void
-mboxIdxBatchLoad(mboxIdxCtx *idxctx, mboxList *indexes, int thread_count)
+mboxIdxBatchLoad(mboxIdxCtx *idxctx, mboxList *indexes, mboxRuntime *rt)
 {
-    mboxList *batch = mboxListNew();
-    mboxWorkerPool *pool = mboxWorkerPoolNew(thread_count);
+    mboxIdxBatch *batch = mboxIdxBatchNew();
+    mboxList *batches = mboxListNew();
+    mboxWorkerGroup *group = mboxWorkerGroupNew(rt->pool, idxctx);
     ssize_t *offsets = NULL;
     size_t batch_bytes = 0;
     size_t message_size = 0;
-
-    mboxWorkerPoolSetPrivData(pool, idxctx);
+    /* Batches are handed to the runtime a few at a time */
+    void *ready[MBOX_IDX_ENQUEUE_BATCH];
+    size_t ready_len = 0;
 
     do {
         offsets = (ssize_t *)mboxListRemoveHead(indexes);
 
         message_size = offsets[1] - offsets[0];
 
-        mboxListAddTail(batch, offsets);
+        mboxListAddTail(batch->offsets, offsets);
 
         if (batch_bytes + message_size < MBOX_IO_READ_SIZE) {
             batch_bytes += message_size;
         } else {
             /* Spawn threadpool task */
-            mboxWorkerPoolEnqueue(pool, mboxIdxGetMessages, batch);
+            mboxListAddTail(batches, batch);
+            ready[ready_len++] = batch;
+            if (ready_len == MBOX_IDX_ENQUEUE_BATCH) {
+                mboxWorkerGroupEnqueueBatch(group, mboxIdxGetMessages, ready,
+                        ready_len);
+                ready_len = 0;
+            }
             batch_bytes = 0;
-            batch = mboxListNew();
+            batch = mboxIdxBatchNew();
         }
     } while (indexes->len > 0);
 
-    if (batch->len > 0) {
-        mboxWorkerPoolEnqueue(pool, mboxIdxGetMessages, batch);
+    if (batch->offsets->len > 0) {
+        mboxListAddTail(batches, batch);
+        ready[ready_len++] = batch;
+    } else {
+        mboxListRelease(batch->offsets);
+        mboxListRelease(batch->msgs);
+        free(batch);
     }
+    mboxWorkerGroupEnqueueBatch(group, mboxIdxGetMessages, ready, ready_len);
+
+    mboxWorkerGroupWait(group);
+    mboxWorkerGroupRelease(group);
 
-    mboxWorkerPoolWait(pool);
+    /* The index is in file order and so are the batches made from it */
+    while ((batch = (mboxIdxBatch *)mboxListRemoveHead(batches)) != NULL) {
+        mboxListAppendListTail(idxctx->msgs, batch->msgs);
+        free(batch);
+    }
+    mboxListRelease(batches);
 }
 
 /* Load mboxLiteMsg from file indexes and parse based on offsets */
 mboxList *
 mboxIdxLoad(char *idxfile, char *mboxfile, unsigned int thread_count)
+{
+    /* The default runtime is already sized to the machine */
+    (void)thread_count;
+    return mboxIdxLoadWithRuntime(idxfile, mboxfile, mboxRuntimeDefault());
+}
+
+mboxList *
+mboxIdxLoadWithRuntime(char *idxfile, char *mboxfile, mboxRuntime *rt)
 {
     mboxList *indexes = NULL;
     mboxList *msgs = NULL;
@@ -332,7 +406,7 @@ mboxIdxLoad(char *idxfile, char *mboxfile, unsigned int thread_count)
     idxctx->mbox_fd = open(mboxfile, O_RDONLY, 0666);
 
     printf("index count: %zu\n", indexes->len);
-    mboxIdxBatchLoad(idxctx, indexes, thread_count);
+    mboxIdxBatchLoad(idxctx, indexes, rt);
 
     close(idxctx->mbox_fd);
     mboxListRelease(indexes);
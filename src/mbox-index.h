@@ -8,6 +8,7 @@
 #define __MBOX_INDEX_H
 
 #include "mbox-list.h"
+#include "mbox-runtime.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,9 +18,13 @@ extern "C" {
 int mboxIdxSave(char *filename, mboxList *l);
 
 /* Load a list of mboxMsgLite from an mbox-idx file and its corresponding mbox
- * file */
+ * file. Loads on the default runtime, `thread_count` is no longer used */
 mboxList *mboxIdxLoad(char *idxfile, char *mboxfile, unsigned int thread_count);
 
+/* The same on `rt`'s threads */
+mboxList *mboxIdxLoadWithRuntime(char *idxfile, char *mboxfile,
+        mboxRuntime *rt);
+
 #ifdef __cplusplus
 }
 #endif
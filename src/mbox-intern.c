@@ -0,0 +1,260 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbox-buf.h"
+#include "mbox-intern.h"
+#include "mbox-logger.h"
+#include "mbox-memory.h"
+
+#define MBOX_INTERN_MIN_SLOTS (64)
+#define MBOX_INTERN_MAX_IDS \
+    ((size_t)MBOX_INTERN_CHUNK * (size_t)MBOX_INTERN_CHUNKS)
+
+/* FNV-1a, the strings are short and we only need them spread out */
+static uint64_t
+mboxInternHash(const char *s, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)s[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+mboxIntern *
+mboxInternNew(void)
+{
+    mboxIntern *d = (mboxIntern *)malloc(sizeof(mboxIntern));
+
+    for (int i = 0; i < MBOX_INTERN_SHARDS; ++i) {
+        mboxInternShard *shard = &d->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->len = 0;
+        shard->capacity = 0;
+        shard->slots = NULL;
+        shard->strings = mboxArenaNew();
+    }
+    d->next_id = 0;
+    d->chunks = (mboxInternStr **)calloc(MBOX_INTERN_CHUNKS,
+            sizeof(mboxInternStr *));
+    return d;
+}
+
+void
+mboxInternRelease(mboxIntern *d)
+{
+    if (d) {
+        for (int i = 0; i < MBOX_INTERN_SHARDS; ++i) {
+            mboxInternShard *shard = &d->shards[i];
+            pthread_mutex_destroy(&shard->lock);
+            free(shard->slots);
+            mboxArenaRelease(shard->strings);
+        }
+        for (int i = 0; i < MBOX_INTERN_CHUNKS; ++i) {
+            free(d->chunks[i]);
+        }
+        free(d->chunks);
+        free(d);
+    }
+}
+
+static mboxInternStr *
+mboxInternEntry(mboxIntern *d, uint32_t id)
+{
+    mboxInternStr *chunk = __atomic_load_n(&d->chunks[id / MBOX_INTERN_CHUNK],
+            __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[id % MBOX_INTERN_CHUNK] : NULL;
+}
+
+/* Chunks are only ever added, whoever loses the race frees theirs */
+static mboxInternStr *
+mboxInternEntryMake(mboxIntern *d, uint32_t id)
+{
+    mboxInternStr *chunk = mboxInternEntry(d, id);
+    mboxInternStr *expected = NULL;
+
+    if (chunk) {
+        return chunk;
+    }
+
+    chunk = (mboxInternStr *)calloc(MBOX_INTERN_CHUNK, sizeof(mboxInternStr));
+    if (!__atomic_compare_exchange_n(&d->chunks[id / MBOX_INTERN_CHUNK],
+                &expected, chunk, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(chunk);
+        chunk = expected;
+    }
+    return &chunk[id % MBOX_INTERN_CHUNK];
+}
+
+/* With the shard locked, the slot `s` is in or the empty one it would go
+ * in */
+static mboxInternSlot *
+mboxInternProbe(mboxIntern *d, mboxInternShard *shard, uint64_t hash,
+        const char *s, size_t len)
+{
+    size_t mask = shard->capacity - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        mboxInternSlot *slot = &shard->slots[i];
+        if (slot->id == MBOX_INTERN_NONE) {
+            return slot;
+        }
+        if (slot->hash == hash) {
+            mboxInternStr *entry = mboxInternEntry(d, slot->id);
+            if (entry->len == len && !memcmp(entry->str, s, len)) {
+                return slot;
+            }
+        }
+    }
+}
+
+static void
+mboxInternGrow(mboxInternShard *shard)
+{
+    size_t old_capacity = shard->capacity;
+    mboxInternSlot *old = shard->slots;
+    size_t capacity = old_capacity ? old_capacity * 2 : MBOX_INTERN_MIN_SLOTS;
+
+    shard->slots = (mboxInternSlot *)malloc(sizeof(mboxInternSlot) * capacity);
+    if (shard->slots == NULL) {
+        loggerPanic("Failed to grow intern table\n");
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        shard->slots[i].id = MBOX_INTERN_NONE;
+    }
+    shard->capacity = capacity;
+
+    /* Every string is different so only an empty slot needs finding */
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old[i].id != MBOX_INTERN_NONE) {
+            size_t j = old[i].hash & (capacity - 1);
+            while (shard->slots[j].id != MBOX_INTERN_NONE) {
+                j = (j + 1) & (capacity - 1);
+            }
+            shard->slots[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+/* The top bits pick the shard and the bottom bits the slot in it */
+static mboxInternShard *
+mboxInternShardFor(mboxIntern *d, uint64_t hash)
+{
+    return &d->shards[hash >> 58];
+}
+
+uint32_t
+mboxInternAdd(mboxIntern *d, const char *s, size_t len)
+{
+    uint64_t hash = mboxInternHash(s, len);
+    mboxInternShard *shard = mboxInternShardFor(d, hash);
+    mboxInternSlot *slot = NULL;
+    mboxInternStr *entry = NULL;
+    char *copy = NULL;
+    uint32_t id;
+
+    pthread_mutex_lock(&shard->lock);
+    /* No more than 3/4 full */
+    if ((shard->len + 1) * 4 > shard->capacity * 3) {
+        mboxInternGrow(shard);
+    }
+
+    slot = mboxInternProbe(d, shard, hash, s, len);
+    if (slot->id != MBOX_INTERN_NONE) {
+        id = slot->id;
+        pthread_mutex_unlock(&shard->lock);
+        return id;
+    }
+
+    id = __atomic_fetch_add(&d->next_id, 1, __ATOMIC_RELAXED);
+    if (id >= MBOX_INTERN_MAX_IDS) {
+        __atomic_store_n(&d->next_id, MBOX_INTERN_MAX_IDS, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->lock);
+        return MBOX_INTERN_NONE;
+    }
+
+    copy = (char *)mboxArenaAlloc(shard->strings, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    entry = mboxInternEntryMake(d, id);
+    entry->len = len;
+    __atomic_store_n(&entry->str, copy, __ATOMIC_RELEASE);
+
+    slot->hash = hash;
+    slot->id = id;
+    shard->len++;
+    pthread_mutex_unlock(&shard->lock);
+    return id;
+}
+
+uint32_t
+mboxInternFind(mboxIntern *d, const char *s, size_t len)
+{
+    uint64_t hash = mboxInternHash(s, len);
+    mboxInternShard *shard = mboxInternShardFor(d, hash);
+    uint32_t id = MBOX_INTERN_NONE;
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->capacity) {
+        id = mboxInternProbe(d, shard, hash, s, len)->id;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return id;
+}
+
+size_t
+mboxInternLen(mboxIntern *d)
+{
+    size_t len = __atomic_load_n(&d->next_id, __ATOMIC_RELAXED);
+    return len < MBOX_INTERN_MAX_IDS ? len : MBOX_INTERN_MAX_IDS;
+}
+
+/* An id is only handed out once its string is in place, but one being added
+ * right now may have been counted by mboxInternLen and not be there yet */
+const char *
+mboxInternGet(mboxIntern *d, uint32_t id)
+{
+    mboxInternStr *entry = NULL;
+
+    if (id >= mboxInternLen(d)) {
+        return NULL;
+    }
+    entry = mboxInternEntry(d, id);
+    return entry ? __atomic_load_n(&entry->str, __ATOMIC_ACQUIRE) : NULL;
+}
+
+uint64_t *
+mboxInternMatch(mboxIntern *d, char *pattern)
+{
+    size_t len = mboxInternLen(d);
+    size_t patternlen = strlen(pattern);
+    uint64_t *bits = (uint64_t *)calloc(len / 64 + 1, sizeof(uint64_t));
+    int *table = mboxBufComputePrefixTable((mboxChar *)pattern, patternlen);
+    mboxBuf view = { .data = NULL, .offset = 0, .len = 0, .capacity = 0 };
+
+    for (size_t id = 0; id < len; ++id) {
+        const char *str = mboxInternGet(d, id);
+        if (str == NULL) {
+            continue;
+        }
+        view.data = (mboxChar *)str;
+        view.len = view.capacity = mboxInternEntry(d, id)->len;
+        if (mboxBufContainsCasePatternWithTable(&view, table,
+                    (mboxChar *)pattern, patternlen) != -1) {
+            bits[id / 64] |= (uint64_t)1 << (id % 64);
+        }
+    }
+    free(table);
+    return bits;
+}
@@ -0,0 +1,82 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_INTERN_H
+#define __MBOX_INTERN_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mbox-memory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The id of a string that isn't in the dictionary, or of one that didn't fit */
+#define MBOX_INTERN_NONE (UINT32_MAX)
+
+/* Strings are spread over this many tables by their hash, each with its own
+ * lock, so threads adding different strings rarely wait on each other */
+#define MBOX_INTERN_SHARDS (64)
+
+/* Ids are handed out in order from 0 and looked up through a directory of
+ * fixed size chunks which are never moved, so looking one up takes no lock.
+ * Holds MBOX_INTERN_CHUNK * MBOX_INTERN_CHUNKS strings */
+#define MBOX_INTERN_CHUNK (4096)
+#define MBOX_INTERN_CHUNKS (4096)
+
+typedef struct mboxInternStr {
+    const char *str; /* '\0' terminated */
+    uint32_t len;
+} mboxInternStr;
+
+typedef struct mboxInternSlot {
+    uint64_t hash;
+    uint32_t id; /* MBOX_INTERN_NONE if the slot is empty */
+} mboxInternSlot;
+
+typedef struct mboxInternShard {
+    pthread_mutex_t lock;
+    size_t len;
+    size_t capacity; /* Power of 2 */
+    mboxInternSlot *slots;
+    mboxArena *strings;
+} __attribute__((aligned(64))) mboxInternShard;
+
+/* Each distinct string once, with a small integer id. Safe to add to and
+ * look up from any number of threads */
+typedef struct mboxIntern {
+    mboxInternShard shards[MBOX_INTERN_SHARDS];
+    uint32_t next_id;
+    mboxInternStr **chunks; /* MBOX_INTERN_CHUNKS, allocated as needed */
+} mboxIntern;
+
+mboxIntern *mboxInternNew(void);
+void mboxInternRelease(mboxIntern *d);
+
+/* The id of `s`, adding a copy of it if it isn't there already.
+ * MBOX_INTERN_NONE once the dictionary is full */
+uint32_t mboxInternAdd(mboxIntern *d, const char *s, size_t len);
+/* MBOX_INTERN_NONE if it isn't there */
+uint32_t mboxInternFind(mboxIntern *d, const char *s, size_t len);
+/* NULL for an id it didn't hand out */
+const char *mboxInternGet(mboxIntern *d, uint32_t id);
+/* How many ids have been handed out, they are 0 to this - 1 */
+size_t mboxInternLen(mboxIntern *d);
+
+/* A bitmap with a bit set for every id whose string contains `pattern`,
+ * ignoring case. One bit for each of mboxInternLen ids rounded up to 64 */
+uint64_t *mboxInternMatch(mboxIntern *d, char *pattern);
+
+#define mboxInternBit(bits, id) (((bits)[(id) / 64] >> ((id) % 64)) & 1)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
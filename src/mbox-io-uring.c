@@ -0,0 +1,396 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbox-io-uring.h"
+#include "mbox-logger.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+
+#define MBOX_IO_URING_FREE (0)
+#define MBOX_IO_URING_INFLIGHT (1)
+#define MBOX_IO_URING_DONE (2)
+
+/* A chunk of the file we have asked the kernel for */
+typedef struct mboxIOUringSlot {
+    int state;
+    size_t offset;
+    size_t size;
+    ssize_t res;
+    unsigned char *data;
+} mboxIOUringSlot;
+
+struct mboxIOUring {
+    int ring_fd;        /* The io_uring instance */
+    int fd;             /* File we are reading from */
+    unsigned int depth; /* How many slots we have */
+    size_t chunk_size;  /* Size of each slot's buffer */
+    unsigned int queued; /* Submission entries not yet handed to the kernel */
+
+    /* Submission queue, we are the only producer */
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue, we are the only consumer */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    mboxIOUringSlot *slots;
+};
+
+static int
+mboxIOUringSetup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+mboxIOUringEnter(int ring_fd, unsigned int to_submit, unsigned int min_complete,
+        unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+mboxIOUring *
+mboxIOUringNew(int fd, unsigned int depth, size_t chunk_size)
+{
+    struct io_uring_params p;
+    mboxIOUring *ring = NULL;
+    int ring_fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    ring_fd = mboxIOUringSetup(depth, &p);
+
+    if (ring_fd < 0) {
+        loggerDebug("io_uring unavailable: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    ring = (mboxIOUring *)calloc(1, sizeof(mboxIOUring));
+    ring->ring_fd = ring_fd;
+    ring->fd = fd;
+    ring->depth = depth;
+    ring->chunk_size = chunk_size;
+    ring->queued = 0;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Newer kernels let us map both rings in one go */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        goto err;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_len);
+            goto err;
+        }
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_len);
+        if (ring->cq_ptr != ring->sq_ptr) {
+            munmap(ring->cq_ptr, ring->cq_len);
+        }
+        goto err;
+    }
+
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr +
+            p.cq_off.cqes);
+
+    ring->slots = (mboxIOUringSlot *)calloc(depth, sizeof(mboxIOUringSlot));
+    for (unsigned int i = 0; i < depth; ++i) {
+        ring->slots[i].state = MBOX_IO_URING_FREE;
+        ring->slots[i].data = (unsigned char *)malloc(chunk_size);
+    }
+
+    return ring;
+
+err:
+    loggerDebug("Failed to map io_uring: %s\n", strerror(errno));
+    close(ring_fd);
+    free(ring);
+    return NULL;
+}
+
+/* Put a read for `slot` on the submission queue, it is not handed to the
+ * kernel until mboxIOUringSubmit */
+static void
+mboxIOUringQueue(mboxIOUring *ring, unsigned int slot_idx, size_t offset,
+        size_t size)
+{
+    mboxIOUringSlot *slot = &ring->slots[slot_idx];
+    unsigned int tail = *ring->sq_tail;
+    unsigned int idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->fd;
+    sqe->addr = (unsigned long)slot->data;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = slot_idx;
+    ring->sq_array[idx] = idx;
+
+    slot->state = MBOX_IO_URING_INFLIGHT;
+    slot->offset = offset;
+    slot->size = size;
+    slot->res = 0;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+/* Hand everything queued to the kernel and optionally wait for `wait`
+ * completions */
+static int
+mboxIOUringSubmit(mboxIOUring *ring, unsigned int wait)
+{
+    unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret = 0;
+
+    if (ring->queued == 0 && wait == 0) {
+        return 0;
+    }
+
+    do {
+        ret = mboxIOUringEnter(ring->ring_fd, ring->queued, wait, flags);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret >= 0) {
+        ring->queued -= (unsigned int)ret < ring->queued ? (unsigned int)ret :
+                                                           ring->queued;
+    }
+    return ret;
+}
+
+static void
+mboxIOUringReap(mboxIOUring *ring)
+{
+    unsigned int head = *ring->cq_head;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        mboxIOUringSlot *slot = &ring->slots[cqe->user_data];
+        slot->res = cqe->res;
+        slot->state = MBOX_IO_URING_DONE;
+        head++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int
+mboxIOUringWait(mboxIOUring *ring, mboxIOUringSlot *slot)
+{
+    mboxIOUringReap(ring);
+    while (slot->state == MBOX_IO_URING_INFLIGHT) {
+        if (mboxIOUringSubmit(ring, 1) < 0) {
+            return -1;
+        }
+        mboxIOUringReap(ring);
+    }
+    return 0;
+}
+
+/* Wait for everything in flight and forget about it, the buffers can't be
+ * reused while the kernel might still be writing to them */
+static void
+mboxIOUringDrain(mboxIOUring *ring)
+{
+    for (unsigned int i = 0; i < ring->depth; ++i) {
+        mboxIOUringSlot *slot = &ring->slots[i];
+        if (slot->state == MBOX_IO_URING_INFLIGHT) {
+            mboxIOUringWait(ring, slot);
+        }
+        slot->state = MBOX_IO_URING_FREE;
+    }
+}
+
+static int
+mboxIOUringFind(mboxIOUring *ring, size_t offset, size_t size)
+{
+    for (unsigned int i = 0; i < ring->depth; ++i) {
+        mboxIOUringSlot *slot = &ring->slots[i];
+        if (slot->state != MBOX_IO_URING_FREE && slot->offset == offset &&
+                slot->size == size) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static int
+mboxIOUringFreeSlot(mboxIOUring *ring)
+{
+    for (unsigned int i = 0; i < ring->depth; ++i) {
+        if (ring->slots[i].state == MBOX_IO_URING_FREE) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+ssize_t
+mboxIOUringRead(mboxIOUring *ring, void *dst, size_t size, size_t offset,
+        size_t readahead_limit)
+{
+    mboxIOUringSlot *slot = NULL;
+    ssize_t res = 0;
+    int slot_idx = -1;
+
+    if (size > ring->chunk_size) {
+        return pread(ring->fd, dst, size, offset);
+    }
+
+    slot_idx = mboxIOUringFind(ring, offset, size);
+
+    /* Not something we read ahead, so whatever is in flight is of no use */
+    if (slot_idx == -1) {
+        mboxIOUringDrain(ring);
+        slot_idx = 0;
+        mboxIOUringQueue(ring, slot_idx, offset, size);
+    }
+    slot = &ring->slots[slot_idx];
+
+    /* Keep the next chunks coming while the caller scans this one */
+    for (unsigned int i = 1; i < ring->depth; ++i) {
+        size_t next = offset + i * size;
+        int free_idx = -1;
+
+        if (next > readahead_limit) {
+            break;
+        }
+
+        if (mboxIOUringFind(ring, next, size) != -1) {
+            continue;
+        }
+
+        if ((free_idx = mboxIOUringFreeSlot(ring)) == -1) {
+            break;
+        }
+        mboxIOUringQueue(ring, free_idx, next, size);
+    }
+
+    mboxIOUringSubmit(ring, 0);
+
+    if (mboxIOUringWait(ring, slot) != 0) {
+        slot->state = MBOX_IO_URING_FREE;
+        mboxIOUringDrain(ring);
+        return pread(ring->fd, dst, size, offset);
+    }
+
+    res = slot->res;
+    slot->state = MBOX_IO_URING_FREE;
+
+    /* The kernel is too old for IORING_OP_READ or something else went
+     * wrong, pread will give us a proper errno */
+    if (res < 0) {
+        return pread(ring->fd, dst, size, offset);
+    }
+
+    memcpy(dst, slot->data, res);
+    return res;
+}
+
+void
+mboxIOUringRelease(mboxIOUring *ring)
+{
+    if (ring) {
+        mboxIOUringDrain(ring);
+        for (unsigned int i = 0; i < ring->depth; ++i) {
+            free(ring->slots[i].data);
+        }
+        free(ring->slots);
+        munmap(ring->sqes, ring->sqes_len);
+        if (ring->cq_ptr != ring->sq_ptr) {
+            munmap(ring->cq_ptr, ring->cq_len);
+        }
+        munmap(ring->sq_ptr, ring->sq_len);
+        close(ring->ring_fd);
+        free(ring);
+    }
+}
+
+#else
+
+mboxIOUring *
+mboxIOUringNew(int fd, unsigned int depth, size_t chunk_size)
+{
+    (void)fd;
+    (void)depth;
+    (void)chunk_size;
+    return NULL;
+}
+
+ssize_t
+mboxIOUringRead(mboxIOUring *ring, void *dst, size_t size, size_t offset,
+        size_t readahead_limit)
+{
+    (void)ring;
+    (void)dst;
+    (void)size;
+    (void)offset;
+    (void)readahead_limit;
+    return -1;
+}
+
+void
+mboxIOUringRelease(mboxIOUring *ring)
+{
+    (void)ring;
+}
+
+#endif
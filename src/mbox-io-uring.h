@@ -0,0 +1,40 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_IO_URING_H
+#define __MBOX_IO_URING_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How many reads we keep in flight for one context, the one we are waiting on
+ * plus the ones after it */
+#define MBOX_IO_URING_DEPTH (3)
+
+typedef struct mboxIOUring mboxIOUring;
+
+/* Returns NULL if io_uring is not available, either it was not compiled in or
+ * the kernel said no */
+mboxIOUring *mboxIOUringNew(int fd, unsigned int depth, size_t chunk_size);
+
+/* Behaves like pread, if `offset` was read ahead this will just copy it out.
+ * After each read up to `depth - 1` of the following chunks are queued, as
+ * long as they start at or before `readahead_limit` */
+ssize_t mboxIOUringRead(mboxIOUring *ring, void *dst, size_t size,
+        size_t offset, size_t readahead_limit);
+
+void mboxIOUringRelease(mboxIOUring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
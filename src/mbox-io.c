@@ -5,6 +5,7 @@
  * This code is released under the BSD 2 clause license.
  * See the COPYING file for more information. */
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <errno.h>
@@ -15,8 +16,17 @@
 #include <unistd.h>
 
 #include "mbox-buf.h"
+#include "mbox-gzip.h"
+#include "mbox-io-uring.h"
 #include "mbox-io.h"
 #include "mbox-logger.h"
+#include "mbox-memory.h"
+
+/* Enough for a full read starting anywhere in a block */
+#define MBOX_IO_DIRECT_BOUNCE_SIZE                                \
+    (((MBOX_IO_READ_SIZE + MBOX_IO_DIRECT_ALIGN - 1) &            \
+             ~((size_t)MBOX_IO_DIRECT_ALIGN - 1)) +               \
+            MBOX_IO_DIRECT_ALIGN)
 
 mboxIOCtx *
 mboxIONew(int fd, size_t file_size)
@@ -30,6 +40,11 @@ mboxIONew(int fd, size_t file_size)
     ioctx->err = MBOX_IO_OK;
     ioctx->file_size = file_size;
     ioctx->buf = mboxBufAlloc(MBOX_IO_READ_SIZE);
+    ioctx->map = NULL;
+    ioctx->uring = NULL;
+    ioctx->ring = NULL;
+    ioctx->bounce = NULL;
+    ioctx->gz = NULL;
     return ioctx;
 }
 
@@ -37,11 +52,35 @@ void
 mboxIORelease(mboxIOCtx *ioctx)
 {
     if (ioctx) {
-        mboxBufRelease(ioctx->buf);
+        mboxIOUringRelease(ioctx->uring);
+        free(ioctx->bounce);
+        mboxGzReaderRelease(ioctx->gz);
+        if (ioctx->map || ioctx->ring) {
+            mboxRingRelease(ioctx->ring);
+            mboxMemFree(ioctx->buf);
+        } else {
+            mboxBufRelease(ioctx->buf);
+        }
         free(ioctx);
     }
 }
 
+void
+mboxIOSetMap(mboxIOCtx *ioctx, mboxChar *map)
+{
+    if (ioctx->ring) {
+        mboxRingRelease(ioctx->ring);
+        ioctx->ring = NULL;
+    } else {
+        mboxMemFree(ioctx->buf->data);
+    }
+    ioctx->map = map;
+    ioctx->buf->data = map;
+    ioctx->buf->len = 0;
+    ioctx->buf->offset = 0;
+    ioctx->buf->capacity = 0;
+}
+
 int
 mboxIOExists(char *path)
 {
@@ -82,19 +121,215 @@ mboxIOOpen(char *name, int perms, int mode)
     return ioctx;
 }
 
+/* Twice a read leaves space for the read after whatever is left over from the
+ * last message */
+int
+mboxIOUseRing(mboxIOCtx *ioctx)
+{
+    mboxBuf *buf = ioctx->buf;
+    mboxRing *ring = mboxRingNew(MBOX_IO_READ_SIZE * 2);
+
+    if (ring == NULL) {
+        return 0;
+    }
+
+    memcpy(ring->base, buf->data, buf->len + 1);
+    mboxMemFree(buf->data);
+    buf->data = ring->base;
+    buf->capacity = ring->size;
+    ioctx->ring = ring;
+    return 1;
+}
+
+/* A message bigger than the ring, move everything into a bigger one. This is
+ * the only time the ring copies */
+static void
+mboxIOGrowRing(mboxIOCtx *ioctx, size_t needed)
+{
+    mboxBuf *buf = ioctx->buf;
+    mboxRing *ring = mboxRingNew(needed > ioctx->ring->size * 2 ?
+                    needed :
+                    ioctx->ring->size * 2);
+
+    if (ring == NULL) {
+        loggerPanic("Failed to grow ring to %zu bytes\n", needed);
+    }
+
+    memcpy(ring->base, buf->data, buf->len + 1);
+    mboxRingRelease(ioctx->ring);
+    buf->data = ring->base;
+    buf->capacity = ring->size;
+    ioctx->ring = ring;
+}
+
+void
+mboxIOSetDirect(mboxIOCtx *ioctx, int direct_fd)
+{
+    void *bounce = NULL;
+
+    if (posix_memalign(&bounce, MBOX_IO_DIRECT_ALIGN,
+                MBOX_IO_DIRECT_BOUNCE_SIZE) != 0) {
+        loggerPanic("Failed to allocate direct io buffer\n");
+    }
+
+    mboxIOUringRelease(ioctx->uring);
+    ioctx->uring = NULL;
+    ioctx->fd = direct_fd;
+    ioctx->bounce = (mboxChar *)bounce;
+}
+
+void
+mboxIOSetGzip(mboxIOCtx *ioctx, struct mboxGzReader *gz)
+{
+    mboxIOUringRelease(ioctx->uring);
+    ioctx->uring = NULL;
+    ioctx->gz = gz;
+}
+
+/* Read the aligned blocks around what was asked for into the bounce buffer
+ * and copy out the middle. Reads are back to back so the block either side
+ * of a boundary gets read twice, which is small change next to a read */
+static ssize_t
+mboxIOReadDirect(mboxIOCtx *ioctx, mboxChar *dst, size_t size, size_t offset)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        size_t pos = offset + done;
+        size_t start = pos & ~((size_t)MBOX_IO_DIRECT_ALIGN - 1);
+        size_t skip = pos - start;
+        size_t want = size - done;
+        size_t len = 0;
+        size_t got = 0;
+        ssize_t rbytes = 0;
+
+        if (want > MBOX_IO_DIRECT_BOUNCE_SIZE - skip) {
+            want = MBOX_IO_DIRECT_BOUNCE_SIZE - skip;
+        }
+        len = (skip + want + MBOX_IO_DIRECT_ALIGN - 1) &
+                ~((size_t)MBOX_IO_DIRECT_ALIGN - 1);
+
+        rbytes = pread(ioctx->fd, ioctx->bounce, len, start);
+
+        if (rbytes < 0) {
+            return done ? (ssize_t)done : rbytes;
+        } else if ((size_t)rbytes <= skip) {
+            break;
+        }
+
+        got = rbytes - skip;
+        if (got > want) {
+            got = want;
+        }
+        memcpy(dst + done, ioctx->bounce + skip, got);
+        done += got;
+
+        /* Short read, we are at the end of the file */
+        if ((size_t)rbytes < len) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+int
+mboxIOSetEngine(mboxIOCtx *ioctx, int engine)
+{
+    mboxIOUringRelease(ioctx->uring);
+    ioctx->uring = NULL;
+
+    if (engine == MBOX_IO_ENGINE_PREAD) {
+        return MBOX_IO_ENGINE_PREAD;
+    }
+
+    ioctx->uring = mboxIOUringNew(ioctx->fd, MBOX_IO_URING_DEPTH,
+            MBOX_IO_READ_SIZE);
+
+    if (ioctx->uring == NULL) {
+        return MBOX_IO_ENGINE_PREAD;
+    }
+    return MBOX_IO_ENGINE_URING;
+}
+
+/* A 'read' of a mapped file just moves the view so that `buf_offset` lines up
+ * with `offset`, the view always runs to the end of the file. As the parser
+ * tends to want the next chunk straight after this one we tell the kernel
+ * to start paging it in */
+static ssize_t
+mboxIOReadMapped(mboxIOCtx *ioctx, size_t size, size_t buf_offset,
+        ssize_t offset)
+{
+    mboxBuf *buf = ioctx->buf;
+    size_t start = offset - buf_offset;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t advise_start = offset & ~(page - 1);
+    ssize_t rbytes = 0;
+
+    ioctx->err = MBOX_IO_OK;
+
+    if ((size_t)offset >= ioctx->file_size) {
+        loggerDebug("NO READ, file offset: %zu\n", ioctx->file_offset);
+        ioctx->err = MBOX_IO_EOF;
+        return 0;
+    }
+
+    if (offset + size > ioctx->file_size) {
+        size = ioctx->file_size - offset;
+    }
+    madvise(ioctx->map + advise_start, size + (offset - advise_start),
+            MADV_WILLNEED);
+
+    buf->data = ioctx->map + start;
+    /* The byte after the file is the zero page, so this is the same as
+     * mboxBufSetLen without the write */
+    buf->len = ioctx->file_size - start;
+    rbytes = buf->len - buf_offset;
+
+    return rbytes;
+}
+
 /* Read from fd into buffer, given how much to read 'size' a buffer offset of
  * where to read and where in the file to read from with file_offset */
 ssize_t
 mboxIORead(mboxIOCtx *ioctx, size_t size, size_t buf_offset, ssize_t offset)
 {
-    mboxBufExtendBufferIfNeeded(ioctx->buf, size);
+    if (ioctx->map) {
+        return mboxIOReadMapped(ioctx, size, buf_offset, offset);
+    }
+
+    if (ioctx->ring) {
+        /* One byte for the '\0' */
+        if (buf_offset + size + 1 > ioctx->ring->size) {
+            mboxIOGrowRing(ioctx, buf_offset + size + 1);
+        }
+    } else {
+        mboxBufExtendBufferIfNeeded(ioctx->buf, size);
+    }
 
     ssize_t rbytes = 0;
     ioctx->err = MBOX_IO_OK;
-    /* We are potentially going to have multiple threads smashing this file
-     * descriptor and going to be hopping all over the place to it makes sense
-     * to use pread */
-    rbytes = pread(ioctx->fd, ioctx->buf->data + buf_offset, size, offset);
+    if (ioctx->gz) {
+        rbytes = mboxGzRead(ioctx->gz, ioctx->buf->data + buf_offset, size,
+                offset);
+    } else if (ioctx->bounce) {
+        rbytes = mboxIOReadDirect(ioctx, ioctx->buf->data + buf_offset, size,
+                offset);
+    } else if (ioctx->uring) {
+        /* Read ahead as far as the context will go, it stops reading once
+         * it is passed its end offset */
+        size_t limit = ioctx->end_offset > 0 ? ioctx->end_offset : 0;
+        if (limit >= ioctx->file_size && ioctx->file_size > 0) {
+            limit = ioctx->file_size - 1;
+        }
+        rbytes = mboxIOUringRead(ioctx->uring, ioctx->buf->data + buf_offset,
+                size, offset, limit);
+    } else {
+        /* We are potentially going to have multiple threads smashing this
+         * file descriptor and going to be hopping all over the place to it
+         * makes sense to use pread */
+        rbytes = pread(ioctx->fd, ioctx->buf->data + buf_offset, size, offset);
+    }
 
     if (rbytes == 0) {
         loggerDebug("NO READ, file offset: %zu\n", ioctx->file_offset);
@@ -109,6 +344,39 @@ mboxIORead(mboxIOCtx *ioctx, size_t size, size_t buf_offset, ssize_t offset)
     return rbytes;
 }
 
+void
+mboxIOConsume(mboxIOCtx *ioctx, size_t size)
+{
+    mboxBuf *buf = ioctx->buf;
+    size_t newlen = buf->len - size;
+
+    if (ioctx->map) {
+        buf->data += size;
+        buf->len = newlen;
+    } else if (ioctx->ring) {
+        /* The '\0' after the data is already in place */
+        buf->data = mboxRingAdvance(ioctx->ring, buf->data, size);
+        buf->len = newlen;
+    } else {
+        if (newlen != 0) {
+            mboxBufSlice(buf, size, 0, newlen);
+        }
+        mboxBufSetLen(buf, newlen);
+    }
+    mboxBufSetOffset(buf, 0);
+}
+
+void
+mboxIOReset(mboxIOCtx *ioctx)
+{
+    if (ioctx->map) {
+        ioctx->buf->len = 0;
+    } else {
+        mboxBufSetLen(ioctx->buf, 0);
+    }
+    mboxBufSetOffset(ioctx->buf, 0);
+}
+
 ssize_t
 mboxIOWrite(mboxIOCtx *ioctx, void *buf, size_t size, ssize_t offset)
 {
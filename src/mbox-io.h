@@ -12,6 +12,7 @@
 #include <stdlib.h>
 
 #include "mbox-buf.h"
+#include "mbox-ring.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -27,6 +28,18 @@ extern "C" {
 
 #define MBOX_IO_READ_SIZE (300000)
 
+/* O_DIRECT reads want the file offset, length and memory aligned to the
+ * logical block size, a page covers every device we care about */
+#define MBOX_IO_DIRECT_ALIGN (4096)
+
+/* How reads are done, auto uses io_uring when the kernel has it */
+#define MBOX_IO_ENGINE_PREAD (0)
+#define MBOX_IO_ENGINE_URING (1)
+#define MBOX_IO_ENGINE_AUTO (2)
+
+struct mboxIOUring;
+struct mboxGzReader;
+
 typedef struct mboxIOCtx {
     int fd;               /* File descriptor */
     int err;              /* Error code '0' is all good */
@@ -39,6 +52,16 @@ typedef struct mboxIOCtx {
     ssize_t file_offset; /* Where we currently are in the file */
     size_t file_size;    /* Size of the file */
     mboxBuf *buf;        /* Buffer for reading into */
+    mboxChar *map; /* If the file is memory mapped, `buf` is then a view into
+                      this and owns none of its data */
+    struct mboxIOUring *uring; /* Reads go through here if set, which keeps
+                                  the following chunks in flight */
+    mboxRing *ring; /* If set `buf` lives in here, consuming from the front of
+                       the buffer is then free */
+    mboxChar *bounce; /* If set `fd` was opened with O_DIRECT, reads land in
+                         here aligned and get copied into `buf` */
+    struct mboxGzReader *gz; /* If set the file is gzipped and offsets are
+                                into the inflated data */
 } mboxIOCtx;
 
 #define mboxIOSetFd(io, _fd) ((io)->fd = (_fd))
@@ -51,13 +74,40 @@ typedef struct mboxIOCtx {
 mboxIOCtx *mboxIONew(int fd, size_t file_size);
 mboxIOCtx *mboxIOOpen(char *path, int perms, int mode);
 void mboxIOClose(mboxIOCtx *ioctx);
+void mboxIORelease(mboxIOCtx *ioctx);
 int mboxIOExists(char *path);
 
+/* Switch the context over to reading from a mapping of the whole file, the
+ * mapping must be followed by at least one writable zeroed page */
+void mboxIOSetMap(mboxIOCtx *ioctx, mboxChar *map);
+
+/* Move the buffer into a ring so consuming from it does not memmove, only
+ * for contexts which read sequentially through the buffer. Returns 0 if we
+ * could not get a ring in which case the plain buffer is kept */
+int mboxIOUseRing(mboxIOCtx *ioctx);
+
+/* Read from `direct_fd`, which was opened with O_DIRECT, so the page cache
+ * is left alone. Reads at any offset and of any size still work */
+void mboxIOSetDirect(mboxIOCtx *ioctx, int direct_fd);
+
+/* Read through `gz` which the context then owns, see mbox-gzip.h */
+void mboxIOSetGzip(mboxIOCtx *ioctx, struct mboxGzReader *gz);
+
+/* Pick how reads are done, returns the engine that is actually in use as
+ * asking for io_uring falls back to pread if the kernel does not support it */
+int mboxIOSetEngine(mboxIOCtx *ioctx, int engine);
+
 /* Read from fd into buffer, given how much to read 'size' a buffer offset of
  * where to read and where in the file to read from with file_offset */
 ssize_t mboxIORead(mboxIOCtx *ioctx, size_t size, size_t buf_offset,
         ssize_t offset);
 
+/* Drop the first `size` bytes of the buffer */
+void mboxIOConsume(mboxIOCtx *ioctx, size_t size);
+
+/* Empty the buffer */
+void mboxIOReset(mboxIOCtx *ioctx);
+
 ssize_t mboxIOWriteBuf(mboxIOCtx *ioctx, size_t size, ssize_t offset);
 int mboxIOFsync(mboxIOCtx *ioctx);
 
@@ -10,11 +10,12 @@
 #include <stdlib.h>
 
 #include "mbox-list.h"
+#include "mbox-memory.h"
 
 static mboxLNode *
 mboxLNodeNew(void *data)
 {
-    mboxLNode *n = (mboxLNode *)malloc(sizeof(mboxLNode));
+    mboxLNode *n = (mboxLNode *)mboxMemAlloc(sizeof(mboxLNode));
     n->data = data;
     n->next = n->prev = NULL;
     return n;
@@ -95,7 +96,7 @@ mboxListRemoveHead(mboxList *l)
         l->root->prev = tail;
     }
 
-    free(head);
+    mboxMemFree(head);
     l->len--;
     return val;
 }
@@ -118,7 +119,7 @@ mboxListRemoveTail(mboxList *l)
         new_tail->next = l->root;
     }
 
-    free(tail);
+    mboxMemFree(tail);
     l->len--;
     return val;
 }
@@ -287,11 +288,12 @@ mboxListRelease(mboxList *l)
 }
 
 /* Plonk aux onto the tail of main O(1) fast and unsophisticated, just how I
- * like cars*/
+ * like cars. aux is freed, empty or not */
 mboxList *
 mboxListAppendListTail(mboxList *main, mboxList *aux)
 {
     if (aux->len == 0) {
+        mboxListRelease(aux);
         return main;
     }
     mboxLNode *aux_head = aux->root;
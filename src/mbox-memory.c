@@ -4,126 +4,388 @@
  *
  * This code is released under the BSD 2 clause license.
  * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mbox-logger.h"
 #include "mbox-memory.h"
 
-#define MEM_BLOCK_SIZE 8
-#define MEM_SIZE_INFO (sizeof(uint32_t) + 1)
+/* Before every object, which class it is in or MBOX_MEM_LARGE. Keeps
+ * objects 8 byte aligned as the class sizes are multiples of 16 */
+#define MBOX_MEM_HEADER (8)
+#define MBOX_MEM_LARGE (0xFF)
+#define MBOX_MEM_GRAIN (16)
+/* About how many bytes of objects move between a thread and the shared
+ * freelist at once */
+#define MBOX_MEM_BATCH_BYTES (8 * 1024)
+#define MBOX_MEM_BATCH_MIN (4)
+#define MBOX_MEM_BATCH_MAX (64)
+
+typedef struct mboxMemObj {
+    struct mboxMemObj *next;
+} mboxMemObj;
+
+typedef struct mboxMemClass {
+    pthread_mutex_t lock;
+    mboxMemObj *free;
+    size_t size;  /* Of each object, the header included */
+    size_t batch; /* How many move to or from a thread at once, a thread
+                     keeps at most twice this many */
+} __attribute__((aligned(64))) mboxMemClass;
 
-/**
- * Store how many blocks worth of data are allocated
- * within in this pointer */
+typedef struct mboxMemCache {
+    mboxMemObj *free[MBOX_MEM_CLASSES];
+    size_t len[MBOX_MEM_CLASSES];
+    int registered; /* To be flushed when the thread exits */
+} mboxMemCache;
+
+static mboxMemClass mbox_mem_classes[MBOX_MEM_CLASSES];
+/* The class for each multiple of MBOX_MEM_GRAIN up to MBOX_MEM_MAX_SMALL */
+static uint8_t mbox_mem_class_of[MBOX_MEM_MAX_SMALL / MBOX_MEM_GRAIN + 1];
+static pthread_once_t mbox_mem_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mbox_mem_key;
+static size_t mbox_mem_reserved = 0;
+static __thread mboxMemCache mbox_mem_cache;
+
+static uint8_t *
+mboxMemHeader(void *ptr)
+{
+    return (uint8_t *)ptr - MBOX_MEM_HEADER;
+}
+
+/* Hand everything the thread is holding back */
 static void
-mboxMemPoolSetBlockCount(void *ptr, unsigned int len)
+mboxMemCacheFlush(void *argv)
 {
-    unsigned char *_ptr = (unsigned char *)ptr;
-    _ptr -= MEM_SIZE_INFO;
-    _ptr[0] = (len >> 24) & 0xFF;
-    _ptr[1] = (len >> 16) & 0xFF;
-    _ptr[2] = (len >> 8) & 0xFF;
-    _ptr[3] = len & 0xFF;
-    (_ptr)[4] = '\0';
-    _ptr += MEM_SIZE_INFO;
+    mboxMemCache *cache = (mboxMemCache *)argv;
+
+    for (int i = 0; i < MBOX_MEM_CLASSES; ++i) {
+        mboxMemClass *cls = &mbox_mem_classes[i];
+        mboxMemObj *head = cache->free[i];
+        mboxMemObj *tail = head;
+
+        if (head == NULL) {
+            continue;
+        }
+        while (tail->next) {
+            tail = tail->next;
+        }
+        pthread_mutex_lock(&cls->lock);
+        tail->next = cls->free;
+        cls->free = head;
+        pthread_mutex_unlock(&cls->lock);
+        cache->free[i] = NULL;
+        cache->len[i] = 0;
+    }
+    cache->registered = 0;
 }
 
-/**
- * Retrieve how many blocks are allocated within this piece of
- * memory */
-static uint32_t
-mboxMemPoolGetBlockCount(void *ptr)
+/* Steps of 16 to 128, then 4 steps for each doubling */
+static void
+mboxMemInit(void)
 {
-    unsigned char *_ptr = (unsigned char *)ptr;
-    _ptr -= MEM_SIZE_INFO;
+    size_t size = MBOX_MEM_GRAIN;
+    size_t step = MBOX_MEM_GRAIN;
+    int cls = 0;
 
-    return ((uint32_t)_ptr[0] << 24) | ((uint32_t)_ptr[1] << 16) |
-            ((uint32_t)_ptr[2] << 8) | (uint32_t)_ptr[3];
+    for (int i = 0; i < MBOX_MEM_CLASSES; ++i) {
+        mboxMemClass *c = &mbox_mem_classes[i];
+        size_t batch = MBOX_MEM_BATCH_BYTES / size;
+
+        pthread_mutex_init(&c->lock, NULL);
+        c->free = NULL;
+        c->size = size;
+        c->batch = batch < MBOX_MEM_BATCH_MIN ? MBOX_MEM_BATCH_MIN :
+                   batch > MBOX_MEM_BATCH_MAX ? MBOX_MEM_BATCH_MAX :
+                                                batch;
+        if (size >= 128 && (size & (size - 1)) == 0) {
+            step = size / 4;
+        }
+        size += step;
+    }
+
+    for (size_t i = 0; i <= MBOX_MEM_MAX_SMALL / MBOX_MEM_GRAIN; ++i) {
+        while (mbox_mem_classes[cls].size < i * MBOX_MEM_GRAIN) {
+            cls++;
+        }
+        mbox_mem_class_of[i] = cls;
+    }
+
+    pthread_key_create(&mbox_mem_key, mboxMemCacheFlush);
 }
 
-mboxMemPool *
-mboxMemPoolNew(size_t block_count)
+/* Chain a new slab's worth of objects on to the class's freelist, with the
+ * class locked */
+static void
+mboxMemCarve(mboxMemClass *c, int cls)
 {
-    mboxMemPool *p = malloc(sizeof(mboxMemPool));
-    p->data = malloc(block_count * MEM_BLOCK_SIZE);
-    p->blocks = block_count;
-    p->allocated = 0;
-    p->bitset = calloc((block_count + 31) / 32, sizeof(uint32_t));
-    return p;
+    uint8_t *slab = (uint8_t *)malloc(MBOX_MEM_SLAB);
+    size_t count = MBOX_MEM_SLAB / c->size;
+
+    if (slab == NULL) {
+        loggerPanic("Failed to allocate memory pool slab\n");
+    }
+    __atomic_add_fetch(&mbox_mem_reserved, MBOX_MEM_SLAB, __ATOMIC_RELAXED);
+
+    for (size_t i = count; i > 0; --i) {
+        uint8_t *header = slab + (i - 1) * c->size;
+        mboxMemObj *obj = (mboxMemObj *)(header + MBOX_MEM_HEADER);
+        header[0] = cls;
+        obj->next = c->free;
+        c->free = obj;
+    }
+}
+
+/* The thread's cache for the class is empty, take a batch from the shared
+ * freelist */
+static void *
+mboxMemRefill(mboxMemCache *cache, int cls)
+{
+    mboxMemClass *c = &mbox_mem_classes[cls];
+    mboxMemObj *head = NULL;
+    mboxMemObj *tail = NULL;
+    size_t taken = 1;
+
+    if (!cache->registered) {
+        pthread_setspecific(mbox_mem_key, cache);
+        cache->registered = 1;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (c->free == NULL) {
+        mboxMemCarve(c, cls);
+    }
+    head = tail = c->free;
+    while (taken < c->batch && tail->next) {
+        tail = tail->next;
+        taken++;
+    }
+    c->free = tail->next;
+    pthread_mutex_unlock(&c->lock);
+
+    tail->next = NULL;
+    cache->free[cls] = head->next;
+    cache->len[cls] = taken - 1;
+    return head;
 }
 
 void *
-mboxMemPoolAlloc(mboxMemPool *p, size_t size)
-{
-    unsigned int block_count = (size + MEM_SIZE_INFO + MEM_BLOCK_SIZE - 1) /
-            MEM_BLOCK_SIZE;
-    uint32_t mask = 0xFFFFFFFFU >> (32 - block_count);
-
-    for (int i = 0; i < p->blocks; ++i) {
-        /* Check that the blocks are free */
-        if ((p->bitset[i / 32] & (mask << (i & (32 - 1)))) == 0) {
-            for (int j = i; j < i + block_count; ++j) {
-                /* mark as allocated */
-                p->bitset[j / 32] |= (1UL << (j & (32 - 1)));
-            }
-            /* Store how many blocks we've allocated */
-            p->allocated += block_count;
-            /* Return pointer to the first byte of free memory */
-            void *ptr = (void *)p->data + MEM_SIZE_INFO + i * MEM_BLOCK_SIZE;
-            /* Set how many blocks were used in the pointer */
-            mboxMemPoolSetBlockCount(ptr, block_count);
-            return ptr;
+mboxMemPoolAlloc(size_t size)
+{
+    size_t need = size + MBOX_MEM_HEADER;
+    mboxMemCache *cache = &mbox_mem_cache;
+    mboxMemObj *obj = NULL;
+    int cls;
+
+    if (need > MBOX_MEM_MAX_SMALL) {
+        uint8_t *header = (uint8_t *)malloc(need);
+        if (header == NULL) {
+            return NULL;
         }
+        header[0] = MBOX_MEM_LARGE;
+        return header + MBOX_MEM_HEADER;
     }
 
-    loggerDebug("out of mem\n");
-    return NULL;
+    pthread_once(&mbox_mem_once, mboxMemInit);
+    cls = mbox_mem_class_of[(need + MBOX_MEM_GRAIN - 1) / MBOX_MEM_GRAIN];
+    obj = cache->free[cls];
+    if (obj == NULL) {
+        return mboxMemRefill(cache, cls);
+    }
+    cache->free[cls] = obj->next;
+    cache->len[cls]--;
+    return obj;
 }
 
 void
-mboxMemPoolFree(mboxMemPool *p, void *ptr)
+mboxMemPoolFree(void *ptr)
+{
+    mboxMemCache *cache = &mbox_mem_cache;
+    mboxMemObj *obj = (mboxMemObj *)ptr;
+    mboxMemClass *c = NULL;
+    int cls;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    cls = mboxMemHeader(ptr)[0];
+    if (cls == MBOX_MEM_LARGE) {
+        free(mboxMemHeader(ptr));
+        return;
+    }
+
+    obj->next = cache->free[cls];
+    cache->free[cls] = obj;
+    c = &mbox_mem_classes[cls];
+    if (++cache->len[cls] <= c->batch * 2) {
+        return;
+    }
+
+    /* Holding too many, give a batch back */
+    mboxMemObj *tail = obj;
+    for (size_t i = 1; i < c->batch; ++i) {
+        tail = tail->next;
+    }
+    cache->free[cls] = tail->next;
+    cache->len[cls] -= c->batch;
+    if (!cache->registered) {
+        pthread_setspecific(mbox_mem_key, cache);
+        cache->registered = 1;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    tail->next = c->free;
+    c->free = obj;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void *
+mboxMemPoolRealloc(void *ptr, size_t size)
 {
-    /* Index of memory block */
-    uint32_t len = mboxMemPoolGetBlockCount(ptr);
-    mboxMemPoolSetBlockCount(ptr, 0);
-    p->allocated -= len;
+    size_t usable;
+    void *grown = NULL;
+    int cls;
+
+    if (ptr == NULL) {
+        return mboxMemPoolAlloc(size);
+    }
+
+    cls = mboxMemHeader(ptr)[0];
+    if (cls == MBOX_MEM_LARGE) {
+        uint8_t *header = (uint8_t *)realloc(mboxMemHeader(ptr),
+                size + MBOX_MEM_HEADER);
+        return header ? header + MBOX_MEM_HEADER : NULL;
+    }
 
-    /* Clear all bits from the bit set */
-    for (int i = len - 1; i >= 0; --i) {
-        int idx = (((char *)ptr - (char *)p->data) / MEM_BLOCK_SIZE) + i;
-        int bit = idx & (32 - 1);
-        int word = idx / 32;
-        p->bitset[word] &= ~(1UL << bit);
+    usable = mbox_mem_classes[cls].size - MBOX_MEM_HEADER;
+    if (size <= usable) {
+        return ptr;
     }
+    grown = mboxMemPoolAlloc(size);
+    if (grown) {
+        memcpy(grown, ptr, usable);
+        mboxMemPoolFree(ptr);
+    }
+    return grown;
 }
 
-void
-mboxMemPoolRelease(mboxMemPool *p)
+size_t
+mboxMemPoolReserved(void)
 {
-    free(p->data);
-    free(p);
+    return __atomic_load_n(&mbox_mem_reserved, __ATOMIC_RELAXED);
+}
+
+void *
+mboxMemAlloc(size_t size)
+{
+#ifdef MBOX_MEMPOOL
+    return mboxMemPoolAlloc(size);
+#else
+    return malloc(size);
+#endif
 }
 
 void
-mboxMemPoolPrint(mboxMemPool *p)
+mboxMemFree(void *ptr)
 {
-    for (int i = 0; i < p->blocks; ++i) {
-        if ((i & (32 - 1)) == 0) {
-            printf("0x%08x ", p->bitset[i / 32]);
+#ifdef MBOX_MEMPOOL
+    mboxMemPoolFree(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+void *
+mboxMemRealloc(void *ptr, size_t size)
+{
+#ifdef MBOX_MEMPOOL
+    return mboxMemPoolRealloc(ptr, size);
+#else
+    return realloc(ptr, size);
+#endif
+}
+
+mboxArena *
+mboxArenaNew(void)
+{
+    mboxArena *a = (mboxArena *)malloc(sizeof(mboxArena));
+    a->chunks = NULL;
+    a->next_size = MBOX_ARENA_MIN_CHUNK;
+    a->bytes = 0;
+    return a;
+}
+
+static mboxArenaChunk *
+mboxArenaChunkNew(size_t size)
+{
+    mboxArenaChunk *chunk = (mboxArenaChunk *)malloc(
+            sizeof(mboxArenaChunk) + size);
+    if (chunk == NULL) {
+        loggerPanic("Failed to allocate arena chunk\n");
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+    chunk->size = size;
+    return chunk;
+}
+
+void *
+mboxArenaAlloc(mboxArena *a, size_t size)
+{
+    mboxArenaChunk *chunk = a->chunks;
+    void *ptr = NULL;
+
+    size = (size + MBOX_ARENA_ALIGN - 1) & ~(size_t)(MBOX_ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        if (size > a->next_size / 4) {
+            /* Too big to share a chunk, goes behind the one in use so what
+             * is left of that isn't wasted */
+            mboxArenaChunk *own = mboxArenaChunkNew(size);
+            own->used = size;
+            if (chunk) {
+                own->next = chunk->next;
+                chunk->next = own;
+            } else {
+                a->chunks = own;
+            }
+            a->bytes += size;
+            return own->data;
         }
 
-        printf("%d", (p->bitset[i / 32] >> (i & (32 - 1))) & 1);
-        if ((i & (32 - 1)) == 31) {
-            printf("\n");
+        chunk = mboxArenaChunkNew(a->next_size);
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        if (a->next_size < MBOX_ARENA_CHUNK) {
+            a->next_size *= 2;
         }
     }
+
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    a->bytes += size;
+    return ptr;
 }
 
-uint32_t
-mboxMemPoolMemCount(mboxMemPool *p)
+void
+mboxArenaRelease(mboxArena *a)
 {
-    return p->allocated * MEM_BLOCK_SIZE;
+    if (a) {
+        mboxArenaChunk *chunk = a->chunks;
+        while (chunk) {
+            mboxArenaChunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        free(a);
+    }
 }
+
@@ -10,17 +10,53 @@
 #include <stddef.h>
 #include <stdint.h>
 
-typedef struct mboxMemPool {
-    void *data;
-    size_t blocks;
-    size_t allocated;
-    uint32_t *bitset;
-} mboxMemPool;
-
-mboxMemPool *mboxMemPoolNew(size_t block_count);
-void *mboxMemPoolAlloc(mboxMemPool *p, size_t size);
-void mboxMemPoolFree(mboxMemPool *p, void *ptr);
-void mboxMemPoolRelease(mboxMemPool *p);
-void mboxMemPoolPrint(mboxMemPool *p);
+/* A small object allocator. Objects up to MBOX_MEM_MAX_SMALL bytes come
+ * from one of MBOX_MEM_CLASSES size classes, carved out of slabs and kept on
+ * a freelist for each class. Each thread keeps a cache of freed objects of
+ * each class which it allocates from without a lock, and swaps them with the
+ * shared freelist in batches. Anything larger goes to malloc. Freeing from
+ * another thread than the one which allocated is fine. Slabs are kept for
+ * reuse and never given back */
+#define MBOX_MEM_MAX_SMALL (4096)
+#define MBOX_MEM_CLASSES (28)
+#define MBOX_MEM_SLAB (64 * 1024)
+
+void *mboxMemPoolAlloc(size_t size);
+void mboxMemPoolFree(void *ptr);
+void *mboxMemPoolRealloc(void *ptr, size_t size);
+/* Bytes carved into slabs so far */
+size_t mboxMemPoolReserved(void);
+
+/* What the library allocates buffers, list nodes and tree nodes with. The
+ * pool if built with --enable-mempool, otherwise malloc */
+void *mboxMemAlloc(size_t size);
+void mboxMemFree(void *ptr);
+void *mboxMemRealloc(void *ptr, size_t size);
+
+/* Bump allocation out of chunks which start small and double up to
+ * MBOX_ARENA_CHUNK, nothing is freed until the whole arena is. There is no
+ * header on each allocation so many small ones cost only what they ask for.
+ * Not thread safe, give each thread its own */
+#define MBOX_ARENA_MIN_CHUNK (4 * 1024)
+#define MBOX_ARENA_CHUNK (256 * 1024)
+#define MBOX_ARENA_ALIGN (8)
+
+typedef struct mboxArenaChunk {
+    struct mboxArenaChunk *next;
+    size_t used;
+    size_t size;
+    unsigned char data[];
+} mboxArenaChunk;
+
+typedef struct mboxArena {
+    mboxArenaChunk *chunks; /* Allocating out of the first */
+    size_t next_size;       /* Of the next chunk */
+    size_t bytes;           /* Handed out so far */
+} mboxArena;
+
+mboxArena *mboxArenaNew(void);
+void *mboxArenaAlloc(mboxArena *a, size_t size);
+/* Frees everything allocated from it, one free per chunk */
+void mboxArenaRelease(mboxArena *a);
 
 #endif
@@ -12,8 +12,10 @@
 #include "mbox-buf.h"
 #include "mbox-common-headers.h"
 #include "mbox-date.h"
+#include "mbox-intern.h"
 #include "mbox-io.h"
 #include "mbox-logger.h"
+#include "mbox-memory.h"
 #include "mbox-msg.h"
 #include "mbox-parser.h"
 #include "mbox-redblacktree.h"
@@ -29,6 +31,9 @@ mboxMsgLiteNew(void)
     m->msg_id = NULL;
     m->subject = NULL;
     m->preview = NULL;
+    m->from_line = NULL;
+    m->in_arena = 0;
+    m->spans = NULL;
     return m;
 }
 
@@ -54,79 +59,269 @@ mboxMsgLitePrint(mboxMsgLite *m)
 void
 mboxMsgLiteClear(mboxMsgLite *m)
 {
-    if (m) {
+    if (m && !m->in_arena) {
         m->start = m->end = m->unix_timestamp = 0;
-        free(m->date);
-        free(m->from);
-        free(m->msg_id);
-        free(m->preview);
-        free(m->subject);
+        mboxBufRelease(m->date);
+        mboxBufRelease(m->from);
+        mboxBufRelease(m->msg_id);
+        mboxBufRelease(m->preview);
+        mboxBufRelease(m->subject);
+        mboxBufRelease(m->from_line);
+        m->date = m->from = m->msg_id = NULL;
+        m->preview = m->subject = m->from_line = NULL;
+        free(m->spans);
+        m->spans = NULL;
     }
 }
 
+/* One in an arena goes when the arena does */
 void
 mboxMsgLiteRelease(mboxMsgLite *m)
 {
-    if (m) {
+    if (m && !m->in_arena) {
         mboxMsgLiteClear(m);
         free(m);
     }
 }
 
-mboxMsgLite *
-mboxMsgLiteFromBuffer(mboxBuf *buf, ssize_t start_offset, ssize_t end_offset)
+/* The buf and its bytes from the arena, no spare capacity as nothing grows
+ * them once parsed */
+static mboxBuf *
+mboxMsgBufDup(mboxArena *arena, mboxChar *s, size_t len, size_t capacity)
+{
+    mboxBuf *dupe = NULL;
+
+    if (arena == NULL) {
+        return mboxBufDupRaw(s, len, capacity);
+    }
+
+    dupe = (mboxBuf *)mboxArenaAlloc(arena, sizeof(mboxBuf));
+    dupe->data = (mboxChar *)mboxArenaAlloc(arena, len + 1);
+    memcpy(dupe->data, s, len);
+    dupe->data[len] = '\0';
+    dupe->len = len;
+    dupe->offset = 0;
+    dupe->capacity = len;
+    return dupe;
+}
+
+static mboxBuf *
+mboxMsgBufMaybeDup(mboxArena *arena, mboxBuf *buf)
+{
+    if (buf) {
+        return mboxMsgBufDup(arena, buf->data, buf->len, buf->len);
+    }
+    return NULL;
+}
+
+static long
+mboxMsgTimestamp(mboxBuf *date)
 {
     struct mboxDate d;
 
+    if (date) {
+        mboxDateStringToStruct((char *)date->data, MBOX_DATE_FORMAT, &d);
+        if (d.tm_hour != -1) {
+            return mboxDateStructToUnix(&d);
+        }
+    }
+    return 0;
+}
+
+mboxMsgLite *
+mboxMsgLiteFromBuffer(mboxBuf *buf, ssize_t start_offset, ssize_t end_offset,
+        mboxArena *arena)
+{
     mboxRBTree *headers = mboxParseEmailHeaders(buf);
     mboxBuf *from = mboxHeadersGet(headers, MBOX_HEADER_FROM);
     mboxBuf *subject = mboxHeadersGet(headers, MBOX_HEADER_SUBJECT);
     mboxBuf *date = mboxHeadersGet(headers, MBOX_HEADER_DATE);
     mboxBuf *msg_id = mboxHeadersGet(headers, MBOX_HEADER_MSG_ID);
-    mboxBuf *preview = mboxBufDupRaw(buf->data + buf->offset,
-            MBOX_BUF_PREVIEW_LEN, MBOX_BUF_PREVIEW_LEN);
+    size_t preview_len = buf->offset < buf->len ? buf->len - buf->offset : 0;
+    /* Do not run off the end of the message, a mapped message would be
+     * looking at the next one */
+    if (preview_len > MBOX_BUF_PREVIEW_LEN) {
+        preview_len = MBOX_BUF_PREVIEW_LEN;
+    }
+    mboxBuf *preview = mboxMsgBufDup(arena, buf->data + buf->offset,
+            preview_len, MBOX_BUF_PREVIEW_LEN);
     mboxBuf *from_line = mboxHeadersGet(headers, MBOX_HEADER_FROM_LINE);
 
-    long unix_timestamp = 0;
-    mboxMsgLite *msg = malloc(sizeof(mboxMsgLite));
-
-    if (date) {
-        mboxDateStringToStruct((char *)date->data, MBOX_DATE_FORMAT, &d);
-        if (d.tm_hour != -1) {
-            unix_timestamp = mboxDateStructToUnix(&d);
-        }
-    }
+    long unix_timestamp = mboxMsgTimestamp(date);
+    mboxMsgLite *msg = arena ? mboxArenaAlloc(arena, sizeof(mboxMsgLite)) :
+                               malloc(sizeof(mboxMsgLite));
 
     if (from == NULL) {
         // loggerDebug("FROM %.*s\n", 20, ctx->buf->data);
         mboxRBTreePrintKeysAsString(headers);
     }
 
-    msg->msg_id = mboxBufMaybeDup(msg_id);
-    msg->from = mboxBufMaybeDup(from);
-    msg->subject = mboxBufMaybeDup(subject);
-    msg->date = mboxBufMaybeDup(date);
-    msg->from_line = mboxBufMaybeDup(from_line);
+    msg->msg_id = mboxMsgBufMaybeDup(arena, msg_id);
+    msg->from = mboxMsgBufMaybeDup(arena, from);
+    msg->subject = mboxMsgBufMaybeDup(arena, subject);
+    msg->date = mboxMsgBufMaybeDup(arena, date);
+    msg->from_line = mboxMsgBufMaybeDup(arena, from_line);
     msg->preview = preview;
+    msg->in_arena = arena != NULL;
     msg->unix_timestamp = unix_timestamp;
     msg->start = start_offset;
     msg->end = end_offset;
+    msg->sender_id = MBOX_INTERN_NONE;
+    msg->domain_id = MBOX_INTERN_NONE;
+    msg->spans = NULL;
 
     /* Clean everything up */
     mboxRBTreeRelease(headers);
     return msg;
 }
 
+void
+mboxIOMsgRelease(mboxIOMsg *ctx)
+{
+    if (ctx) {
+        if (ctx->buf != &ctx->view) {
+            mboxBufRelease(ctx->buf);
+        }
+        free(ctx);
+    }
+}
+
 mboxMsgLite *
-mboxMsgLiteCreate(mboxIOMsg *ctx)
+mboxMsgLiteCreate(mboxIOMsg *ctx, mboxArena *arena)
 {
     mboxMsgLite *msg = mboxMsgLiteFromBuffer(ctx->buf, ctx->start_offset,
-            ctx->end_offset);
-    mboxBufRelease(ctx->buf);
-    free(ctx);
+            ctx->end_offset, arena);
+    mboxIOMsgRelease(ctx);
     return msg;
 }
 
+mboxBuf *
+mboxMsgFieldDecode(int field, mboxChar *raw, size_t len)
+{
+    mboxBuf header = { .data = raw, .len = len, .offset = 0 };
+    mboxBuf *value = NULL;
+
+    if (len == 0) {
+        return NULL;
+    }
+
+    switch (field) {
+    case MBOX_FIELD_PREVIEW:
+        return mboxBufDupRaw(raw, len, MBOX_BUF_PREVIEW_LEN);
+
+    case MBOX_FIELD_FROM_LINE:
+        value = mboxBufAlloc(len);
+        value->data[0] = '\0';
+        for (size_t i = 0; i < len; ++i) {
+            if (raw[i] != '\r') {
+                mboxBufPutChar(value, raw[i]);
+            }
+        }
+        return value;
+
+    default:
+        /* Past the name and ': ' */
+        while (header.offset < len && raw[header.offset] != ':') {
+            header.offset++;
+        }
+        header.offset += 2;
+        value = mboxBufAlloc(len);
+        value->data[0] = '\0';
+        if (header.offset < len) {
+            mboxParseHeaderValue(&header, value);
+        }
+        if (mboxBufIsMimeEncoded(value)) {
+            mboxBuf *decoded = mboxBufDecodeMimeEncoded(value);
+            mboxBufRelease(value);
+            return decoded;
+        }
+        return value;
+    }
+}
+
+mboxBuf **
+mboxMsgLiteFieldSlot(mboxMsgLite *msg, int field)
+{
+    switch (field) {
+    case MBOX_FIELD_FROM:
+        return &msg->from;
+    case MBOX_FIELD_SUBJECT:
+        return &msg->subject;
+    case MBOX_FIELD_DATE:
+        return &msg->date;
+    case MBOX_FIELD_MSG_ID:
+        return &msg->msg_id;
+    case MBOX_FIELD_FROM_LINE:
+        return &msg->from_line;
+    case MBOX_FIELD_PREVIEW:
+        return &msg->preview;
+    default:
+        return NULL;
+    }
+}
+
+mboxMsgLite *
+mboxMsgLiteFromBufferLazy(mboxBuf *buf, ssize_t start_offset,
+        ssize_t end_offset, mboxArena *arena)
+{
+    mboxMsgLite *msg = NULL;
+    mboxMsgSpan *spans = NULL;
+    mboxMsgSpan *date = NULL;
+    mboxBuf *decoded = NULL;
+
+    if (arena) {
+        msg = (mboxMsgLite *)mboxArenaAlloc(arena, sizeof(mboxMsgLite));
+        spans = (mboxMsgSpan *)mboxArenaAlloc(arena,
+                sizeof(mboxMsgSpan) * MBOX_FIELD_COUNT);
+    } else {
+        msg = (mboxMsgLite *)malloc(sizeof(mboxMsgLite));
+        spans = (mboxMsgSpan *)malloc(sizeof(mboxMsgSpan) * MBOX_FIELD_COUNT);
+    }
+
+    mboxParseHeaderSpans(buf, spans);
+    date = &spans[MBOX_FIELD_DATE];
+    decoded = mboxMsgFieldDecode(MBOX_FIELD_DATE, buf->data + date->offset,
+            date->len);
+
+    msg->msg_id = msg->from = msg->subject = msg->date = NULL;
+    msg->from_line = msg->preview = NULL;
+    msg->in_arena = arena != NULL;
+    msg->unix_timestamp = mboxMsgTimestamp(decoded);
+    msg->start = start_offset;
+    msg->end = end_offset;
+    msg->sender_id = MBOX_INTERN_NONE;
+    msg->domain_id = MBOX_INTERN_NONE;
+    msg->spans = spans;
+
+    mboxBufRelease(decoded);
+    return msg;
+}
+
+mboxMsgLite *
+mboxMsgLiteCreateLazy(mboxIOMsg *ctx, mboxArena *arena)
+{
+    mboxMsgLite *msg = mboxMsgLiteFromBufferLazy(ctx->buf, ctx->start_offset,
+            ctx->end_offset, arena);
+    mboxIOMsgRelease(ctx);
+    return msg;
+}
+
+size_t
+mboxMsgListEndOffset(mboxList *l)
+{
+    mboxLNode *n = l->root;
+    size_t end = 0;
+
+    for (size_t i = 0; i < l->len; ++i) {
+        mboxMsgLite *msg = (mboxMsgLite *)n->data;
+        if (msg->end > end) {
+            end = msg->end;
+        }
+        n = n->next;
+    }
+    return end;
+}
+
 int
 mboxMsgListCompareByDate(void *d1, void *d2)
 {
@@ -201,3 +396,132 @@ mboxMsgListFilterBySender(mboxList *l, char *sender)
 
     return filtered;
 }
+
+static int
+mboxMsgAddressSpace(mboxChar c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '"';
+}
+
+size_t
+mboxMsgSenderAddress(mboxBuf *from, char *out)
+{
+    mboxChar *s = from->data;
+    mboxChar *end = from->data + from->len;
+    mboxChar *open = memchr(s, '<', from->len);
+    size_t len = 0;
+
+    if (open) {
+        mboxChar *close = memchr(open + 1, '>', end - (open + 1));
+        if (close) {
+            s = open + 1;
+            end = close;
+        }
+    }
+
+    while (s < end && mboxMsgAddressSpace(*s)) {
+        s++;
+    }
+    while (s < end && len < MBOX_MSG_ADDRESS_LEN && *s != '\0' &&
+            *s != '(' && !mboxMsgAddressSpace(*s)) {
+        mboxChar c = *s++;
+        out[len++] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+    return len;
+}
+
+void
+mboxMsgLiteIntern(mboxMsgLite *msg, mboxIntern *d)
+{
+    char address[MBOX_MSG_ADDRESS_LEN];
+    size_t len = 0;
+    char *at = NULL;
+
+    if (msg->from == NULL) {
+        return;
+    }
+
+    len = mboxMsgSenderAddress(msg->from, address);
+    if (len == 0) {
+        return;
+    }
+    msg->sender_id = mboxInternAdd(d, address, len);
+
+    /* The last one, the local part may have its own */
+    for (size_t i = len; i > 0; --i) {
+        if (address[i - 1] == '@') {
+            at = &address[i];
+            break;
+        }
+    }
+    if (at && at < address + len) {
+        msg->domain_id = mboxInternAdd(d, at, address + len - at);
+    }
+}
+
+void
+mboxMsgListIntern(mboxList *l, mboxIntern *d)
+{
+    mboxLNode *n = l->root;
+
+    for (size_t i = 0; i < l->len; ++i) {
+        mboxMsgLiteIntern((mboxMsgLite *)n->data, d);
+        n = n->next;
+    }
+}
+
+mboxList *
+mboxMsgListFilterBySenderInterned(mboxList *l, mboxIntern *d, char *sender)
+{
+    mboxList *filtered = mboxListNew();
+    /* Ids handed out after this weren't matched */
+    size_t known = mboxInternLen(d);
+    uint64_t *matched = mboxInternMatch(d, sender);
+    mboxLNode *n = l->root;
+
+    for (size_t i = 0; i < l->len; ++i) {
+        mboxMsgLite *msg = (mboxMsgLite *)n->data;
+        uint32_t id = msg->sender_id;
+
+        if (id < known && mboxInternBit(matched, id)) {
+            mboxListAddTail(filtered, msg);
+        }
+        n = n->next;
+    }
+    free(matched);
+
+    return filtered;
+}
+
+mboxList *
+mboxMsgListFilterByDomain(mboxList *l, mboxIntern *d, char *domain)
+{
+    mboxList *filtered = mboxListNew();
+    char lower[MBOX_MSG_ADDRESS_LEN];
+    size_t len = strlen(domain);
+    uint32_t id;
+    mboxLNode *n = l->root;
+
+    if (len > MBOX_MSG_ADDRESS_LEN) {
+        return filtered;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        char c = domain[i];
+        lower[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+
+    id = mboxInternFind(d, lower, len);
+    if (id == MBOX_INTERN_NONE) {
+        return filtered;
+    }
+
+    for (size_t i = 0; i < l->len; ++i) {
+        mboxMsgLite *msg = (mboxMsgLite *)n->data;
+        if (msg->domain_id == id) {
+            mboxListAddTail(filtered, msg);
+        }
+        n = n->next;
+    }
+
+    return filtered;
+}
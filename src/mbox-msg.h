@@ -10,9 +10,12 @@
 #include <sys/types.h>
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "mbox-buf.h"
+#include "mbox-intern.h"
 #include "mbox-list.h"
+#include "mbox-memory.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,6 +24,23 @@ extern "C" {
 
 typedef struct _mboxMsgLite mboxMsgLite;
 
+/* The fields of a message that can be left in the file until asked for, see
+ * mboxSetLazy */
+#define MBOX_FIELD_FROM (0)
+#define MBOX_FIELD_SUBJECT (1)
+#define MBOX_FIELD_DATE (2)
+#define MBOX_FIELD_MSG_ID (3)
+#define MBOX_FIELD_FROM_LINE (4)
+#define MBOX_FIELD_PREVIEW (5)
+#define MBOX_FIELD_COUNT (6)
+
+/* Where a field is in the raw message. For a header this is the whole of it,
+ * name and any lines carrying it on included */
+typedef struct mboxMsgSpan {
+    uint32_t offset; /* From the start of the message */
+    uint32_t len;    /* 0 if the message doesn't have it */
+} mboxMsgSpan;
+
 typedef enum {
     MBOX_PTR_FULL_MESSAGE_OFFSET = 0,
     MBOX_PTR_HEADER_OFFSET,
@@ -33,6 +53,10 @@ typedef struct mboxIOMsg {
     mboxBuf *buf; /* Full message from from line to the start of the next one */
     size_t start_offset; /* Where the message starts in the file */
     size_t end_offset;   /* Where the message ends in the file */
+    mboxBuf view; /* When the file is mapped `buf` points here and borrows
+                     the bytes from the mapping rather than owning a copy */
+    mboxLNode *slot; /* Where the parsed message goes in its range's results,
+                        NULL when streaming */
 } mboxIOMsg;
 
 /* There is so much noise in the file that this should help cut it down,
@@ -50,17 +74,62 @@ struct _mboxMsgLite {
      * friends */
     size_t start; /* The start of this offset in the file */
     size_t end;   /* The end of the offset in the file */
+    int in_arena; /* It and its strings were allocated together in an arena,
+                     mboxMsgLiteRelease leaves it to be freed with that */
+    /* The sender's address and its domain in a dictionary of them, see
+     * mboxMsgLiteIntern. MBOX_INTERN_NONE until interned */
+    uint32_t sender_id;
+    uint32_t domain_id;
+    /* NULL unless parsed lazily, then MBOX_FIELD_COUNT spans and the fields
+     * above stay NULL until they are decoded. unix_timestamp is always set */
+    mboxMsgSpan *spans;
 };
 
+/* With `arena` NULL everything is malloced and the message can be released
+ * by itself */
 mboxMsgLite *mboxMsgLiteFromBuffer(mboxBuf *buf, ssize_t start_offset,
-        ssize_t end_offset);
-mboxMsgLite *mboxMsgLiteCreate(mboxIOMsg *ctx);
+        ssize_t end_offset, mboxArena *arena);
+mboxMsgLite *mboxMsgLiteCreate(mboxIOMsg *ctx, mboxArena *arena);
+/* The same but only finds where each field is, decoding just the date for
+ * the timestamp */
+mboxMsgLite *mboxMsgLiteFromBufferLazy(mboxBuf *buf, ssize_t start_offset,
+        ssize_t end_offset, mboxArena *arena);
+mboxMsgLite *mboxMsgLiteCreateLazy(mboxIOMsg *ctx, mboxArena *arena);
+/* Decode `field` from `raw`, the bytes of its span. Returns a new buf or NULL
+ * if the span is empty */
+mboxBuf *mboxMsgFieldDecode(int field, mboxChar *raw, size_t len);
+/* Where `field` lives on the message */
+mboxBuf **mboxMsgLiteFieldSlot(mboxMsgLite *msg, int field);
+void mboxIOMsgRelease(mboxIOMsg *ctx);
 void mboxMsgLitePrint(mboxMsgLite *m);
 void mboxMsgLiteRelease(mboxMsgLite *m);
 void mboxMsgListSortByDate(mboxList *msglist);
 void mboxMsgListSortBySender(mboxList *msglist);
 mboxList *mboxMsgListFilterBySender(mboxList *l, char *sender);
 
+/* Longest address kept when interning, anything longer is cut short */
+#define MBOX_MSG_ADDRESS_LEN (320)
+
+/* The address in a From header lowercased, what is between the angle
+ * brackets if there are any else the first word. Writes at most
+ * MBOX_MSG_ADDRESS_LEN bytes to `out` and returns how many */
+size_t mboxMsgSenderAddress(mboxBuf *from, char *out);
+/* Add the message's sender and domain to `d` and point it at them */
+void mboxMsgLiteIntern(mboxMsgLite *msg, mboxIntern *d);
+/* The same for every message in the list, for those not parsed by an mbox
+ * such as a list loaded from an index */
+void mboxMsgListIntern(mboxList *l, mboxIntern *d);
+/* Like mboxMsgListFilterBySender but `sender` is matched against each
+ * distinct address in `d` once, then each message by its id. Only looks at
+ * the address, not the name in front of it, and keeps the list's order */
+mboxList *mboxMsgListFilterBySenderInterned(mboxList *l, mboxIntern *d,
+        char *sender);
+/* Messages from exactly `domain`, ignoring case */
+mboxList *mboxMsgListFilterByDomain(mboxList *l, mboxIntern *d, char *domain);
+/* Where the last message in the list ends, somewhere to pick up from with
+ * mboxParseAppended */
+size_t mboxMsgListEndOffset(mboxList *l);
+
 #ifdef __cplusplus
 }
 #endif
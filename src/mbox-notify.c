@@ -0,0 +1,101 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbox-logger.h"
+#include "mbox-notify.h"
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+
+int
+mboxNotifyInit(mboxNotify *n)
+{
+    n->rfd = n->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (n->rfd == -1) {
+        loggerDebug("Failed to create eventfd: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+void
+mboxNotifySignal(mboxNotify *n)
+{
+    uint64_t one = 1;
+    /* Can only fail if the count would overflow, it is readable anyway */
+    (void)!write(n->wfd, &one, sizeof(one));
+}
+
+int
+mboxNotifyDrain(mboxNotify *n)
+{
+    uint64_t count = 0;
+    return read(n->rfd, &count, sizeof(count)) == sizeof(count);
+}
+#else
+int
+mboxNotifyInit(mboxNotify *n)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        loggerDebug("Failed to create pipe: %s\n", strerror(errno));
+        n->rfd = n->wfd = -1;
+        return 0;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    n->rfd = fds[0];
+    n->wfd = fds[1];
+    return 1;
+}
+
+void
+mboxNotifySignal(mboxNotify *n)
+{
+    char one = 1;
+    /* A full pipe is readable anyway */
+    (void)!write(n->wfd, &one, sizeof(one));
+}
+
+int
+mboxNotifyDrain(mboxNotify *n)
+{
+    char bytes[64];
+    int signalled = 0;
+
+    while (read(n->rfd, bytes, sizeof(bytes)) > 0) {
+        signalled = 1;
+    }
+    return signalled;
+}
+#endif
+
+void
+mboxNotifyClose(mboxNotify *n)
+{
+    if (n->rfd != -1) {
+        close(n->rfd);
+    }
+    if (n->wfd != n->rfd && n->wfd != -1) {
+        close(n->wfd);
+    }
+    n->rfd = n->wfd = -1;
+}
@@ -0,0 +1,33 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_NOTIFY_H
+#define __MBOX_NOTIFY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A descriptor that becomes readable when signalled from any thread, for
+ * waking up someone else's event loop. An eventfd where there is one, else
+ * the two ends of a pipe. Signals before it is drained collapse into one */
+typedef struct mboxNotify {
+    int rfd; /* What to poll */
+    int wfd; /* The same as rfd for an eventfd */
+} mboxNotify;
+
+/* Returns 0 if no descriptor could be made */
+int mboxNotifyInit(mboxNotify *n);
+void mboxNotifySignal(mboxNotify *n);
+/* Make it unreadable again, returns 1 if it had been signalled */
+int mboxNotifyDrain(mboxNotify *n);
+void mboxNotifyClose(mboxNotify *n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
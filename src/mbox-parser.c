@@ -21,6 +21,8 @@
 #include "mbox-io.h"
 #include "mbox-logger.h"
 #include "mbox-parser.h"
+#include "mbox-scan.h"
+#include "macros.h"
 
 #define MBOX_MESSAGE_RETRIES (5)
 
@@ -40,7 +42,9 @@ mboxParserCtxInit(mboxParserCtx *ctx, int id, int readfd, size_t file_size)
     ctx->id = id;
     ctx->parsed = 0;
     ctx->err = MBOX_IO_OK;
+    ctx->borrow = 0;
     ctx->ioctx = mboxIONew(readfd, file_size);
+    mboxIOUseRing(ctx->ioctx);
 }
 
 /* Create a new context */
@@ -216,6 +220,115 @@ mboxBufMatchFromLine(mboxBuf *buf)
             buf->data[buf->offset + 4] == ' ';
 }
 
+void
+mboxParseHeaderValue(mboxBuf *buf, mboxBuf *value)
+{
+    while (1) {
+        while (buf->offset < buf->len && buf->data[buf->offset] != '\n') {
+            char ch = buf->data[buf->offset];
+            /* There _shouldn't_ be '\r' but there seem to be */
+            if (ch != '\r' && ch != '\t') {
+                mboxBufPutChar(value, ch);
+            }
+            buf->offset++;
+        }
+        buf->offset++;
+        if (buf->offset < buf->len &&
+                (mboxBufMatchChar(buf, ' ') || mboxBufMatchChar(buf, '\t'))) {
+            /* Keep parsing */
+            continue;
+        }
+        return;
+    }
+}
+
+static const struct {
+    char *name;
+    size_t len;
+} mboxSpanHeaders[] = {
+    [MBOX_FIELD_FROM] = { "From:", 5 },
+    [MBOX_FIELD_SUBJECT] = { "Subject:", 8 },
+    [MBOX_FIELD_DATE] = { "Date:", 5 },
+    [MBOX_FIELD_MSG_ID] = { "Message-ID:", 11 },
+};
+
+/* Which field the header starting `line` is for, -1 for none */
+static int
+mboxParseSpanField(mboxChar *line, size_t len)
+{
+    for (int i = 0; i < (int)static_sizeof(mboxSpanHeaders); ++i) {
+        if (len >= mboxSpanHeaders[i].len &&
+                strncasecmp((char *)line, mboxSpanHeaders[i].name,
+                        mboxSpanHeaders[i].len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+size_t
+mboxParseHeaderSpans(mboxBuf *buf, mboxMsgSpan *spans)
+{
+    mboxChar *data = buf->data;
+    size_t len = buf->len;
+    size_t i = buf->offset;
+
+    memset(spans, 0, sizeof(mboxMsgSpan) * MBOX_FIELD_COUNT);
+
+    while (i < len && isLine(data[i])) {
+        i++;
+    }
+
+    if (len - i >= 5 && memcmp(data + i, "From ", 5) == 0) {
+        size_t line = i;
+        while (i < len && data[i] != '\n') {
+            i++;
+        }
+        spans[MBOX_FIELD_FROM_LINE].offset = line;
+        spans[MBOX_FIELD_FROM_LINE].len = i - line;
+        i++;
+    }
+
+    while (i < len) {
+        size_t line = i;
+        int field;
+
+        /* A blank line and then the body */
+        if (isLine(data[i])) {
+            while (i < len && isLine(data[i])) {
+                i++;
+            }
+            break;
+        }
+
+        /* The header and any lines carrying it on */
+        do {
+            while (i < len && data[i] != '\n') {
+                i++;
+            }
+            i++;
+        } while (i < len && (data[i] == ' ' || data[i] == '\t'));
+        if (i > len) {
+            i = len;
+        }
+
+        field = mboxParseSpanField(data + line, i - line);
+        if (field != -1 && spans[field].len == 0) {
+            spans[field].offset = line;
+            spans[field].len = i - line;
+        }
+    }
+
+    if (i > len) {
+        i = len;
+    }
+    spans[MBOX_FIELD_PREVIEW].offset = i;
+    spans[MBOX_FIELD_PREVIEW].len = len - i < MBOX_BUF_PREVIEW_LEN ?
+            len - i :
+            MBOX_BUF_PREVIEW_LEN;
+    return i;
+}
+
 /* Can be both used by the io parser and the parser with a full message in the
  * buffer. IO Parser has to use it to be able to determine where the boundary is
  */
@@ -254,42 +367,23 @@ mboxParseEmailHeaders(mboxBuf *buf)
         /* Move past ': ' */
         buf->offset += 2;
 
-        while (1) {
-            while (buf->data[buf->offset] != '\n') {
-                char ch = buf->data[buf->offset];
-                /* There _shouldn't_ be '\r' but there seem to be */
-                if (ch != '\r' && ch != '\t') {
-                    mboxBufPutChar(value, ch);
-                }
-                buf->offset++;
-            }
-            buf->offset++;
-            if (mboxBufMatchChar(buf, ' ') || mboxBufMatchChar(buf, '\t')) {
-                /* Keep parsing */
-                continue;
-                /* Finished parsing all headers */
-            } else {
-                if (mboxBufIsMimeEncoded(value)) {
-                    mboxBuf *decoded = mboxBufDecodeMimeEncoded(value);
-                    mboxRBTreeInsert(headers, mboxBufDup(key), decoded);
-                } else {
-                    mboxRBTreeInsert(headers, mboxBufDup(key),
-                            mboxBufDup(value));
-                }
-
-                mboxBufSlice(key, 0, 0, 0);
-                mboxBufSlice(value, 0, 0, 0);
+        mboxParseHeaderValue(buf, value);
+        if (mboxBufIsMimeEncoded(value)) {
+            mboxBuf *decoded = mboxBufDecodeMimeEncoded(value);
+            mboxRBTreeInsert(headers, mboxBufDup(key), decoded);
+        } else {
+            mboxRBTreeInsert(headers, mboxBufDup(key), mboxBufDup(value));
+        }
 
-                if (isLine(mboxBufGetChar(buf))) {
-                    while (isLine(mboxBufGetChar(buf))) {
-                        mboxBufAdvance(buf);
-                    }
-                    run = 0;
-                }
+        mboxBufSlice(key, 0, 0, 0);
+        mboxBufSlice(value, 0, 0, 0);
 
-                /* Finished parsing the value */
-                break;
+        /* Finished parsing all headers */
+        if (isLine(mboxBufGetChar(buf))) {
+            while (isLine(mboxBufGetChar(buf))) {
+                mboxBufAdvance(buf);
             }
+            run = 0;
         }
     }
     mboxBufRelease(key);
@@ -507,62 +601,64 @@ mboxIsFromLine(mboxChar *s)
     return 0;
 }
 
-/* Go backwards until pattern 'From ' */
-void
+/* Find the first message that belongs to this context, that is the first
+ * 'From ' line whose 'F' is in [start_offset, end_offset). Whatever comes
+ * before it is the tail of a message the previous range finishes off, so
+ * neighbouring ranges never have to agree on anything. Returns 0 if no message
+ * starts in the range */
+int
 mboxParserCtxSeekStart(mboxParserCtx *ctx)
 {
     mboxIOCtx *ioctx = ctx->ioctx;
     mboxBuf *buf = ioctx->buf;
     size_t idx = 0;
-    ssize_t jumpsize = 0;
+    size_t window = 0;
     ssize_t rbytes = 0;
-    ssize_t offset = ioctx->file_offset;
+    /* Start a byte early to catch the '\n' of a 'From ' line on the boundary */
+    size_t offset = ioctx->start_offset > 0 ? ioctx->start_offset - 1 : 0;
     int found_offset = 0;
 
-    jumpsize = MBOX_IO_READ_SIZE;
-
-    while (1) {
-
-        offset = offset - jumpsize < 0 ? 0 : offset - jumpsize;
+    while (offset < ioctx->end_offset) {
         rbytes = mboxIORead(ioctx, MBOX_IO_READ_SIZE, 0, offset);
 
         if (rbytes == 0 || ioctx->err != 0) {
             break;
         }
 
-        for (idx = 0; idx < buf->len; ++idx) {
-            if (ioctx->file_offset != 0) {
-                if (buf->data[idx] == '\n' && buf->data[idx + 1] == 'F' &&
-                        buf->data[idx + 2] == 'r' &&
-                        buf->data[idx + 3] == 'o' &&
-                        buf->data[idx + 4] == 'm' &&
-                        buf->data[idx + 5] == ' ') {
-                    ioctx->start_offset = offset + idx;
-                    found_offset = 1;
-                    break;
-                }
-            } else {
-                if (buf->data[idx] == 'F' && buf->data[idx + 1] == 'r' &&
-                        buf->data[idx + 2] == 'o' &&
-                        buf->data[idx + 3] == 'm' &&
-                        buf->data[idx + 4] == ' ') {
-                    ioctx->start_offset = offset + idx;
-                    found_offset = 1;
-                    break;
-                }
-            }
+        /* A mapped read hands back the rest of the file, only look at what a
+         * normal read would have given us */
+        window = rbytes < MBOX_IO_READ_SIZE ? rbytes : MBOX_IO_READ_SIZE;
+
+        if (offset == 0 && window >= 5 &&
+                memcmp(buf->data, "From ", 5) == 0) {
+            ioctx->start_offset = 0;
+            found_offset = 1;
+            break;
+        }
+
+        idx = mboxScanFromLine(buf->data, 0, window > 5 ? window - 5 : 0);
+        if (idx + 5 < window) {
+            ioctx->start_offset = offset + idx + 1;
+            found_offset = ioctx->start_offset < ioctx->end_offset;
+            break;
         }
 
-        if (found_offset) {
+        if (window <= 5) {
             break;
         }
+        /* Overlap the reads so a '\nFrom ' split across them is not lost */
+        offset += window - 5;
     }
-    mboxBufSetLen(buf, 0);
-    buf->offset = 0;
+
+    mboxIOReset(ioctx);
+    ioctx->offset = ioctx->start_offset;
     ioctx->file_offset = ioctx->start_offset;
+    return found_offset;
 }
 
-/* TODO: this is the think we need to optimise the hell out of */
+/* Every byte of the mbox goes through here. The bulk of the buffer is handed
+ * to the vectorised scanner, the last 10 bytes are still done one line at a
+ * time as that is where we decide whether to read in more of the file */
 int
 mboxParserCtxSeekNextFromLine(mboxParserCtx *ctx)
 {
@@ -571,6 +667,11 @@ mboxParserCtxSeekNextFromLine(mboxParserCtx *ctx)
     ssize_t rbytes = 0;
 
     while (1) {
+        if (buf->offset + 10 < buf->len) {
+            buf->offset = mboxScanFromLine(buf->data, buf->offset,
+                    buf->len - 10);
+        }
+
         /* Go one line at a time */
         while (buf->offset < buf->len) {
             if (buf->data[buf->offset] == '\n') {
@@ -585,7 +686,13 @@ mboxParserCtxSeekNextFromLine(mboxParserCtx *ctx)
         }
 
         if (buf->offset + 10 >= buf->len) {
-            if (ioctx->file_offset > ioctx->end_offset) {
+            /* Any 'From ' line after here starts in the next range, rather
+             * than scan on for it we leave this message to be stitched once
+             * that range has found it. The last range reads to the end */
+            if (ioctx->end_offset < ioctx->file_size &&
+                    ioctx->offset + buf->offset + 1 >= ioctx->end_offset) {
+                ctx->tail_msg = ioctx->offset;
+                ctx->err = MBOX_PARSE_DONE;
                 return 0;
             }
 
@@ -686,17 +793,42 @@ mboxParserCtxSeekHeaders(mboxParserCtx *ctx)
     return 1;
 }
 
+/* Wrap the first `len` bytes of the buffer up as a message */
+static mboxIOMsg *
+mboxParserCtxMsgNew(mboxParserCtx *ctx, size_t len, size_t start, size_t end)
+{
+    mboxBuf *buf = ctx->ioctx->buf;
+    mboxIOMsg *msg = malloc(sizeof(mboxIOMsg));
+
+    /* Nothing to copy, the message can point straight into the mapping which
+     * outlives the parse, or into the buffer if it is parsed before we read
+     * on */
+    if (ctx->ioctx->map || ctx->borrow) {
+        msg->view.data = buf->data;
+        msg->view.offset = 0;
+        msg->view.len = len;
+        msg->view.capacity = 0;
+        msg->buf = &msg->view;
+    } else {
+        msg->buf = mboxBufDupRaw(buf->data, len, len);
+    }
+    msg->start_offset = start;
+    msg->end_offset = end;
+    msg->slot = NULL;
+
+    ctx->parsed++;
+
+    return msg;
+}
+
 /* Scan from current From line up to but not including the next 'F' */
 mboxIOMsg *
 mboxParserCtxGetNextMessage(mboxParserCtx *ctx)
 {
     mboxIOCtx *ioctx = ctx->ioctx;
     mboxBuf *buf = ioctx->buf;
-    mboxBuf *full_msg = NULL;
-    mboxIOMsg *msg = NULL;
     size_t msg_start = ioctx->offset;
     size_t msg_end = 0;
-    size_t newlen = buf->len - buf->offset;
 
     /**
      * Move the buffer along, we can drop what we have parsed and move what
@@ -705,13 +837,7 @@ mboxParserCtxGetNextMessage(mboxParserCtx *ctx)
      * Then set the length of the buffer, the offset to zero (so we process
      * what is in the buffer)
      */
-    if (newlen != 0) {
-        mboxBufSlice(buf, buf->offset, 0, newlen);
-    }
-
-    /* Prepare the buffer for the next parse */
-    mboxBufSetLen(buf, newlen);
-    mboxBufSetOffset(buf, 0);
+    mboxIOConsume(ioctx, buf->offset);
 
     /* It's faster to scan for \n\n than it is to search for the from line,
      * so may as well keep this */
@@ -731,23 +857,39 @@ mboxParserCtxGetNextMessage(mboxParserCtx *ctx)
         ctx->err = MBOX_PARSE_DONE;
     }
 
-    full_msg = mboxBufDupRaw(buf->data, buf->offset, buf->offset);
-    msg = malloc(sizeof(mboxIOMsg));
-    msg->buf = full_msg;
-    msg->start_offset = msg_start;
-    msg->end_offset = msg_end;
+    return mboxParserCtxMsgNew(ctx, buf->offset, msg_start, msg_end);
+}
 
-    ctx->parsed++;
+/* Everything we need is read in one go, there is nothing to scan for */
+mboxIOMsg *
+mboxParserCtxGetMessageAt(mboxParserCtx *ctx, size_t start, size_t end)
+{
+    mboxIOCtx *ioctx = ctx->ioctx;
+    mboxBuf *buf = ioctx->buf;
+    ssize_t rbytes = 0;
 
-    return msg;
+    mboxIOReset(ioctx);
+    ioctx->offset = start;
+    ioctx->file_offset = start;
+
+    while (buf->len < end - start) {
+        rbytes = mboxIORead(ioctx, MBOX_IO_READ_SIZE, buf->len,
+                ioctx->file_offset);
+
+        if (rbytes == 0 || ioctx->err != 0) {
+            return NULL;
+        }
+        ioctx->file_offset += rbytes;
+    }
+
+    return mboxParserCtxMsgNew(ctx, end - start, start, end);
 }
 
 void
 mboxParserCtxRelease(mboxParserCtx *ctx)
 {
     if (ctx) {
-        mboxIOCtx *ioctx = ctx->ioctx;
-        mboxBufRelease(ioctx->buf);
+        mboxIORelease(ctx->ioctx);
         free(ctx);
     }
 }
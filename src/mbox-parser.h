@@ -36,6 +36,9 @@ extern "C" {
 
 #define MBOX_PARSE_DONE (1)
 
+/* For range offsets that have not been found */
+#define MBOX_PARSE_NO_OFFSET ((size_t)-1)
+
 typedef enum {
     MBOX_ERR_EOF = -1,
     MBOX_ERR_NO_FILE = 0,
@@ -54,6 +57,18 @@ typedef struct mboxParserCtx {
     int err;          /* Error code '0' is all good */
     size_t parsed;    /* How many messages this context has passed*/
     mboxIOCtx *ioctx; /* File context that we are parsing */
+    size_t range_start; /* This context parses every message whose 'From ' */
+    size_t range_end;   /* line starts in [range_start, range_end) */
+    size_t first_msg;   /* Where the first message in the range starts */
+    size_t tail_msg; /* Start of the last message if it ran past range_end,
+                        it gets stitched together once the next range's
+                        first_msg is known */
+    struct mboxGzReader *gz; /* Left over from reading a gzip range, the
+                                stitch carries on inflating from here */
+    int borrow; /* Messages point into the read buffer rather than being
+                   copied out, for when each is done with before the next is
+                   read */
+    mboxList *results; /* What was parsed from this range in file order */
 } mboxParserCtx;
 
 /* Initialise context, not needed if new was used to create the context */
@@ -70,8 +85,18 @@ ssize_t mboxParserCtxRead(mboxParserCtx *ctx, size_t size, size_t buf_offset,
 /* Parse the email headers to a redblack tree */
 mboxRBTree *mboxParseEmailHeaders(mboxBuf *buf);
 
-/* Find the starting 'From' pattern */
-void mboxParserCtxSeekStart(mboxParserCtx *ctx);
+/* Read a header's value from just after its ': ' to the end of its last
+ * line, appending to `value` without the line breaks and tabs */
+void mboxParseHeaderValue(mboxBuf *buf, mboxBuf *value);
+
+/* Without copying anything find where the from line, From, Subject, Date and
+ * Message-ID headers and the preview are, the first of each header counts.
+ * Returns where the body starts */
+size_t mboxParseHeaderSpans(mboxBuf *buf, mboxMsgSpan *spans);
+
+/* Find the first 'From ' line starting within the range set on the io
+ * context, returns 0 if there isn't one */
+int mboxParserCtxSeekStart(mboxParserCtx *ctx);
 
 /* Free a context */
 void mboxParserCtxRelease(mboxParserCtx *ctx);
@@ -79,6 +104,11 @@ void mboxParserCtxRelease(mboxParserCtx *ctx);
 /* Will return a mboxIOMsg containing a full message ready to be parsed */
 mboxIOMsg *mboxParserCtxGetNextMessage(mboxParserCtx *ctx);
 
+/* The message in [start, end) of the file, for when we already know where it
+ * ends */
+mboxIOMsg *mboxParserCtxGetMessageAt(mboxParserCtx *ctx, size_t start,
+        size_t end);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,137 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mbox-queue.h"
+
+mboxQueue *
+mboxQueueNew(size_t capacity)
+{
+    mboxQueue *q = (mboxQueue *)malloc(sizeof(mboxQueue));
+    q->items = (void **)malloc(sizeof(void *) * capacity);
+    q->capacity = capacity;
+    q->head = 0;
+    q->len = 0;
+    q->reserved = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    return q;
+}
+
+int
+mboxQueueReserve(mboxQueue *q)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->closed && q->len + q->reserved >= q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    if (!q->closed) {
+        q->reserved++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+int
+mboxQueueReserveTimed(mboxQueue *q, int timeout_ms)
+{
+    struct timespec deadline;
+    int ok = -1;
+    int err = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->closed && q->len + q->reserved >= q->capacity &&
+            timeout_ms > 0 && err != ETIMEDOUT) {
+        err = pthread_cond_timedwait(&q->not_full, &q->lock, &deadline);
+    }
+    if (q->closed) {
+        ok = 0;
+    } else if (q->len + q->reserved < q->capacity) {
+        q->reserved++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+int
+mboxQueuePush(mboxQueue *q, void *item)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&q->lock);
+    q->reserved--;
+    if (!q->closed) {
+        q->items[(q->head + q->len) % q->capacity] = item;
+        q->len++;
+        ok = 1;
+        pthread_cond_signal(&q->not_empty);
+    } else {
+        /* Someone may be waiting on the slot */
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+void *
+mboxQueuePop(mboxQueue *q)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->len == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->len) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->len--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+void
+mboxQueueClose(mboxQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_full);
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void
+mboxQueueRelease(mboxQueue *q)
+{
+    if (q) {
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->not_full);
+        pthread_cond_destroy(&q->not_empty);
+        free(q->items);
+        free(q);
+    }
+}
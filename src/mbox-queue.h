@@ -0,0 +1,58 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_QUEUE_H
+#define __MBOX_QUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A fixed size blocking FIFO. Producers reserve a slot before they start on
+ * an item and push it when it is ready, so everything between the two counts
+ * towards the limit as well as what is sitting in the queue */
+typedef struct mboxQueue {
+    void **items;
+    size_t capacity;
+    size_t head;     /* Index of the next item to pop */
+    size_t len;      /* Items in the queue */
+    size_t reserved; /* Slots handed out that have not been pushed yet */
+    int closed;      /* Nothing more will be pushed */
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+} mboxQueue;
+
+mboxQueue *mboxQueueNew(size_t capacity);
+
+/* Blocks until there is a free slot, returns 0 if the queue was closed */
+int mboxQueueReserve(mboxQueue *q);
+
+/* The same but gives up after `timeout_ms`, 0 to not wait at all. Returns -1
+ * if it timed out */
+int mboxQueueReserveTimed(mboxQueue *q, int timeout_ms);
+
+/* Push into a reserved slot, returns 0 if the queue was closed in which case
+ * the item is still the caller's */
+int mboxQueuePush(mboxQueue *q, void *item);
+
+/* Blocks until there is an item, returns NULL once the queue is closed and
+ * empty */
+void *mboxQueuePop(mboxQueue *q);
+
+/* Wakes everyone up, pushes and reservations fail from here on but what is
+ * already queued can still be popped */
+void mboxQueueClose(mboxQueue *q);
+void mboxQueueRelease(mboxQueue *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,6 +14,7 @@
 #include <stdlib.h>
 
 #include "mbox-buf.h"
+#include "mbox-memory.h"
 #include "mbox-redblacktree.h"
 
 static rbNode RB_SENTINAL[1];
@@ -38,7 +39,7 @@ rbTreeNew(rbFreeKey *freekey, rbFreeValue *freevalue, rbCompareKey *keycmp)
 static rbNode *
 rbNodeNew(void *key, void *value)
 {
-    rbNode *n = malloc(sizeof(rbNode));
+    rbNode *n = mboxMemAlloc(sizeof(rbNode));
     n->key = key;
     n->value = value;
     n->color = RB_RED;
@@ -59,7 +60,7 @@ rbNodeRelease(mboxRBTree *t, rbNode *n)
             t->freevalue(n->value);
         }
 
-        free(n);
+        mboxMemFree(n);
     }
 }
 
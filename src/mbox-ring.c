@@ -0,0 +1,87 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbox-logger.h"
+#include "mbox-ring.h"
+
+#ifdef HAVE_MEMFD_CREATE
+mboxRing *
+mboxRingNew(size_t min_size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (min_size + page - 1) & ~(page - 1);
+    mboxChar *reserve = NULL;
+    mboxRing *ring = NULL;
+    int fd = memfd_create("mbox-ring", MFD_CLOEXEC);
+
+    if (fd == -1) {
+        loggerDebug("memfd_create failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        goto err;
+    }
+
+    /* Grab enough address space for both halves so nothing else can be placed
+     * between them */
+    reserve = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+            0);
+    if (reserve == MAP_FAILED) {
+        goto err;
+    }
+
+    if (mmap(reserve, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                0) == MAP_FAILED ||
+            mmap(reserve + size, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(reserve, size * 2);
+        goto err;
+    }
+
+    /* The mappings keep the memory alive */
+    close(fd);
+
+    ring = (mboxRing *)malloc(sizeof(mboxRing));
+    ring->base = reserve;
+    ring->size = size;
+    return ring;
+
+err:
+    loggerDebug("Failed to map ring: %s\n", strerror(errno));
+    close(fd);
+    return NULL;
+}
+#else
+mboxRing *
+mboxRingNew(size_t min_size)
+{
+    (void)min_size;
+    return NULL;
+}
+#endif
+
+void
+mboxRingRelease(mboxRing *ring)
+{
+    if (ring) {
+        munmap(ring->base, ring->size * 2);
+        free(ring);
+    }
+}
@@ -0,0 +1,47 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_RING_H
+#define __MBOX_RING_H
+
+#include <stddef.h>
+
+#include "mbox-buf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A 'magic' ring buffer, the same pages are mapped twice back to back so
+ * anything up to `size` bytes starting anywhere in the first mapping can be
+ * read and written as if it were contiguous. Dropping bytes from the front is
+ * then just moving a pointer */
+typedef struct mboxRing {
+    mboxChar *base; /* Start of the first mapping */
+    size_t size;    /* Size of one mapping, always a multiple of the page size */
+} mboxRing;
+
+/* Returns NULL if the platform can't do it */
+mboxRing *mboxRingNew(size_t min_size);
+void mboxRingRelease(mboxRing *ring);
+
+/* Move a pointer into the ring along by `by`, wrapping it back into the first
+ * mapping */
+static inline mboxChar *
+mboxRingAdvance(mboxRing *ring, mboxChar *ptr, size_t by)
+{
+    ptr += by;
+    while (ptr >= ring->base + ring->size) {
+        ptr -= ring->size;
+    }
+    return ptr;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mbox-logger.h"
+#include "mbox-runtime.h"
+#include "mbox-worker.h"
+
+static mboxRuntime *mbox_runtime_default = NULL;
+static pthread_once_t mbox_runtime_once = PTHREAD_ONCE_INIT;
+
+/* Whole cpus worth of quota rounded up, 0 if there is no limit. cgroup v2
+ * has "max 100000" or "<quota> <period>" in cpu.max, v1 has the two in
+ * separate files with a quota of -1 for no limit */
+static size_t
+mboxRuntimeCgroupCpus(void)
+{
+    FILE *fp = NULL;
+    long quota = -1;
+    long period = 0;
+    char max[32];
+
+    if ((fp = fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL) {
+        if (fscanf(fp, "%31s %ld", max, &period) == 2) {
+            quota = strtol(max, NULL, 10);
+            if (max[0] == 'm') {
+                quota = -1;
+            }
+        }
+        fclose(fp);
+    } else if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) !=
+            NULL) {
+        if (fscanf(fp, "%ld", &quota) != 1) {
+            quota = -1;
+        }
+        fclose(fp);
+        if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) !=
+                NULL) {
+            if (fscanf(fp, "%ld", &period) != 1) {
+                period = 0;
+            }
+            fclose(fp);
+        }
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return (size_t)((quota + period - 1) / period);
+}
+
+/* Fills `cpus` with the ones we may run on, returns how many */
+static size_t
+mboxRuntimeAllowedCpus(int *cpus, size_t max)
+{
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(CPU_ISSET)
+    cpu_set_t set;
+    size_t count = 0;
+
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &set)) {
+                if (cpus && count < max) {
+                    cpus[count] = i;
+                }
+                count++;
+            }
+        }
+        if (count > 0) {
+            return count;
+        }
+    }
+#else
+    (void)cpus;
+    (void)max;
+#endif
+    return 0;
+}
+
+size_t
+mboxRuntimeDefaultThreads(void)
+{
+    size_t count = mboxRuntimeAllowedCpus(NULL, 0);
+    size_t quota = mboxRuntimeCgroupCpus();
+
+    if (count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = online > 0 ? (size_t)online : 1;
+    }
+    if (quota > 0 && quota < count) {
+        count = quota;
+    }
+    return count;
+}
+
+mboxRuntime *
+mboxRuntimeNew(mboxRuntimeConfig *config)
+{
+    mboxRuntime *rt = (mboxRuntime *)malloc(sizeof(mboxRuntime));
+    size_t threads = config ? config->threads : 0;
+
+    rt->threads = threads ? threads : mboxRuntimeDefaultThreads();
+    rt->pool = mboxWorkerPoolNew(rt->threads);
+
+    if (config == NULL) {
+        return rt;
+    }
+
+    if (config->cpus && config->cpu_count > 0) {
+        if (!mboxWorkerPoolSetAffinity(rt->pool, config->cpus,
+                    config->cpu_count, config->pin)) {
+            loggerDebug("Failed to set worker affinity\n");
+        }
+    } else if (config->pin) {
+        /* Pin over whatever we are allowed */
+        size_t count = mboxRuntimeAllowedCpus(NULL, 0);
+        int *cpus = (int *)malloc(sizeof(int) * (count ? count : 1));
+
+        count = mboxRuntimeAllowedCpus(cpus, count);
+        if (count == 0 ||
+                !mboxWorkerPoolSetAffinity(rt->pool, cpus, count, 1)) {
+            loggerDebug("Failed to pin workers\n");
+        }
+        free(cpus);
+    }
+    return rt;
+}
+
+void
+mboxRuntimeRelease(mboxRuntime *rt)
+{
+    if (rt && rt != mbox_runtime_default) {
+        mboxWorkerPoolRelease(rt->pool);
+        free(rt);
+    }
+}
+
+size_t
+mboxRuntimeThreadCount(mboxRuntime *rt)
+{
+    return rt->threads;
+}
+
+mboxWorkerPoolCounters *
+mboxRuntimeStats(mboxRuntime *rt)
+{
+    return mboxWorkerPoolStats(rt->pool);
+}
+
+void
+mboxRuntimeStatsReset(mboxRuntime *rt)
+{
+    mboxWorkerPoolStatsReset(rt->pool);
+}
+
+void
+mboxRuntimeStatsRelease(mboxWorkerPoolCounters *stats)
+{
+    mboxWorkerPoolStatsRelease(stats);
+}
+
+static void
+mboxRuntimeDefaultInit(void)
+{
+    mbox_runtime_default = mboxRuntimeNew(NULL);
+}
+
+mboxRuntime *
+mboxRuntimeDefault(void)
+{
+    pthread_once(&mbox_runtime_once, mboxRuntimeDefaultInit);
+    return mbox_runtime_default;
+}
@@ -0,0 +1,60 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_RUNTIME_H
+#define __MBOX_RUNTIME_H
+
+#include <stddef.h>
+
+#include "mbox-worker.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The threads every parse and index load runs on. Starting and stopping
+ * threads for each mailbox opened adds up, so they are started once and
+ * shared. Each parse gets its own group of jobs on the pool and only waits
+ * for those */
+typedef struct mboxRuntime {
+    mboxWorkerPool *pool;
+    size_t threads;
+} mboxRuntime;
+
+typedef struct mboxRuntimeConfig {
+    size_t threads; /* 0 for mboxRuntimeDefaultThreads() */
+    int *cpus;      /* Cpus the workers may run on, NULL for any we are
+                       allowed */
+    size_t cpu_count;
+    int pin; /* Each worker on a single cpu, round robin over `cpus` */
+} mboxRuntimeConfig;
+
+/* `config` can be NULL for the defaults */
+mboxRuntime *mboxRuntimeNew(mboxRuntimeConfig *config);
+
+/* Every mbox using it must have been released first */
+void mboxRuntimeRelease(mboxRuntime *rt);
+
+size_t mboxRuntimeThreadCount(mboxRuntime *rt);
+
+/* What each of the threads has spent its time on, see mboxWorkerCounters.
+ * NULL if built with --disable-worker-stats */
+mboxWorkerPoolCounters *mboxRuntimeStats(mboxRuntime *rt);
+void mboxRuntimeStatsReset(mboxRuntime *rt);
+void mboxRuntimeStatsRelease(mboxWorkerPoolCounters *stats);
+
+/* Shared by everything not given a runtime of its own, started on first use
+ * and never released */
+mboxRuntime *mboxRuntimeDefault(void);
+
+/* Cpus we are allowed to run on, capped by any cgroup cpu quota. At least 1 */
+size_t mboxRuntimeDefaultThreads(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mbox-buf.h"
+#include "mbox-scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MBOX_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* Everything after the '\n', checked one byte at a time so we never read past
+ * a '\0' terminator */
+static inline int
+mboxScanIsFrom(const mboxChar *s)
+{
+    return s[0] == 'F' && s[1] == 'r' && s[2] == 'o' && s[3] == 'm' &&
+            s[4] == ' ';
+}
+
+size_t
+mboxScanFromLineScalar(const mboxChar *data, size_t from, size_t to)
+{
+    for (size_t i = from; i < to; ++i) {
+        if (data[i] == '\n' && mboxScanIsFrom(data + i + 1)) {
+            return i;
+        }
+    }
+    return to;
+}
+
+#ifdef MBOX_SCAN_X86
+/* Both vector versions compare a block against '\n' and the block one byte
+ * along against 'F', only where both match do we look at the rest of
+ * "rom ". Newlines followed by 'F' are rare enough in email that the
+ * candidate check hardly ever runs */
+__attribute__((target("sse2"))) static size_t
+mboxScanFromLineSSE2(const mboxChar *data, size_t from, size_t to)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i f = _mm_set1_epi8('F');
+    size_t i = from;
+
+    for (; i + 16 <= to; i += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(b0, nl), _mm_cmpeq_epi8(b1, f)));
+
+        while (mask) {
+            unsigned int bit = __builtin_ctz(mask);
+            if (mboxScanIsFrom(data + i + bit + 1)) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return mboxScanFromLineScalar(data, i, to);
+}
+
+__attribute__((target("avx2"))) static size_t
+mboxScanFromLineAVX2(const mboxChar *data, size_t from, size_t to)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i f = _mm256_set1_epi8('F');
+    size_t i = from;
+
+    for (; i + 32 <= to; i += 32) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(b0, nl),
+                        _mm256_cmpeq_epi8(b1, f)));
+
+        while (mask) {
+            unsigned int bit = __builtin_ctz(mask);
+            if (mboxScanIsFrom(data + i + bit + 1)) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return mboxScanFromLineSSE2(data, i, to);
+}
+#endif
+
+mboxScanFn *
+mboxScanGetSSE2(void)
+{
+#ifdef MBOX_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        return mboxScanFromLineSSE2;
+    }
+#endif
+    return NULL;
+}
+
+mboxScanFn *
+mboxScanGetAVX2(void)
+{
+#ifdef MBOX_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return mboxScanFromLineAVX2;
+    }
+#endif
+    return NULL;
+}
+
+static size_t mboxScanResolve(const mboxChar *data, size_t from, size_t to);
+
+/* Starts off pointing at the resolver which swaps itself out for the real
+ * implementation, every thread will resolve to the same function so racing
+ * on this is harmless */
+static mboxScanFn *mbox_scan_impl = mboxScanResolve;
+static const char *mbox_scan_impl_name = "scalar";
+
+static void
+mboxScanPick(void)
+{
+    mboxScanFn *fn = NULL;
+
+    if ((fn = mboxScanGetAVX2()) != NULL) {
+        mbox_scan_impl_name = "avx2";
+    } else if ((fn = mboxScanGetSSE2()) != NULL) {
+        mbox_scan_impl_name = "sse2";
+    } else {
+        fn = mboxScanFromLineScalar;
+        mbox_scan_impl_name = "scalar";
+    }
+    __atomic_store_n(&mbox_scan_impl, fn, __ATOMIC_RELAXED);
+}
+
+static size_t
+mboxScanResolve(const mboxChar *data, size_t from, size_t to)
+{
+    mboxScanPick();
+    return mbox_scan_impl(data, from, to);
+}
+
+size_t
+mboxScanFromLine(const mboxChar *data, size_t from, size_t to)
+{
+    mboxScanFn *fn = __atomic_load_n(&mbox_scan_impl, __ATOMIC_RELAXED);
+    return fn(data, from, to);
+}
+
+const char *
+mboxScanImplName(void)
+{
+    if (__atomic_load_n(&mbox_scan_impl, __ATOMIC_RELAXED) ==
+            mboxScanResolve) {
+        mboxScanPick();
+    }
+    return mbox_scan_impl_name;
+}
@@ -0,0 +1,42 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_SCAN_H
+#define __MBOX_SCAN_H
+
+#include <stddef.h>
+
+#include "mbox-buf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Finds the first index `i` in [from, to) where `data + i` is "\nFrom ".
+ * Returns `to` if there is no such index.
+ *
+ * Up to 5 bytes past `to` may be looked at, comparisons stop on the first
+ * mismatch so a '\0' at `to` is enough to keep the scan in bounds */
+typedef size_t mboxScanFn(const mboxChar *data, size_t from, size_t to);
+
+/* Picks the fastest implementation the CPU supports the first time it is
+ * called */
+size_t mboxScanFromLine(const mboxChar *data, size_t from, size_t to);
+
+/* Name of the implementation mboxScanFromLine has picked */
+const char *mboxScanImplName(void);
+
+/* The individual implementations, exposed for tests and benchmarks. The SIMD
+ * ones are NULL on CPUs which do not support them */
+size_t mboxScanFromLineScalar(const mboxChar *data, size_t from, size_t to);
+mboxScanFn *mboxScanGetSSE2(void);
+mboxScanFn *mboxScanGetAVX2(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,291 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbox-buf.h"
+#include "mbox-list.h"
+#include "mbox-logger.h"
+#include "mbox-msg.h"
+#include "mbox-table.h"
+
+#define MBOX_TABLE_MIN_ROWS (64)
+#define MBOX_TABLE_MIN_HEAP (4096)
+
+static void *
+mboxTableRealloc(void *ptr, size_t size)
+{
+    void *grown = realloc(ptr, size);
+    if (grown == NULL) {
+        loggerPanic("Failed to grow message table\n");
+    }
+    return grown;
+}
+
+static void
+mboxStrColumnInit(mboxStrColumn *col)
+{
+    col->offsets = NULL;
+    col->lens = NULL;
+    col->heap = NULL;
+    col->heap_len = 0;
+    col->heap_capacity = 0;
+}
+
+static void
+mboxStrColumnGrow(mboxStrColumn *col, size_t rows)
+{
+    col->offsets = (uint64_t *)mboxTableRealloc(col->offsets,
+            sizeof(uint64_t) * rows);
+    col->lens = (uint32_t *)mboxTableRealloc(col->lens,
+            sizeof(uint32_t) * rows);
+}
+
+static void
+mboxStrColumnSet(mboxStrColumn *col, size_t row, mboxBuf *buf)
+{
+    if (buf == NULL) {
+        col->offsets[row] = MBOX_TABLE_NONE;
+        col->lens[row] = 0;
+        return;
+    }
+
+    if (col->heap_len + buf->len + 1 > col->heap_capacity) {
+        size_t capacity = col->heap_capacity ? col->heap_capacity :
+                                               MBOX_TABLE_MIN_HEAP;
+        while (col->heap_len + buf->len + 1 > capacity) {
+            capacity *= 2;
+        }
+        col->heap = (char *)mboxTableRealloc(col->heap, capacity);
+        col->heap_capacity = capacity;
+    }
+
+    memcpy(col->heap + col->heap_len, buf->data, buf->len);
+    col->heap[col->heap_len + buf->len] = '\0';
+    col->offsets[row] = col->heap_len;
+    col->lens[row] = buf->len;
+    col->heap_len += buf->len + 1;
+}
+
+static const char *
+mboxStrColumnGet(mboxStrColumn *col, size_t row)
+{
+    if (col->offsets[row] == MBOX_TABLE_NONE) {
+        return NULL;
+    }
+    return col->heap + col->offsets[row];
+}
+
+static void
+mboxStrColumnRelease(mboxStrColumn *col)
+{
+    free(col->offsets);
+    free(col->lens);
+    free(col->heap);
+}
+
+mboxMsgTable *
+mboxMsgTableNew(void)
+{
+    mboxMsgTable *t = (mboxMsgTable *)malloc(sizeof(mboxMsgTable));
+    t->len = 0;
+    t->capacity = 0;
+    t->start = NULL;
+    t->end = NULL;
+    t->unix_timestamp = NULL;
+    mboxStrColumnInit(&t->from);
+    mboxStrColumnInit(&t->subject);
+    mboxStrColumnInit(&t->msg_id);
+    return t;
+}
+
+static void
+mboxMsgTableReserve(mboxMsgTable *t, size_t rows)
+{
+    size_t capacity = t->capacity ? t->capacity : MBOX_TABLE_MIN_ROWS;
+
+    if (rows <= t->capacity) {
+        return;
+    }
+    while (capacity < rows) {
+        capacity *= 2;
+    }
+
+    t->start = (size_t *)mboxTableRealloc(t->start, sizeof(size_t) * capacity);
+    t->end = (size_t *)mboxTableRealloc(t->end, sizeof(size_t) * capacity);
+    t->unix_timestamp = (long *)mboxTableRealloc(t->unix_timestamp,
+            sizeof(long) * capacity);
+    mboxStrColumnGrow(&t->from, capacity);
+    mboxStrColumnGrow(&t->subject, capacity);
+    mboxStrColumnGrow(&t->msg_id, capacity);
+    t->capacity = capacity;
+}
+
+void
+mboxMsgTableAdd(mboxMsgTable *t, mboxMsgLite *msg)
+{
+    size_t row = t->len;
+
+    mboxMsgTableReserve(t, row + 1);
+    t->start[row] = msg->start;
+    t->end[row] = msg->end;
+    t->unix_timestamp[row] = msg->unix_timestamp;
+    mboxStrColumnSet(&t->from, row, msg->from);
+    mboxStrColumnSet(&t->subject, row, msg->subject);
+    mboxStrColumnSet(&t->msg_id, row, msg->msg_id);
+    t->len++;
+}
+
+mboxMsgTable *
+mboxMsgTableFromList(mboxList *l)
+{
+    mboxMsgTable *t = mboxMsgTableNew();
+    mboxLNode *n = l->root;
+
+    mboxMsgTableReserve(t, l->len);
+    for (size_t i = 0; i < l->len; ++i) {
+        mboxMsgTableAdd(t, (mboxMsgLite *)n->data);
+        n = n->next;
+    }
+    return t;
+}
+
+void
+mboxMsgTableRelease(mboxMsgTable *t)
+{
+    if (t) {
+        free(t->start);
+        free(t->end);
+        free(t->unix_timestamp);
+        mboxStrColumnRelease(&t->from);
+        mboxStrColumnRelease(&t->subject);
+        mboxStrColumnRelease(&t->msg_id);
+        free(t);
+    }
+}
+
+size_t
+mboxMsgTableLen(mboxMsgTable *t)
+{
+    return t->len;
+}
+
+size_t
+mboxMsgTableStart(mboxMsgTable *t, size_t row)
+{
+    return t->start[row];
+}
+
+size_t
+mboxMsgTableEnd(mboxMsgTable *t, size_t row)
+{
+    return t->end[row];
+}
+
+long
+mboxMsgTableTimestamp(mboxMsgTable *t, size_t row)
+{
+    return t->unix_timestamp[row];
+}
+
+const char *
+mboxMsgTableFrom(mboxMsgTable *t, size_t row)
+{
+    return mboxStrColumnGet(&t->from, row);
+}
+
+const char *
+mboxMsgTableSubject(mboxMsgTable *t, size_t row)
+{
+    return mboxStrColumnGet(&t->subject, row);
+}
+
+const char *
+mboxMsgTableMsgId(mboxMsgTable *t, size_t row)
+{
+    return mboxStrColumnGet(&t->msg_id, row);
+}
+
+/* Branch free so the compiler can vectorise it, every row is written and
+ * the count only moves on for a match */
+size_t
+mboxMsgTableFilterByDate(mboxMsgTable *t, long from, long to, size_t *rows)
+{
+    long *ts = t->unix_timestamp;
+    size_t count = 0;
+
+    for (size_t i = 0; i < t->len; ++i) {
+        rows[count] = i;
+        count += (ts[i] >= from) & (ts[i] < to);
+    }
+    return count;
+}
+
+#define mboxTableFold(c) ((unsigned char)((c) - 'A') < 26 ? (c) + 32 : (c))
+
+/* The senders are next to each other in the heap so this walks it from one
+ * end to the other. Looks for the first character of `sender` and only then
+ * compares the rest, which is cheaper than mboxBufContainsCasePattern's
+ * prefix table for the short strings a sender is matched with. Starting the
+ * pattern with something that isn't a letter, like '@', is quickest */
+size_t
+mboxMsgTableFilterBySender(mboxMsgTable *t, char *sender, size_t *rows)
+{
+    mboxStrColumn *col = &t->from;
+    size_t len = strlen(sender);
+    unsigned char *heap = (unsigned char *)col->heap;
+    unsigned char *pattern = NULL;
+    size_t count = 0;
+    int caseless;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    pattern = (unsigned char *)malloc(len);
+    for (size_t i = 0; i < len; ++i) {
+        pattern[i] = mboxTableFold((unsigned char)sender[i]);
+    }
+    /* Nothing to fold so memchr can find where to start comparing */
+    caseless = (unsigned char)(pattern[0] - 'a') >= 26;
+
+    for (size_t i = 0; i < t->len; ++i) {
+        unsigned char *from = NULL;
+        size_t last;
+
+        if (col->offsets[i] == MBOX_TABLE_NONE || col->lens[i] < len) {
+            continue;
+        }
+
+        from = heap + col->offsets[i];
+        last = col->lens[i] - len;
+        for (size_t j = 0; j <= last; ++j) {
+            if (caseless) {
+                unsigned char *next = memchr(from + j, pattern[0],
+                        last - j + 1);
+                if (next == NULL) {
+                    break;
+                }
+                j = next - from;
+            } else if (mboxTableFold(from[j]) != pattern[0]) {
+                continue;
+            }
+            size_t k = 1;
+            while (k < len && mboxTableFold(from[j + k]) == pattern[k]) {
+                k++;
+            }
+            if (k == len) {
+                rows[count++] = i;
+                break;
+            }
+        }
+    }
+    free(pattern);
+    return count;
+}
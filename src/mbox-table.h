@@ -0,0 +1,75 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_TABLE_H
+#define __MBOX_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mbox-list.h"
+#include "mbox-msg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The offset of a string a message doesn't have */
+#define MBOX_TABLE_NONE (UINT64_MAX)
+
+/* One string for each row, packed one after the other in row order and
+ * each '\0' terminated */
+typedef struct mboxStrColumn {
+    uint64_t *offsets; /* Into `heap`, MBOX_TABLE_NONE if there isn't one */
+    uint32_t *lens;
+    char *heap;
+    size_t heap_len;
+    size_t heap_capacity;
+} mboxStrColumn;
+
+/* The same as a list of mboxMsgLite but a column for each field, so a scan
+ * over one field reads only that field and reads it in order. Rows are in
+ * the order the messages were added */
+typedef struct mboxMsgTable {
+    size_t len;
+    size_t capacity;
+    size_t *start;
+    size_t *end;
+    long *unix_timestamp;
+    mboxStrColumn from;
+    mboxStrColumn subject;
+    mboxStrColumn msg_id;
+} mboxMsgTable;
+
+mboxMsgTable *mboxMsgTableNew(void);
+/* Copies what it needs, the list and its messages are untouched */
+mboxMsgTable *mboxMsgTableFromList(mboxList *l);
+void mboxMsgTableAdd(mboxMsgTable *t, mboxMsgLite *msg);
+void mboxMsgTableRelease(mboxMsgTable *t);
+
+size_t mboxMsgTableLen(mboxMsgTable *t);
+size_t mboxMsgTableStart(mboxMsgTable *t, size_t row);
+size_t mboxMsgTableEnd(mboxMsgTable *t, size_t row);
+long mboxMsgTableTimestamp(mboxMsgTable *t, size_t row);
+/* NULL if the message didn't have one */
+const char *mboxMsgTableFrom(mboxMsgTable *t, size_t row);
+const char *mboxMsgTableSubject(mboxMsgTable *t, size_t row);
+const char *mboxMsgTableMsgId(mboxMsgTable *t, size_t row);
+
+/* Each writes the rows that match to `rows`, which must have room for every
+ * row in the table, and returns how many there were. Sent in [from, to) */
+size_t mboxMsgTableFilterByDate(mboxMsgTable *t, long from, long to,
+        size_t *rows);
+/* Case insensitive, anywhere in the From header like
+ * mboxMsgListFilterBySender */
+size_t mboxMsgTableFilterBySender(mboxMsgTable *t, char *sender,
+        size_t *rows);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,8 @@
 #include <sys/time.h>
 
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "mbox-timing.h"
 
@@ -25,3 +27,12 @@ mboxTimerEnd(struct timeval *timer)
     return (end.tv_sec - timer->tv_sec) * 1000.0 +
             (end.tv_usec - timer->tv_usec) / 1000.0;
 }
+
+uint64_t
+mboxTimerNowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
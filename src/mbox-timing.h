@@ -8,6 +8,7 @@
 #define __TIMING_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,9 @@ extern "C" {
 void mboxTimerStart(struct timeval *timer);
 double mboxTimerEnd(struct timeval *timer);
 
+/* Monotonic nanoseconds, for timing things too short for the above */
+uint64_t mboxTimerNowNs(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,95 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbox-logger.h"
+#include "mbox-watch.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+
+#include <poll.h>
+
+int
+mboxWatchOpen(char *file_path)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd == -1) {
+        loggerDebug("Failed to init inotify: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (inotify_add_watch(fd, file_path, IN_CLOSE_WRITE) == -1) {
+        loggerDebug("Failed to watch %s: %s\n", file_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+mboxWatchWait(int fd, int timeout_ms)
+{
+    /* Big enough for a good few events, we only care that there were some */
+    char events[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+    int changed = 0;
+    int ok = 0;
+
+    do {
+        ok = poll(&pfd, 1, timeout_ms);
+    } while (ok == -1 && errno == EINTR);
+
+    if (ok <= 0) {
+        return ok;
+    }
+
+    /* Several deliveries can land before we get here, one parse of the
+     * appended data picks them all up so swallow the lot */
+    while (read(fd, events, sizeof(events)) > 0) {
+        changed = 1;
+    }
+    return changed;
+}
+
+void
+mboxWatchClose(int fd)
+{
+    if (fd != -1) {
+        close(fd);
+    }
+}
+#else
+int
+mboxWatchOpen(char *file_path)
+{
+    (void)file_path;
+    return -1;
+}
+
+int
+mboxWatchWait(int fd, int timeout_ms)
+{
+    (void)fd;
+    (void)timeout_ms;
+    return -1;
+}
+
+void
+mboxWatchClose(int fd)
+{
+    (void)fd;
+}
+#endif
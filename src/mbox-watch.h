@@ -0,0 +1,29 @@
+/* Copyright (C) 2023 James W M Barford-Evans
+ * <jamesbarfordevans at gmail dot com>
+ * All Rights Reserved
+ *
+ * This code is released under the BSD 2 clause license.
+ * See the COPYING file for more information. */
+#ifndef __MBOX_WATCH_H
+#define __MBOX_WATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns a descriptor which becomes readable whenever a writer closes the
+ * file, which is when an MTA has finished delivering. Returns -1 if watching
+ * files is not supported. The descriptor can go in a poll set of your own */
+int mboxWatchOpen(char *file_path);
+
+/* Wait up to `timeout_ms` (-1 for ever) for the file to be written to,
+ * returns 1 if it was, 0 on timeout and -1 on error */
+int mboxWatchWait(int fd, int timeout_ms);
+
+void mboxWatchClose(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,61 +4,645 @@
  *
  * This code is released under the BSD 2 clause license.
  * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <sys/types.h>
 
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include "mbox-list.h"
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #include "mbox-logger.h"
+#include "mbox-timing.h"
 #include "mbox-worker.h"
 
-typedef struct mboxWorkerJob {
-    mboxWorkerCallback *callback;
-    void *argv;
-    struct mboxWorkerJob *next;
-} mboxWorkerJob;
+/* How many times an idle worker looks for work before going to sleep, jobs
+ * tend to come in bursts and sleeping and waking costs a couple of syscalls */
+#define MBOX_WORKER_SPIN (128)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define mboxCpuRelax() __builtin_ia32_pause()
+#else
+#define mboxCpuRelax()
+#endif
+
+/* Chase-Lev, the owner pushes and pops at the bottom without contending with
+ * anyone unless it is down to the last job. Thieves CAS the top */
+typedef struct mboxWorkerDeque {
+    ssize_t top __attribute__((aligned(MBOX_WORKER_CACHELINE)));
+    ssize_t bottom __attribute__((aligned(MBOX_WORKER_CACHELINE)));
+    mboxWorkerTask tasks[MBOX_WORKER_DEQUE_LEN];
+} mboxWorkerDeque;
+
+/* The worker running on this thread, if any */
+static __thread mboxWorker *mbox_worker_self = NULL;
+/* The pool and lane of the job running on this thread, for mboxWorkerYield */
+static __thread mboxWorkerPool *mbox_worker_job_pool = NULL;
+static __thread int mbox_worker_job_lane = MBOX_WORKER_BULK;
+
+#ifdef MBOX_WORKER_STATS
+/* Each on its own cache line, a worker only writes to its own. Helpers from
+ * outside the pool share the last one so everything in it is atomic */
+typedef struct mboxWorkerStatsSlot {
+    mboxWorkerCounters counters;
+} __attribute__((aligned(MBOX_WORKER_CACHELINE))) mboxWorkerStatsSlot;
+
+/* Time spent in jobs the running job ran while it waited, which it doesn't
+ * count as its own */
+static __thread uint64_t mbox_worker_inner_ns = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+/* How long to time the cycle counter against the clock for */
+#define MBOX_WORKER_CALIBRATE_NS (200000)
+
+/* A few times cheaper than clock_gettime, which on some virtual machines is
+ * a syscall, and this is read twice for every job. Calibrated once against
+ * the clock when the first pool starts */
+static double mbox_worker_ns_per_tick = 1.0;
+static pthread_once_t mbox_worker_tick_once = PTHREAD_ONCE_INIT;
+
+static void
+mboxWorkerTicksCalibrate(void)
+{
+    uint64_t ns = mboxTimerNowNs();
+    uint64_t ticks = __builtin_ia32_rdtsc();
+    uint64_t now = 0;
+
+    while ((now = mboxTimerNowNs()) - ns < MBOX_WORKER_CALIBRATE_NS) {
+        mboxCpuRelax();
+    }
+    ticks = __builtin_ia32_rdtsc() - ticks;
+    if (ticks > 0) {
+        mbox_worker_ns_per_tick = (double)(now - ns) / (double)ticks;
+    }
+}
+
+#define mboxWorkerTicks() __builtin_ia32_rdtsc()
+#define mboxWorkerTicksToNs(ticks) \
+    ((uint64_t)((double)(ticks)*mbox_worker_ns_per_tick))
+#define mboxWorkerTicksInit() \
+    pthread_once(&mbox_worker_tick_once, mboxWorkerTicksCalibrate)
+#else
+#define mboxWorkerTicks() mboxTimerNowNs()
+#define mboxWorkerTicksToNs(ticks) (ticks)
+#define mboxWorkerTicksInit()
+#endif
+
+typedef struct mboxWorkerStatsFrame {
+    mboxWorkerCounters *counters;
+    uint64_t start;
+    uint64_t outer_inner_ns;
+} mboxWorkerStatsFrame;
+
+static mboxWorkerCounters *
+mboxWorkerStatsFor(mboxWorkerPool *pool)
+{
+    mboxWorker *self = mbox_worker_self;
+    size_t slot = pool->worker_count;
+
+    if (self && self->pool == pool) {
+        slot = (size_t)self->id;
+    }
+    return &pool->stats[slot].counters;
+}
+
+static void
+mboxWorkerStatsAdd(uint64_t *counter, uint64_t n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static void
+mboxWorkerStatsJobStart(mboxWorkerPool *pool, mboxWorkerTask *task,
+        mboxWorkerStatsFrame *frame)
+{
+    uint64_t wait = 0;
+    size_t bucket = 0;
+
+    frame->counters = mboxWorkerStatsFor(pool);
+    frame->start = mboxWorkerTicks();
+    frame->outer_inner_ns = mbox_worker_inner_ns;
+    mbox_worker_inner_ns = 0;
+
+    /* Enqueued on another cpu whose counter can be a little ahead */
+    if (frame->start > task->queued_at) {
+        wait = mboxWorkerTicksToNs(frame->start - task->queued_at);
+    }
+    if (wait > 0) {
+        bucket = 63 - __builtin_clzll(wait);
+        if (bucket >= MBOX_WORKER_HIST_LEN) {
+            bucket = MBOX_WORKER_HIST_LEN - 1;
+        }
+    }
+    mboxWorkerStatsAdd(&frame->counters->wait_ns, wait);
+    mboxWorkerStatsAdd(&frame->counters->wait_hist[bucket], 1);
+}
+
+static void
+mboxWorkerStatsJobEnd(mboxWorkerStatsFrame *frame)
+{
+    uint64_t elapsed = mboxWorkerTicksToNs(mboxWorkerTicks() - frame->start);
+
+    mboxWorkerStatsAdd(&frame->counters->jobs, 1);
+    mboxWorkerStatsAdd(&frame->counters->busy_ns,
+            elapsed - mbox_worker_inner_ns);
+    mbox_worker_inner_ns = frame->outer_inner_ns + elapsed;
+}
+
+/* `*since` is 0 while busy */
+static void
+mboxWorkerStatsIdle(uint64_t *since)
+{
+    if (*since == 0) {
+        *since = mboxWorkerTicks();
+    }
+}
+
+static void
+mboxWorkerStatsBusy(mboxWorker *self, uint64_t *since)
+{
+    if (*since != 0) {
+        mboxWorkerStatsAdd(&self->pool->stats[self->id].counters.idle_ns,
+                mboxWorkerTicksToNs(mboxWorkerTicks() - *since));
+        *since = 0;
+    }
+}
+
+static void
+mboxWorkerStatsSteal(mboxWorkerPool *pool)
+{
+    mboxWorkerStatsAdd(&mboxWorkerStatsFor(pool)->steals, 1);
+}
+
+/* Head first, it never passes the tail we read after it */
+static void
+mboxWorkerStatsQueued(mboxWorkerPool *pool, int lane)
+{
+    mboxWorkerRing *ring = &pool->lanes[lane];
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t depth = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - head;
+    size_t high = __atomic_load_n(&pool->high_water[lane], __ATOMIC_RELAXED);
+
+    while (depth > high &&
+            !__atomic_compare_exchange_n(&pool->high_water[lane], &high, depth,
+                    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+#else
+typedef struct mboxWorkerStatsFrame {
+    int unused;
+} mboxWorkerStatsFrame;
+
+#define mboxWorkerTicks() (0)
+#define mboxWorkerStatsJobStart(pool, task, frame) ((void)(frame))
+#define mboxWorkerStatsJobEnd(frame)
+#define mboxWorkerStatsIdle(since) ((void)(since))
+#define mboxWorkerStatsBusy(self, since)
+#define mboxWorkerStatsSteal(pool)
+#define mboxWorkerStatsQueued(pool, lane)
+#endif
+
+/* Sleep while `*addr` is `val`, may wake early. Without futexes the pool's
+ * lock and condition stand in */
+static void
+mboxWorkerPoolSleep(mboxWorkerPool *pool, int *addr, int val)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+    (void)pool;
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+static void
+mboxWorkerPoolWake(mboxWorkerPool *pool, int *addr, int count)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+    (void)pool;
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#else
+    (void)addr;
+    (void)count;
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
 
-static mboxSemaphore *
-mboxSemNew(void)
+/* The woken worker may not get to run for a while, until it does everyone
+ * enqueueing would otherwise make a syscall to wake it again */
+static void
+mboxWorkerPoolWakeOne(mboxWorkerPool *pool)
 {
-    mboxSemaphore *sem = malloc(sizeof(mboxSemaphore));
-    sem->val = 0;
-    pthread_cond_init(&sem->cond, NULL);
-    pthread_mutex_init(&sem->lock, NULL);
-    return sem;
+    int waking = 0;
+
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0 &&
+            __atomic_load_n(&pool->waking, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_compare_exchange_n(&pool->waking, &waking, 1, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&pool->signal, 1, __ATOMIC_SEQ_CST);
+        mboxWorkerPoolWake(pool, &pool->signal, 1);
+    }
 }
 
+/* Spin then start giving up the cpu, for the short waits on another thread
+ * finishing what it is half way through */
 static void
-mboxSemaphoreSignal(mboxSemaphore *sem)
+mboxWorkerBackoff(int *spins)
 {
-    pthread_mutex_lock(&sem->lock);
-    sem->val = 1;
-    pthread_cond_signal(&sem->cond);
-    pthread_mutex_unlock(&sem->lock);
+    if ((*spins)++ < MBOX_WORKER_SPIN) {
+        mboxCpuRelax();
+    } else {
+        sched_yield();
+    }
 }
 
+static int
+mboxWorkerDequePush(mboxWorkerDeque *dq, mboxWorkerTask *src)
+{
+    ssize_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    ssize_t t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    mboxWorkerTask *task = NULL;
+
+    if (b - t >= MBOX_WORKER_DEQUE_LEN) {
+        return 0;
+    }
+
+    /* Thieves can read a slot as we write it, they throw away what they read
+     * if they then lose the race for it */
+    task = &dq->tasks[b & (MBOX_WORKER_DEQUE_LEN - 1)];
+    __atomic_store_n(&task->callback, src->callback, __ATOMIC_RELAXED);
+    __atomic_store_n(&task->argv, src->argv, __ATOMIC_RELAXED);
+    __atomic_store_n(&task->group, src->group, __ATOMIC_RELAXED);
+    __atomic_store_n(&task->queued_at, src->queued_at, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Copy out a slot a thief may be overwriting, only used if the copy is then
+ * won */
 static void
-mboxSemaphoreWait(mboxSemaphore *sem)
+mboxWorkerTaskLoad(mboxWorkerTask *dst, mboxWorkerTask *task)
+{
+    dst->callback = __atomic_load_n(&task->callback, __ATOMIC_RELAXED);
+    dst->argv = __atomic_load_n(&task->argv, __ATOMIC_RELAXED);
+    dst->group = __atomic_load_n(&task->group, __ATOMIC_RELAXED);
+    dst->queued_at = __atomic_load_n(&task->queued_at, __ATOMIC_RELAXED);
+}
+
+static int
+mboxWorkerDequePop(mboxWorkerDeque *dq, mboxWorkerTask *dst)
+{
+    ssize_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    ssize_t t = 0;
+    mboxWorkerTask *task = NULL;
+    int ok = 1;
+
+    /* Take the bottom job before looking at the top, a thief looks the other
+     * way round so we can't both think we have it */
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    task = &dq->tasks[b & (MBOX_WORKER_DEQUE_LEN - 1)];
+    mboxWorkerTaskLoad(dst, task);
+
+    /* The last one, race the thieves for it */
+    if (t == b) {
+        ok = __atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return ok;
+}
+
+static int
+mboxWorkerDequeSteal(mboxWorkerDeque *dq, mboxWorkerTask *dst)
+{
+    ssize_t t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    ssize_t b = 0;
+    mboxWorkerTask *task = NULL;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b) {
+        return 0;
+    }
+
+    task = &dq->tasks[t & (MBOX_WORKER_DEQUE_LEN - 1)];
+    mboxWorkerTaskLoad(dst, task);
+    return __atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static int
+mboxWorkerDequeIsEmpty(mboxWorkerDeque *dq)
+{
+    return __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) <=
+            __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+}
+
+/* The ring is Dmitry Vyukov's bounded MPMC queue. Each slot's `seq` says
+ * which lap of the ring it is ready for, a producer may fill slot `pos` when
+ * `seq == pos` and a consumer may empty it when `seq == pos + 1`. Claiming a
+ * position is a CAS on `tail` or `head`, nothing else is shared */
+static int
+mboxWorkerRingPush(mboxWorkerRing *ring, mboxWorkerTask *task)
+{
+    mboxWorkerJob *job = NULL;
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    while (1) {
+        job = &ring->jobs[pos & (MBOX_WORKER_QUEUE_LEN - 1)];
+        size_t seq = __atomic_load_n(&job->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* Full, the slot still holds a job from the last lap */
+            return 0;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    job->task = *task;
+    __atomic_store_n(&job->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Claim as many positions as there is room for with one CAS. Every slot in
+ * a claimed run has been taken by a consumer on the last lap, it may still be
+ * copying out of it so we wait for it to let go. Returns how many were
+ * pushed */
+static size_t
+mboxWorkerRingPushMany(mboxWorkerRing *ring, mboxWorkerTask *task,
+        void **argv, size_t count)
 {
-    pthread_mutex_lock(&sem->lock);
-    while (sem->val != 1) {
-        pthread_cond_wait(&sem->cond, &sem->lock);
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    size_t n = 0;
+
+    do {
+        size_t used = pos - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (used >= MBOX_WORKER_QUEUE_LEN) {
+            return 0;
+        }
+        n = MBOX_WORKER_QUEUE_LEN - used;
+        if (n > count) {
+            n = count;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->tail, &pos, pos + n, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (size_t i = 0; i < n; ++i) {
+        mboxWorkerJob *job = &ring->jobs[(pos + i) &
+                (MBOX_WORKER_QUEUE_LEN - 1)];
+        int spins = 0;
+
+        while (__atomic_load_n(&job->seq, __ATOMIC_ACQUIRE) != pos + i) {
+            mboxWorkerBackoff(&spins);
+        }
+        job->task = *task;
+        job->task.argv = argv[i];
+        __atomic_store_n(&job->seq, pos + i + 1, __ATOMIC_RELEASE);
     }
-    sem->val = 0;
-    pthread_mutex_unlock(&sem->lock);
+    return n;
 }
 
-static mboxWorkerJob *
-mboxWorkerJobNew(mboxWorkerCallback *callback, void *argv)
+/* Take up to `max` jobs that are ready in a row off the front with one
+ * CAS */
+static size_t
+mboxWorkerRingPopMany(mboxWorkerRing *ring, mboxWorkerTask *tasks, size_t max)
 {
-    mboxWorkerJob *job = (mboxWorkerJob *)malloc(sizeof(mboxWorkerJob));
-    job->callback = callback;
-    job->argv = argv;
-    job->next = NULL;
-    return job;
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t n = 0;
+
+    while (1) {
+        for (n = 0; n < max; ++n) {
+            mboxWorkerJob *job = &ring->jobs[(pos + n) &
+                    (MBOX_WORKER_QUEUE_LEN - 1)];
+            if (__atomic_load_n(&job->seq, __ATOMIC_ACQUIRE) != pos + n + 1) {
+                break;
+            }
+        }
+
+        if (n == 0) {
+            mboxWorkerJob *job = &ring->jobs[pos & (MBOX_WORKER_QUEUE_LEN - 1)];
+            size_t seq = __atomic_load_n(&job->seq, __ATOMIC_ACQUIRE);
+            if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+                return 0;
+            }
+            /* Someone else took it, catch up */
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&ring->head, &pos, pos + n, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        mboxWorkerJob *job = &ring->jobs[(pos + i) &
+                (MBOX_WORKER_QUEUE_LEN - 1)];
+        tasks[i] = job->task;
+        /* Ready for the producer on the next lap */
+        __atomic_store_n(&job->seq, pos + i + MBOX_WORKER_QUEUE_LEN,
+                __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+static int
+mboxWorkerRingIsEmpty(mboxWorkerRing *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) ==
+            __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+/* Try every worker's deque once, starting from a random one so thieves
+ * spread out */
+static int
+mboxWorkerPoolSteal(mboxWorkerPool *pool, mboxWorker *self,
+        mboxWorkerTask *task)
+{
+    size_t count = pool->worker_count;
+    size_t start = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    start = self ? (size_t)rand_r(&self->seed) % count : 0;
+    for (size_t i = 0; i < count; ++i) {
+        mboxWorker *victim = &pool->workers[(start + i) % count];
+        if (victim != self &&
+                mboxWorkerDequeSteal(victim->deque, task)) {
+            mboxWorkerStatsSteal(pool);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Interactive jobs first, then our own deque, then the shared bulk ring,
+ * then other workers. Interactive jobs are taken one at a time, on a deque
+ * they would be stuck behind bulk jobs */
+static int
+mboxWorkerFindJob(mboxWorker *self, mboxWorkerTask *task)
+{
+    mboxWorkerPool *pool = self->pool;
+    mboxWorkerTask tasks[MBOX_WORKER_GRAB];
+    size_t n = 0;
+
+    if (mboxWorkerRingPopMany(&pool->lanes[MBOX_WORKER_INTERACTIVE], task,
+                1) ||
+            mboxWorkerDequePop(self->deque, task)) {
+        return 1;
+    }
+
+    /* Our deque is empty so the rest fit */
+    if ((n = mboxWorkerRingPopMany(&pool->lanes[MBOX_WORKER_BULK], tasks,
+                 MBOX_WORKER_GRAB)) > 0) {
+        for (size_t i = 1; i < n; ++i) {
+            mboxWorkerDequePush(self->deque, &tasks[i]);
+        }
+        *task = tasks[0];
+
+        /* Get someone over to steal the rest */
+        if (n > 1) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&pool->spinning, __ATOMIC_SEQ_CST) == 0) {
+                mboxWorkerPoolWakeOne(pool);
+            }
+        }
+        return 1;
+    }
+
+    return mboxWorkerPoolSteal(pool, self, task);
+}
+
+static int
+mboxWorkerPoolHasWork(mboxWorkerPool *pool, mboxWorker *self)
+{
+    for (int i = 0; i < MBOX_WORKER_LANES; ++i) {
+        if (!mboxWorkerRingIsEmpty(&pool->lanes[i])) {
+            return 1;
+        }
+    }
+    return !mboxWorkerDequeIsEmpty(self->deque);
+}
+
+/* Once a group's count is down the waiter may free it, so the last job
+ * only uses the address to wake it */
+static void
+mboxWorkerGroupDone(mboxWorkerPool *pool, mboxWorkerGroup *group)
+{
+    int *state = &group->state;
+
+    if (__atomic_fetch_sub(state, 2, __ATOMIC_SEQ_CST) == 3) {
+        mboxWorkerPoolWake(pool, state, INT_MAX);
+    }
+}
+
+static void
+mboxWorkerPoolRunJob(mboxWorkerPool *pool, mboxWorkerTask *task)
+{
+    /* Jobs can run jobs while they wait or yield */
+    mboxWorkerPool *outer_pool = mbox_worker_job_pool;
+    int outer_lane = mbox_worker_job_lane;
+    mboxWorkerStatsFrame frame;
+
+    mboxWorkerStatsJobStart(pool, task, &frame);
+    mbox_worker_job_pool = pool;
+    if (task->group) {
+        mbox_worker_job_lane = task->group->lane;
+        task->callback(task->group->priv_data, task->argv);
+        mboxWorkerGroupDone(pool, task->group);
+    } else {
+        mbox_worker_job_lane = MBOX_WORKER_BULK;
+        task->callback(pool->priv_data, task->argv);
+    }
+    mbox_worker_job_pool = outer_pool;
+    mbox_worker_job_lane = outer_lane;
+    mboxWorkerStatsJobEnd(&frame);
+
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&pool->waiters, __ATOMIC_SEQ_CST) > 0) {
+        mboxWorkerPoolWake(pool, &pool->pending, INT_MAX);
+    }
+}
+
+/* For threads outside the pool, or inside it waiting on it. Runs one job,
+ * looking in the same order as a worker does */
+int
+mboxWorkerPoolHelp(mboxWorkerPool *pool)
+{
+    mboxWorkerTask task;
+    mboxWorker *self = mbox_worker_self;
+
+    if (self && self->pool != pool) {
+        self = NULL;
+    }
+
+    if (mboxWorkerRingPopMany(&pool->lanes[MBOX_WORKER_INTERACTIVE], &task,
+                1) ||
+            (self && mboxWorkerDequePop(self->deque, &task)) ||
+            mboxWorkerRingPopMany(&pool->lanes[MBOX_WORKER_BULK], &task, 1) ||
+            mboxWorkerPoolSteal(pool, self, &task)) {
+        mboxWorkerPoolRunJob(pool, &task);
+        return 1;
+    }
+    return 0;
+}
+
+int
+mboxWorkerYield(void)
+{
+    mboxWorkerPool *pool = mbox_worker_job_pool;
+    mboxWorkerRing *ring = NULL;
+    mboxWorkerTask task;
+    int count = 0;
+
+    if (pool == NULL || mbox_worker_job_lane == MBOX_WORKER_INTERACTIVE) {
+        return 0;
+    }
+
+    ring = &pool->lanes[MBOX_WORKER_INTERACTIVE];
+    while (!mboxWorkerRingIsEmpty(ring) &&
+            mboxWorkerRingPopMany(ring, &task, 1)) {
+        mboxWorkerPoolRunJob(pool, &task);
+        count++;
+    }
+    return count;
 }
 
 /* Add a job to the queue */
@@ -66,78 +650,171 @@ void
 mboxWorkerPoolEnqueue(mboxWorkerPool *pool, mboxWorkerCallback *callback,
         void *argv)
 {
-    mboxWorkerJob *job = mboxWorkerJobNew(callback, argv);
-    pthread_mutex_lock(&pool->qlock);
-    mboxListAddTail(pool->jobs, job);
-    mboxSemaphoreSignal(pool->sem);
-    pthread_mutex_unlock(&pool->qlock);
+    mboxWorkerPoolEnqueueBatch(pool, callback, &argv, 1);
 }
 
-static mboxWorkerJob *
-mboxWorkerPoolDequeue(mboxWorkerPool *pool)
+static void
+mboxWorkerPoolSubmit(mboxWorkerPool *pool, mboxWorkerGroup *group,
+        mboxWorkerCallback *callback, void **argv, size_t count)
 {
-    pthread_mutex_lock(&pool->qlock);
-    mboxWorkerJob *job = mboxListRemoveHead(pool->jobs);
+    mboxWorker *self = mbox_worker_self;
+    mboxWorkerTask task = { .callback = callback,
+        .group = group,
+        .queued_at = mboxWorkerTicks() };
+    int lane = group ? group->lane : MBOX_WORKER_BULK;
+    mboxWorkerRing *ring = &pool->lanes[lane];
+    size_t done = 0;
+    size_t queued = 0; /* On our deque, the rest go in the ring */
+    int spins = 0;
+
+    if (count == 0) {
+        return;
+    }
 
-    if (job) {
-        mboxSemaphoreSignal(pool->sem);
+    /* Counted before they are visible so a wait can't miss them */
+    if (group) {
+        __atomic_add_fetch(&group->state, 2 * (int)count, __ATOMIC_SEQ_CST);
     }
+    __atomic_add_fetch(&pool->pending, count, __ATOMIC_SEQ_CST);
 
-    pthread_mutex_unlock(&pool->qlock);
-    return job;
+    if (self && self->pool == pool && lane == MBOX_WORKER_BULK) {
+        for (; done < count; ++done) {
+            task.argv = argv[done];
+            if (!mboxWorkerDequePush(self->deque, &task)) {
+                break;
+            }
+        }
+    }
+
+    queued = done;
+    if (count - done == 1) {
+        task.argv = argv[done];
+        while (!mboxWorkerRingPush(ring, &task)) {
+            /* The workers are behind, help rather than wait on them which
+             * could never end if we are one of them */
+            if (!mboxWorkerPoolHelp(pool)) {
+                mboxWorkerBackoff(&spins);
+            }
+        }
+    } else {
+        while (done < count) {
+            size_t n = mboxWorkerRingPushMany(ring, &task, argv + done,
+                    count - done);
+            if (n == 0 && !mboxWorkerPoolHelp(pool)) {
+                mboxWorkerBackoff(&spins);
+            }
+            done += n;
+        }
+    }
+    if (queued < count) {
+        mboxWorkerStatsQueued(pool, lane);
+    }
+
+    /* Pairs with the worker announcing it is going to sleep and then looking
+     * for work one last time, one of us sees the other */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->spinning, __ATOMIC_SEQ_CST) == 0) {
+        mboxWorkerPoolWakeOne(pool);
+    }
+}
+
+void
+mboxWorkerPoolEnqueueBatch(mboxWorkerPool *pool,
+        mboxWorkerCallback *callback, void **argv, size_t count)
+{
+    mboxWorkerPoolSubmit(pool, NULL, callback, argv, count);
 }
 
-/* Wait for all jobs in the pool to complete */
+/* Wait for all jobs in the pool to complete, including every group's, running
+ * any still queued rather than sitting idle */
 void
 mboxWorkerPoolWait(mboxWorkerPool *pool)
 {
-    pthread_mutex_lock(&pool->lock);
-    while (pool->jobs->len || pool->active_threads != 0) {
-        pthread_cond_wait(&pool->no_work, &pool->lock);
+    int pending = 0;
+
+    while ((pending = __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST)) !=
+            0) {
+        if (mboxWorkerPoolHelp(pool)) {
+            continue;
+        }
+        __atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == pending) {
+            mboxWorkerPoolSleep(pool, &pool->pending, pending);
+        }
+        __atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
     }
-    pthread_mutex_unlock(&pool->lock);
 }
 
+/* A worker is either running jobs, spinning looking for one or asleep. While
+ * any are spinning producers don't bother waking anyone, so the last one to
+ * stop spinning because it found work wakes another if there is more */
 static void *
 mboxWorkerPoolMain(void *argv)
 {
-    mboxWorkerPool *pool = (mboxWorkerPool *)argv;
-    mboxWorkerJob *job = NULL;
+    mboxWorker *self = (mboxWorker *)argv;
+    mboxWorkerPool *pool = self->pool;
+    mboxWorkerTask task;
+    uint64_t idle_since = 0;
+    int spins = 0;
+    int signal = 0;
 
-    pthread_mutex_lock(&pool->lock);
-    pool->alive_threads++;
-    pthread_mutex_unlock(&pool->lock);
+    mbox_worker_self = self;
 
     while (1) {
+        if (mboxWorkerFindJob(self, &task)) {
+            mboxWorkerStatsBusy(self, &idle_since);
+            mboxWorkerPoolRunJob(pool, &task);
+            continue;
+        }
 
-        mboxSemaphoreWait(pool->sem);
+        if (!__atomic_load_n(&pool->run, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        mboxWorkerStatsIdle(&idle_since);
 
-        pthread_mutex_lock(&pool->lock);
-        pool->active_threads++;
-        pthread_mutex_unlock(&pool->lock);
+        __atomic_add_fetch(&pool->spinning, 1, __ATOMIC_SEQ_CST);
+        for (spins = 0; spins < MBOX_WORKER_SPIN; ++spins) {
+            if (mboxWorkerFindJob(self, &task)) {
+                break;
+            }
+            mboxCpuRelax();
+        }
 
-        job = mboxWorkerPoolDequeue(pool);
-        if (job) {
-            job->callback(pool->priv_data, job->argv);
-            free(job);
+        if (spins < MBOX_WORKER_SPIN) {
+            if (__atomic_sub_fetch(&pool->spinning, 1, __ATOMIC_SEQ_CST) ==
+                            0 &&
+                    mboxWorkerPoolHasWork(pool, self)) {
+                mboxWorkerPoolWakeOne(pool);
+            }
+            mboxWorkerStatsBusy(self, &idle_since);
+            mboxWorkerPoolRunJob(pool, &task);
+            continue;
         }
 
-        pthread_mutex_lock(&pool->lock);
-        pool->active_threads--;
+        /* Counted as a sleeper before we stop spinning, so a producer always
+         * sees one or the other. Then look once more in case a job came in
+         * while it thought we were still spinning. A wake sent after we
+         * took `signal` gets us straight back out */
+        signal = __atomic_load_n(&pool->signal, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&pool->spinning, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&pool->waking, 0, __ATOMIC_SEQ_CST);
 
-        if (pool->active_threads == 0) {
-            pthread_cond_signal(&pool->no_work);
+        if (mboxWorkerFindJob(self, &task)) {
+            __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+            mboxWorkerStatsBusy(self, &idle_since);
+            mboxWorkerPoolRunJob(pool, &task);
+            continue;
         }
 
-        pthread_mutex_unlock(&pool->lock);
+        if (__atomic_load_n(&pool->run, __ATOMIC_ACQUIRE)) {
+            mboxWorkerPoolSleep(pool, &pool->signal, signal);
+        }
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&pool->waking, 0, __ATOMIC_SEQ_CST);
     }
 
-    pool->worker_count--;
-    if (pool->active_threads == 0) {
-        pthread_cond_signal(&pool->no_work);
-    }
-    pthread_mutex_unlock(&pool->lock);
-    pthread_exit(NULL);
+    mbox_worker_self = NULL;
     return NULL;
 }
 
@@ -150,56 +827,134 @@ workerSpawn(mboxWorkerPool *pool, size_t worker_count)
     pool->workers = workers;
     pool->worker_count = worker_count;
 
+    /* Every deque has to exist before any worker goes looking to steal */
     for (size_t i = 0; i < worker_count; ++i) {
         mboxWorker *worker = &workers[i];
         worker->id = i;
-        pthread_create(&worker->th, NULL, mboxWorkerPoolMain, pool);
-        pthread_detach(worker->th);
+        worker->seed = i + 1;
+        worker->pool = pool;
+        if (posix_memalign((void **)&worker->deque, MBOX_WORKER_CACHELINE,
+                    sizeof(mboxWorkerDeque)) != 0) {
+            loggerPanic("Failed to allocate worker deque\n");
+        }
+        worker->deque->top = 0;
+        worker->deque->bottom = 0;
+    }
+
+    for (size_t i = 0; i < worker_count; ++i) {
+        pthread_create(&workers[i].th, NULL, mboxWorkerPoolMain, &workers[i]);
     }
 }
 
 mboxWorkerPool *
 mboxWorkerPoolNew(size_t worker_count)
 {
-    mboxWorkerPool *pool = (mboxWorkerPool *)malloc(sizeof(mboxWorkerPool));
-    pool->jobs = mboxListNew();
+    mboxWorkerPool *pool = NULL;
+
+    /* malloc won't line it up for the padding between the ring ends */
+    if (posix_memalign((void **)&pool, MBOX_WORKER_CACHELINE,
+                sizeof(mboxWorkerPool)) != 0) {
+        loggerPanic("Failed to allocate worker pool\n");
+    }
+
+    for (int lane = 0; lane < MBOX_WORKER_LANES; ++lane) {
+        mboxWorkerRing *ring = &pool->lanes[lane];
+        ring->jobs = (mboxWorkerJob *)malloc(
+                sizeof(mboxWorkerJob) * MBOX_WORKER_QUEUE_LEN);
+        for (size_t i = 0; i < MBOX_WORKER_QUEUE_LEN; ++i) {
+            ring->jobs[i].seq = i;
+        }
+        ring->head = 0;
+        ring->tail = 0;
+    }
+    pool->pending = 0;
+    pool->waiters = 0;
+    pool->signal = 0;
+    pool->sleepers = 0;
+    pool->spinning = 0;
+    pool->waking = 0;
     pool->run = 1;
     pool->worker_count = worker_count;
-    pool->active_threads = 0;
     pool->priv_data = NULL;
-    pool->sem = mboxSemNew();
-    pool->alive_threads = 0;
+    pool->stats = NULL;
+    for (int lane = 0; lane < MBOX_WORKER_LANES; ++lane) {
+        pool->high_water[lane] = 0;
+    }
+#ifdef MBOX_WORKER_STATS
+    mboxWorkerTicksInit();
+    /* The last for threads outside the pool */
+    if (posix_memalign((void **)&pool->stats, MBOX_WORKER_CACHELINE,
+                sizeof(mboxWorkerStatsSlot) * (worker_count + 1)) != 0) {
+        loggerPanic("Failed to allocate worker stats\n");
+    }
+    memset(pool->stats, 0, sizeof(mboxWorkerStatsSlot) * (worker_count + 1));
+#endif
 
-    pthread_cond_init(&pool->no_work, NULL);
-    pthread_cond_init(&pool->has_work, NULL);
+    /* Nothing to wait for, jobs enqueued before a worker is up sit in the
+     * ring until it looks */
+    pthread_cond_init(&pool->cond, NULL);
     pthread_mutex_init(&pool->lock, NULL);
-    pthread_mutex_init(&pool->qlock, NULL);
     workerSpawn(pool, pool->worker_count);
-    while (pool->alive_threads != pool->worker_count)
-        ;
 
     return pool;
 }
 
+int
+mboxWorkerPoolSetAffinity(mboxWorkerPool *pool, int *cpus, size_t cpu_count,
+        int pin)
+{
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_SET)
+    cpu_set_t set;
+    int ok = 1;
+
+    if (cpu_count == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < pool->worker_count; ++i) {
+        CPU_ZERO(&set);
+        if (pin) {
+            CPU_SET(cpus[i % cpu_count], &set);
+        } else {
+            for (size_t j = 0; j < cpu_count; ++j) {
+                CPU_SET(cpus[j], &set);
+            }
+        }
+        if (pthread_setaffinity_np(pool->workers[i].th, sizeof(set), &set) !=
+                0) {
+            ok = 0;
+        }
+    }
+    return ok;
+#else
+    (void)pool;
+    (void)cpus;
+    (void)cpu_count;
+    (void)pin;
+    return 0;
+#endif
+}
+
 /* Wait for all jobs to complete and then destroy all of the workers in the
  * pool, only call if we're trying to free the pool */
 static void
 mboxWorkerPoolStop(mboxWorkerPool *pool)
 {
-    pthread_mutex_lock(&pool->lock);
-    while (pool->active_threads != 0) {
-        pthread_cond_wait(&pool->has_work, &pool->lock);
-    }
-    pool->run = 0;
-    pthread_cond_broadcast(&pool->has_work);
-    pthread_mutex_unlock(&pool->lock);
+    mboxWorkerPoolWait(pool);
+
+    __atomic_store_n(&pool->run, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pool->signal, 1, __ATOMIC_SEQ_CST);
+    mboxWorkerPoolWake(pool, &pool->signal, INT_MAX);
 
     for (size_t i = 0; i < pool->worker_count; ++i) {
         pthread_join(pool->workers[i].th, NULL);
     }
+    /* Only once they have all stopped, they steal from each other */
+    for (size_t i = 0; i < pool->worker_count; ++i) {
+        free(pool->workers[i].deque);
+    }
 
     pool->worker_count = 0;
-    pthread_cond_signal(&pool->no_work);
 }
 
 void
@@ -208,12 +963,135 @@ mboxWorkerPoolRelease(mboxWorkerPool *pool)
     if (pool) {
         mboxWorkerPoolStop(pool);
 
-        pthread_cond_destroy(&pool->has_work);
-        pthread_cond_destroy(&pool->no_work);
+        pthread_cond_destroy(&pool->cond);
         pthread_mutex_destroy(&pool->lock);
 
-        mboxListRelease(pool->jobs);
+        for (int lane = 0; lane < MBOX_WORKER_LANES; ++lane) {
+            free(pool->lanes[lane].jobs);
+        }
         free(pool->workers);
+        free(pool->stats);
         free(pool);
     }
 }
+
+/* Every counter is a uint64_t, copied and cleared one at a time */
+#define MBOX_WORKER_COUNTER_WORDS \
+    (sizeof(mboxWorkerCounters) / sizeof(uint64_t))
+
+mboxWorkerPoolCounters *
+mboxWorkerPoolStats(mboxWorkerPool *pool)
+{
+#ifdef MBOX_WORKER_STATS
+    size_t len = pool->worker_count + 1;
+    mboxWorkerPoolCounters *stats = (mboxWorkerPoolCounters *)malloc(
+            sizeof(mboxWorkerPoolCounters));
+
+    stats->worker_count = pool->worker_count;
+    stats->workers = (mboxWorkerCounters *)malloc(
+            sizeof(mboxWorkerCounters) * len);
+    for (size_t i = 0; i < len; ++i) {
+        uint64_t *src = (uint64_t *)&pool->stats[i].counters;
+        uint64_t *dst = (uint64_t *)&stats->workers[i];
+        for (size_t j = 0; j < MBOX_WORKER_COUNTER_WORDS; ++j) {
+            dst[j] = __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+        }
+    }
+    for (int lane = 0; lane < MBOX_WORKER_LANES; ++lane) {
+        stats->high_water[lane] = __atomic_load_n(&pool->high_water[lane],
+                __ATOMIC_RELAXED);
+    }
+    return stats;
+#else
+    (void)pool;
+    return NULL;
+#endif
+}
+
+void
+mboxWorkerPoolStatsRelease(mboxWorkerPoolCounters *stats)
+{
+    if (stats) {
+        free(stats->workers);
+        free(stats);
+    }
+}
+
+void
+mboxWorkerPoolStatsReset(mboxWorkerPool *pool)
+{
+#ifdef MBOX_WORKER_STATS
+    for (size_t i = 0; i < pool->worker_count + 1; ++i) {
+        uint64_t *counters = (uint64_t *)&pool->stats[i].counters;
+        for (size_t j = 0; j < MBOX_WORKER_COUNTER_WORDS; ++j) {
+            __atomic_store_n(&counters[j], 0, __ATOMIC_RELAXED);
+        }
+    }
+    for (int lane = 0; lane < MBOX_WORKER_LANES; ++lane) {
+        __atomic_store_n(&pool->high_water[lane], 0, __ATOMIC_RELAXED);
+    }
+#else
+    (void)pool;
+#endif
+}
+
+mboxWorkerGroup *
+mboxWorkerGroupNew(mboxWorkerPool *pool, void *priv_data)
+{
+    mboxWorkerGroup *group = (mboxWorkerGroup *)malloc(
+            sizeof(mboxWorkerGroup));
+    group->pool = pool;
+    group->priv_data = priv_data;
+    group->lane = MBOX_WORKER_BULK;
+    group->state = 0;
+    return group;
+}
+
+void
+mboxWorkerGroupSetLane(mboxWorkerGroup *group, int lane)
+{
+    group->lane = lane == MBOX_WORKER_INTERACTIVE ? MBOX_WORKER_INTERACTIVE :
+                                                    MBOX_WORKER_BULK;
+}
+
+void
+mboxWorkerGroupEnqueue(mboxWorkerGroup *group, mboxWorkerCallback *callback,
+        void *argv)
+{
+    mboxWorkerPoolSubmit(group->pool, group, callback, &argv, 1);
+}
+
+void
+mboxWorkerGroupEnqueueBatch(mboxWorkerGroup *group,
+        mboxWorkerCallback *callback, void **argv, size_t count)
+{
+    mboxWorkerPoolSubmit(group->pool, group, callback, argv, count);
+}
+
+/* Jobs from other groups may be run while we wait, there is no telling
+ * ours apart on the ring */
+void
+mboxWorkerGroupWait(mboxWorkerGroup *group)
+{
+    int state = 0;
+
+    while ((state = __atomic_load_n(&group->state, __ATOMIC_SEQ_CST)) > 1) {
+        if (mboxWorkerPoolHelp(group->pool)) {
+            continue;
+        }
+        /* Ask the last job to wake us, then sleep unless it already has */
+        if ((state & 1) == 0 &&
+                !__atomic_compare_exchange_n(&group->state, &state, state | 1,
+                        0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        mboxWorkerPoolSleep(group->pool, &group->state, state | 1);
+    }
+    __atomic_store_n(&group->state, 0, __ATOMIC_SEQ_CST);
+}
+
+void
+mboxWorkerGroupRelease(mboxWorkerGroup *group)
+{
+    free(group);
+}
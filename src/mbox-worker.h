@@ -9,8 +9,7 @@
 
 #include <pthread.h>
 #include <stddef.h>
-
-#include "mbox-list.h"
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,44 +19,184 @@ extern "C" {
  * with Enqueue */
 typedef void mboxWorkerCallback(void *priv_data, void *argv);
 
-typedef struct mboxWorkerJob mboxWorkerJob;
+/* Jobs live in a fixed ring of slots which are reused, enqueueing and
+ * dequeueing is a few atomics rather than a lock and an allocation. Must be a
+ * power of 2 */
+#define MBOX_WORKER_QUEUE_LEN (4096)
+
+/* Keep the producer and consumer ends of the ring off each other's cache
+ * line */
+#define MBOX_WORKER_CACHELINE (64)
+
+struct mboxWorkerPool;
+struct mboxWorkerDeque;
+struct mboxWorkerGroup;
+struct mboxWorkerStatsSlot;
+
+typedef struct mboxWorkerTask {
+    mboxWorkerCallback *callback;
+    void *argv;
+    struct mboxWorkerGroup *group; /* NULL for jobs enqueued on the pool */
+    uint64_t queued_at; /* When it was enqueued, in cycle counter ticks. 0
+                           without stats */
+} mboxWorkerTask;
+
+typedef struct mboxWorkerJob {
+    size_t seq; /* Which lap of the ring the slot is ready for */
+    mboxWorkerTask task;
+} mboxWorkerJob;
+
+/* Each worker's own jobs, only it pushes and pops at the bottom while idle
+ * workers steal from the top. Must be a power of 2 */
+#define MBOX_WORKER_DEQUE_LEN (1024)
+
+/* How many jobs a worker takes off the shared ring at once, the rest go on
+ * its deque where the others can steal them */
+#define MBOX_WORKER_GRAB (16)
+
+/* Which lane a group's jobs go in. Workers take interactive jobs before
+ * anything else, bulk jobs only run when there are none waiting. Jobs
+ * enqueued on the pool rather than a group are bulk */
+#define MBOX_WORKER_INTERACTIVE (0)
+#define MBOX_WORKER_BULK (1)
+#define MBOX_WORKER_LANES (2)
+
+/* Queue waits are counted in buckets of powers of 2 nanoseconds, the last
+ * takes everything longer */
+#define MBOX_WORKER_HIST_LEN (40)
+
+/* What a worker has been up to since the pool started or the stats were
+ * last reset. Collected unless built with --disable-worker-stats */
+typedef struct mboxWorkerCounters {
+    uint64_t jobs;    /* Jobs run */
+    uint64_t busy_ns; /* Running them, not counting jobs they ran while they
+                         waited which are counted once by themselves */
+    uint64_t idle_ns; /* Looking for work or asleep */
+    uint64_t steals;  /* Jobs taken from another worker's deque */
+    uint64_t wait_ns; /* How long the jobs sat queued before starting */
+    uint64_t wait_hist[MBOX_WORKER_HIST_LEN]; /* Jobs by how long they sat
+                                                 queued, bucket i is
+                                                 [2^i, 2^(i+1)) ns */
+} mboxWorkerCounters;
+
+/* A copy of a pool's counters, from mboxWorkerPoolStats */
+typedef struct mboxWorkerPoolCounters {
+    size_t worker_count;
+    /* One for each worker and then one more for jobs run by threads outside
+     * the pool helping while they wait */
+    mboxWorkerCounters *workers;
+    /* Most jobs there have been waiting in each lane's ring at once */
+    size_t high_water[MBOX_WORKER_LANES];
+} mboxWorkerPoolCounters;
+
+/* One of these for each lane */
+typedef struct mboxWorkerRing {
+    /* Next slot to enqueue to */
+    size_t tail __attribute__((aligned(MBOX_WORKER_CACHELINE)));
+    /* Next slot to dequeue from */
+    size_t head __attribute__((aligned(MBOX_WORKER_CACHELINE)));
+    mboxWorkerJob *jobs; /* MBOX_WORKER_QUEUE_LEN slots */
+} mboxWorkerRing;
+
 typedef struct mboxWorker {
     pthread_t th;
     int id;
+    unsigned int seed; /* For picking who to steal from */
+    struct mboxWorkerPool *pool;
+    struct mboxWorkerDeque *deque;
 } mboxWorker;
 
-typedef struct mboxSemaphore {
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
-    volatile int val;
-} mboxSemaphore;
-
+/* Jobs enqueued from outside the pool go on a shared ring which idle workers
+ * take from in batches. Bulk jobs enqueued by one of the pool's own workers
+ * go on that worker's deque, so a worker splitting up its work touches
+ * nothing shared until someone comes to steal. Interactive jobs always go on
+ * their own ring where every worker looks first */
 typedef struct mboxWorkerPool {
-    mboxList *jobs;                 /* Work to be done */
-    volatile size_t worker_count;   /* How many threads we have in the pool */
-    volatile size_t alive_threads;  /* Threads that are alive */
-    volatile size_t active_threads; /* Work queued, only decemented when the
-                                     * work is complete
-                                     */
-    int run;                        /* Keep running the thread pool */
-    pthread_cond_t has_work;
-    pthread_cond_t no_work;
-    pthread_mutex_t lock;
-    pthread_mutex_t qlock;
-    mboxSemaphore *sem;
+    mboxWorkerRing lanes[MBOX_WORKER_LANES];
+    /* Jobs enqueued and not yet finished, waited on by mboxWorkerPoolWait */
+    int pending __attribute__((aligned(MBOX_WORKER_CACHELINE)));
+    int waiters; /* Threads waiting on `pending` */
+    /* Bumped to wake idle workers, which sleep on it */
+    int signal __attribute__((aligned(MBOX_WORKER_CACHELINE)));
+    int sleepers;                /* Workers asleep or about to be */
+    int spinning; /* Workers awake and looking for work, no need to wake
+                     anyone while there are some */
+    int waking;   /* A wake is on its way, don't send another until a worker
+                     has come out of or gone into sleep */
+    size_t worker_count;         /* How many threads we have in the pool */
+    int run;                     /* Keep running the thread pool */
+    pthread_mutex_t lock; /* Only used to sleep without futexes */
+    pthread_cond_t cond;
     mboxWorker *workers; /* Array of workers */
     void *priv_data; /* Passed as the first argument to onComplete, can be any
                         value. Simulating a closure */
+    struct mboxWorkerStatsSlot *stats; /* worker_count + 1 of them */
+    size_t high_water[MBOX_WORKER_LANES];
 } mboxWorkerPool;
 
+/* A set of jobs on a pool that can be waited on by themselves, so many
+ * callers can share one pool. Jobs get the group's priv_data rather than the
+ * pool's */
+typedef struct mboxWorkerGroup {
+    mboxWorkerPool *pool;
+    void *priv_data;
+    int lane; /* MBOX_WORKER_INTERACTIVE or MBOX_WORKER_BULK */
+    /* Jobs not yet finished times 2, the low bit is set while someone is
+     * waiting. One word so finishing the last job doesn't have to look at
+     * the group again after the waiter can see it is done */
+    int state;
+} mboxWorkerGroup;
+
 #define mboxWorkerPoolSetPrivData(p, d) (p->priv_data = d)
 
+/* Never blocks, if the ring is full the caller runs queued jobs itself until
+ * there is room */
 void mboxWorkerPoolEnqueue(mboxWorkerPool *pool, mboxWorkerCallback *callback,
         void *work);
+/* Enqueue `count` jobs with the same callback, one for each of `argv`. Costs
+ * about the same as enqueueing one */
+void mboxWorkerPoolEnqueueBatch(mboxWorkerPool *pool,
+        mboxWorkerCallback *callback, void **argv, size_t count);
 void mboxWorkerPoolWait(mboxWorkerPool *pool);
+
+/* Run one queued job on the calling thread, from any group. Returns 0 if
+ * there was nothing to run */
+int mboxWorkerPoolHelp(mboxWorkerPool *pool);
+
+/* For long bulk jobs to call every so often at a point where they can stand
+ * to be held up. Runs any interactive jobs waiting on the pool the current
+ * job came from, so they don't wait for the bulk job to finish. Does nothing
+ * outside a job or in an interactive one. Returns how many were run */
+int mboxWorkerYield(void);
+
 mboxWorkerPool *mboxWorkerPoolNew(size_t worker_count);
+
+/* A copy of the counters, read without stopping anything so they may be a
+ * job or two apart from each other. NULL if built without stats */
+mboxWorkerPoolCounters *mboxWorkerPoolStats(mboxWorkerPool *pool);
+void mboxWorkerPoolStatsRelease(mboxWorkerPoolCounters *stats);
+/* Start counting again from 0, say before the parse you want to look at */
+void mboxWorkerPoolStatsReset(mboxWorkerPool *pool);
+
+/* Restrict the workers to `cpus`, or if `pin` is set put each on just one of
+ * them in turn. Returns 0 if the platform can't */
+int mboxWorkerPoolSetAffinity(mboxWorkerPool *pool, int *cpus,
+        size_t cpu_count, int pin);
 void mboxWorkerPoolRelease(mboxWorkerPool *pool);
 
+/* Groups start out bulk */
+mboxWorkerGroup *mboxWorkerGroupNew(mboxWorkerPool *pool, void *priv_data);
+/* Only while none of its jobs are queued */
+void mboxWorkerGroupSetLane(mboxWorkerGroup *group, int lane);
+void mboxWorkerGroupEnqueue(mboxWorkerGroup *group,
+        mboxWorkerCallback *callback, void *argv);
+void mboxWorkerGroupEnqueueBatch(mboxWorkerGroup *group,
+        mboxWorkerCallback *callback, void **argv, size_t count);
+/* Wait for every job in the group, running queued jobs meanwhile */
+void mboxWorkerGroupWait(mboxWorkerGroup *group);
+/* Only once it has been waited on */
+void mboxWorkerGroupRelease(mboxWorkerGroup *group);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,29 +4,87 @@
  *
  * This code is released under the BSD 2 clause license.
  * See the COPYING file for more information. */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "mbox-balance.h"
 #include "mbox-buf.h"
+#include "mbox-gzip.h"
 #include "mbox-io.h"
 #include "mbox-list.h"
 #include "mbox-logger.h"
+#include "mbox-memory.h"
 #include "mbox-msg.h"
+#include "mbox-notify.h"
 #include "mbox-parser.h"
+#include "mbox-queue.h"
+#include "mbox-runtime.h"
+#include "mbox-timing.h"
 #include "mbox-worker.h"
 #include "mbox.h"
 
+/* The file is cut into many more ranges than there are threads, readers
+ * take the next range when they finish one so a range full of huge messages
+ * holds up one thread rather than the whole parse. It also gives the
+ * balancing a chance to move threads around between ranges */
+#define MBOX_RANGES_PER_THREAD (8)
+#define MBOX_RANGE_MAX_SIZE (64 * 1024 * 1024)
+#define MBOX_RANGE_MIN_SIZE (4 * MBOX_IO_READ_SIZE)
+
+/* How many messages can be between being read and handed to the caller when
+ * streaming */
+#define MBOX_STREAM_QUEUE_LEN (1024)
+
+/* Messages found by an io thread are handed to the parse group this many at
+ * a time */
+#define MBOX_EMIT_BATCH (32)
+
+/* Bytes of messages copied out of the read buffers and waiting to be parsed
+ * before readers stop handing them over and parse them themselves */
+#define MBOX_BACKLOG_LIMIT (64 * 1024 * 1024)
+
+typedef struct mboxEmitBatch {
+    void *msgs[MBOX_EMIT_BATCH];
+    size_t len;
+    mboxList *results; /* The range's, each message gets a place in it */
+} mboxEmitBatch;
+
+/* The arena one thread parses a file's messages into, only that thread ever
+ * allocates from it */
+typedef struct mboxThreadArena {
+    pthread_t thread;
+    mboxArena *arena;
+} mboxThreadArena;
+
+/* A parse running on its own thread, see mboxParseAsync */
+typedef struct mboxAsync {
+    struct mbox *m;
+    mboxNotify notify; /* Signalled as ranges are read and when it is over */
+    pthread_t thread;
+    int state;    /* MBOX_ASYNC_* */
+    size_t total; /* Size of the file, 0 if it won't be known until the end */
+} mboxAsync;
+
 typedef struct mbox {
     int readfd;
+    int directfd; /* Opened with O_DIRECT by mboxReadOpenDirect, else -1 */
     int writefd;
     int read_refcount;
     int write_refcount;
@@ -38,47 +96,374 @@ typedef struct mbox {
     mboxParserCtx *contexts;
     mboxList *completed_io;
     mboxList *completed_parse;
-    mboxWorkerPool *io_pool;
-    mboxWorkerPool *parse_pool;
+    mboxRuntime *runtime; /* Whose threads we parse on */
+    mboxWorkerGroup *io_group;    /* Reading ranges and stitching them */
+    mboxWorkerGroup *parse_group; /* Parsing the messages found */
+    int balance_mode;             /* MBOX_BALANCE_* */
+    int lane; /* MBOX_WORKER_BULK or MBOX_WORKER_INTERACTIVE */
+    mboxBalance balance; /* How many threads read rather than parse */
+    size_t next_range;   /* The next range for a reader to take */
+    size_t backlog_limit; /* Bytes, 0 for no limit */
+    size_t backlog_bytes; /* Held by messages waiting to be parsed */
+    mboxChar *map; /* Whole file when opened with mboxReadOpenMapped */
+    size_t map_len;
+    int io_engine; /* MBOX_IO_ENGINE_*, how the contexts read the file */
+    mboxQueue *stream; /* When streaming parsed messages go here rather than
+                          on to completed_parse */
+    pthread_t stream_thread;
+    int gzip; /* Opened with mboxReadOpenGzip, file_size is then the inflated
+                 size, or SSIZE_MAX until we know it */
+    mboxGzIndex *gz_index; /* Checkpoints, without them there is one range */
+    char *gz_checkpoint;   /* Where checkpoints are saved, can be NULL */
+    mboxAsync *async;      /* Told about progress if parsing in the
+                              background */
+    int cancel;            /* Set to wind the running parse down early */
+    size_t progress;       /* Bytes of ranges read so far */
+    uint64_t id;           /* Never reused, for the thread's arena cache */
+    pthread_mutex_t arena_lock;
+    mboxList *arenas; /* mboxThreadArena, every parsed message lives in one of
+                         these until the mbox is released */
+    mboxIntern *senders; /* Every sender and domain parsed, messages refer to
+                            them by id */
+    int lazy; /* Messages only keep where their fields are, see mboxSetLazy */
 } mbox;
 
+/* The last arena this thread parsed into and the mbox it belongs to, a
+ * thread tends to parse many messages from the same file in a row */
+static __thread mboxArena *mbox_thread_arena = NULL;
+static __thread uint64_t mbox_thread_arena_owner = 0;
+static uint64_t mbox_next_id = 1;
+
+/* Each thread gets its own so allocating is a bump with nothing shared. The
+ * lock is only taken the first time a thread parses for this mbox, or when
+ * it comes back to it after parsing another */
+static mboxArena *
+mboxParseArena(mbox *m)
+{
+    pthread_t self = pthread_self();
+    mboxThreadArena *ta = NULL;
+    mboxLNode *node = NULL;
+
+    if (mbox_thread_arena_owner == m->id) {
+        return mbox_thread_arena;
+    }
+
+    pthread_mutex_lock(&m->arena_lock);
+    node = m->arenas->root;
+    for (size_t i = 0; i < m->arenas->len; ++i, node = node->next) {
+        mboxThreadArena *candidate = (mboxThreadArena *)node->data;
+        if (pthread_equal(candidate->thread, self)) {
+            ta = candidate;
+            break;
+        }
+    }
+    if (ta == NULL) {
+        ta = (mboxThreadArena *)malloc(sizeof(mboxThreadArena));
+        ta->thread = self;
+        ta->arena = mboxArenaNew();
+        mboxListAddTail(m->arenas, ta);
+    }
+    pthread_mutex_unlock(&m->arena_lock);
+
+    mbox_thread_arena = ta->arena;
+    mbox_thread_arena_owner = m->id;
+    return ta->arena;
+}
+
+static void
+mboxThreadArenaRelease(void *data)
+{
+    mboxThreadArena *ta = (mboxThreadArena *)data;
+    mboxArenaRelease(ta->arena);
+    free(ta);
+}
+
+static int
+mboxCancelled(mbox *m)
+{
+    return __atomic_load_n(&m->cancel, __ATOMIC_RELAXED);
+}
+
+/* What a message holds on to until it is parsed, nothing if it is
+ * borrowing the mapping or the read buffer */
+static size_t
+mboxIOMsgHeldBytes(mboxIOMsg *msg)
+{
+    return msg->buf != &msg->view ? msg->buf->capacity : 0;
+}
+
 /* call back for parsing a message from a minimal representation */
 static void
 mboxIOMsgParseCallback(void *argv1, void *argv2)
 {
     mbox *m = (mbox *)argv1;
     mboxIOMsg *msg = (mboxIOMsg *)argv2;
-    mboxMsgLite *lite = mboxMsgLiteCreate(msg);
-    mboxListTSAddTail(m->completed_parse, lite);
+    size_t held = mboxIOMsgHeldBytes(msg);
+    mboxLNode *slot = msg->slot;
+    uint64_t start = 0;
+    mboxMsgLite *lite = NULL;
+
+    /* Its slot stays empty, the results are thrown away */
+    if (mboxCancelled(m)) {
+        mboxIOMsgRelease(msg);
+        __atomic_sub_fetch(&m->backlog_bytes, held, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* Streamed messages are the caller's to release one at a time */
+    start = mboxTimerNowNs();
+    if (m->lazy && !m->gzip) {
+        lite = mboxMsgLiteCreateLazy(msg,
+                m->stream ? NULL : mboxParseArena(m));
+    } else {
+        lite = mboxMsgLiteCreate(msg, m->stream ? NULL : mboxParseArena(m));
+    }
+    /* Nothing to intern until the sender has been decoded */
+    mboxMsgLiteIntern(lite, m->senders);
+    mboxBalanceParsed(&m->balance, mboxTimerNowNs() - start);
+    __atomic_sub_fetch(&m->backlog_bytes, held, __ATOMIC_RELAXED);
+
+    if (m->stream) {
+        if (!mboxQueuePush(m->stream, lite)) {
+            mboxMsgLiteRelease(lite);
+        }
+    } else {
+        slot->data = lite;
+    }
 }
 
-/* Made generic so it can work in a thread pool */
 static void
-mboxParserCtxGetNextMessageCallback(void *argv1, void *argv2)
+mboxEmitFlush(mbox *m, mboxEmitBatch *batch)
+{
+    mboxBalanceQueued(&m->balance, batch->len);
+    mboxWorkerGroupEnqueueBatch(m->parse_group, mboxIOMsgParseCallback,
+            batch->msgs, batch->len);
+    batch->len = 0;
+}
+
+/* The pool is shared so the threads waiting for room may be the ones that
+ * would otherwise be parsing what is holding it up, run queued jobs while we
+ * wait. Returns 0 if the stream was closed */
+static int
+mboxStreamReserve(mbox *m)
+{
+    int ok = 0;
+
+    while ((ok = mboxQueueReserveTimed(m->stream, 0)) == -1) {
+        if (!mboxWorkerPoolHelp(m->runtime->pool) &&
+                (ok = mboxQueueReserveTimed(m->stream, 1)) != -1) {
+            break;
+        }
+    }
+    return ok;
+}
+
+/* Send a message off to be parsed, they go in batches. When streaming we
+ * first wait for room in the queue so memory use does not grow with the size
+ * of the file, returns 0 if the stream was closed and the message dropped.
+ * If the messages waiting to be parsed already hold more than the backlog
+ * limit the parsers are not keeping up, rather than queue more or wait for
+ * them we parse it here */
+static int
+mboxEmitMsg(mbox *m, mboxEmitBatch *batch, mboxIOMsg *msg)
+{
+    size_t held = 0;
+
+    if (m->stream && !mboxStreamReserve(m)) {
+        mboxIOMsgRelease(msg);
+        return 0;
+    }
+
+    held = __atomic_add_fetch(&m->backlog_bytes, mboxIOMsgHeldBytes(msg),
+            __ATOMIC_RELAXED);
+
+    /* Its place in the results is taken now while we know the order, the
+     * parse fills it in whenever it gets to it */
+    if (!m->stream) {
+        mboxListAddTail(batch->results, NULL);
+        msg->slot = batch->results->root->prev;
+    }
+
+    /* Fused, the message may be borrowing the read buffer */
+    if (m->balance.mode == MBOX_BALANCE_FUSED ||
+            (m->backlog_limit > 0 && held > m->backlog_limit)) {
+        mboxBalanceQueued(&m->balance, 1);
+        mboxIOMsgParseCallback(m, msg);
+        return 1;
+    }
+
+    if (m->stream) {
+        /* Messages held back in a batch have room reserved, waiting for more
+         * room while holding them could wait forever */
+        mboxBalanceQueued(&m->balance, 1);
+        mboxWorkerGroupEnqueue(m->parse_group, mboxIOMsgParseCallback, msg);
+        return 1;
+    }
+
+    batch->msgs[batch->len++] = msg;
+    if (batch->len == MBOX_EMIT_BATCH) {
+        mboxEmitFlush(m, batch);
+    }
+    return 1;
+}
+
+/* Contexts only hold a buffer while they are reading */
+static void
+mboxRangeOpen(mbox *m, mboxParserCtx *ctx, size_t start, size_t end)
+{
+    mboxParserCtxInit(ctx, ctx->id, m->readfd, m->file_size);
+    ctx->borrow = m->balance.mode == MBOX_BALANCE_FUSED;
+    if (m->gzip) {
+        mboxGzReader *gz = ctx->gz;
+        ctx->gz = NULL;
+        /* Record checkpoints on the first pass, later passes use them */
+        if (gz == NULL) {
+            gz = mboxGzReaderNew(m->readfd, m->gz_index,
+                    m->gz_index == NULL && m->gz_checkpoint != NULL);
+        }
+        if (gz == NULL) {
+            loggerPanic("Failed to start inflating\n");
+        }
+        mboxIOSetGzip(ctx->ioctx, gz);
+    } else if (m->map) {
+        mboxIOSetMap(ctx->ioctx, m->map);
+    } else if (m->directfd != -1) {
+        mboxIOSetDirect(ctx->ioctx, m->directfd);
+    } else {
+        mboxIOSetEngine(ctx->ioctx, m->io_engine);
+    }
+    mboxIOSetStartOffset(ctx->ioctx, start);
+    mboxIOSetOffset(ctx->ioctx, start);
+    mboxIOSetFileOffset(ctx->ioctx, start);
+    mboxIOSetFileSize(ctx->ioctx, m->file_size);
+    ctx->ioctx->end_offset = end;
+}
+
+static void
+mboxRangeClose(mbox *m, mboxParserCtx *ctx)
+{
+    mboxGzIndex *idx = NULL;
+
+    /* Only the single range of a first gzip pass records, it has inflated the
+     * whole file if it got to the end */
+    if (ctx->ioctx->gz && (idx = mboxGzReaderTakeIndex(ctx->ioctx->gz))) {
+        if (mboxGzIndexSave(idx, m->gz_checkpoint, m->readfd)) {
+            loggerDebug("Saved %s\n", m->gz_checkpoint);
+        }
+        m->gz_index = idx;
+        m->file_size = mboxGzIndexSize(idx);
+    }
+    mboxIORelease(ctx->ioctx);
+    ctx->ioctx = NULL;
+}
+
+/* Finish off the message which ran past the end of this context's range, it
+ * ends where the next range with a message in it starts */
+static void
+mboxParserCtxStitchCallback(void *argv1, void *argv2)
 {
     mbox *m = (mbox *)argv1;
     mboxParserCtx *ctx = (mboxParserCtx *)argv2;
     mboxIOMsg *msg = NULL;
+    mboxEmitBatch batch = { .len = 0, .results = ctx->results };
+    size_t end = MBOX_PARSE_NO_OFFSET;
 
-    while ((msg = mboxParserCtxGetNextMessage(ctx)) != NULL) {
-        mboxWorkerPoolEnqueue(m->parse_pool, mboxIOMsgParseCallback, msg);
-        if (ctx->err == MBOX_PARSE_DONE) {
+    for (size_t i = ctx->id + 1; i < m->context_len; ++i) {
+        if (m->contexts[i].first_msg != MBOX_PARSE_NO_OFFSET) {
+            end = m->contexts[i].first_msg;
             break;
         }
     }
+
+    if (end != MBOX_PARSE_NO_OFFSET) {
+        mboxRangeOpen(m, ctx, ctx->tail_msg, end);
+        msg = mboxParserCtxGetMessageAt(ctx, ctx->tail_msg, end);
+    } else {
+        /* The last message in the file, parse it like any other so the end
+         * of the file is handled the same */
+        mboxRangeOpen(m, ctx, ctx->tail_msg, m->file_size);
+        msg = mboxParserCtxGetNextMessage(ctx);
+    }
+
+    if (msg) {
+        mboxEmitMsg(m, &batch, msg);
+        mboxEmitFlush(m, &batch);
+    }
+    mboxRangeClose(m, ctx);
 }
 
-/* Find start of message */
+/* Made generic so it can work in a thread pool */
 static void
-mboxParserCtxSeekStartCallback(void *argv1, void *argv2)
+mboxParserCtxGetNextMessageCallback(void *argv1, void *argv2)
 {
-    (void)argv1;
+    mbox *m = (mbox *)argv1;
     mboxParserCtx *ctx = (mboxParserCtx *)argv2;
-    mboxParserCtxSeekStart(ctx);
+    mboxIOMsg *msg = NULL;
+    mboxEmitBatch batch = { .len = 0, .results = ctx->results };
+
+    mboxRangeOpen(m, ctx, ctx->range_start, ctx->range_end);
+
+    if (mboxParserCtxSeekStart(ctx)) {
+        ctx->first_msg = ctx->ioctx->start_offset;
+        while ((msg = mboxParserCtxGetNextMessage(ctx)) != NULL) {
+            if (!mboxEmitMsg(m, &batch, msg) ||
+                    ctx->err == MBOX_PARSE_DONE || mboxCancelled(m)) {
+                break;
+            }
+            /* A range can take a while, don't hold up interactive parses */
+            mboxWorkerYield();
+        }
+        mboxEmitFlush(m, &batch);
+    }
+
+    /* Getting a gzip reader to the tail again means inflating up to it */
+    if (ctx->ioctx->gz && ctx->tail_msg != MBOX_PARSE_NO_OFFSET) {
+        ctx->gz = ctx->ioctx->gz;
+        ctx->ioctx->gz = NULL;
+    }
+
+    mboxRangeClose(m, ctx);
 }
 
-mbox *
-mboxReadOpen(char *file_path, int perms)
+/* Reads ranges until there are none left, there are only as many of these
+ * running as ranges we want read at once. Between ranges the reader may hand
+ * its thread over to parsing, or start another reader if parsing is keeping
+ * up */
+static void
+mboxRangeReaderCallback(void *argv1, void *argv2)
+{
+    mbox *m = (mbox *)argv1;
+    size_t i = 0;
+
+    (void)argv2;
+    while (!mboxCancelled(m) &&
+            (i = __atomic_fetch_add(&m->next_range, 1, __ATOMIC_RELAXED)) <
+                    m->context_len) {
+        mboxParserCtx *ctx = &m->contexts[i];
+        uint64_t start = mboxTimerNowNs();
+        mboxParserCtxGetNextMessageCallback(m, ctx);
+        mboxBalanceRead(&m->balance, ctx->parsed, mboxTimerNowNs() - start);
+
+        __atomic_add_fetch(&m->progress, ctx->range_end - ctx->range_start,
+                __ATOMIC_RELAXED);
+        if (m->async) {
+            mboxNotifySignal(&m->async->notify);
+        }
+
+        switch (mboxBalanceStep(&m->balance)) {
+        case MBOX_BALANCE_RETIRE:
+            return;
+        case MBOX_BALANCE_SPAWN:
+            mboxWorkerGroupEnqueue(m->io_group, mboxRangeReaderCallback,
+                    NULL);
+            break;
+        }
+    }
+    mboxBalanceReaderExit(&m->balance);
+}
+
+static mbox *
+mboxOpen(char *file_path, int perms)
 {
     struct stat st;
     int fd = -1;
@@ -102,113 +487,487 @@ mboxReadOpen(char *file_path, int perms)
     m = (mbox *)malloc(sizeof(mbox));
     m->read_refcount = 1;
     m->readfd = fd;
+    m->directfd = -1;
     loggerDebug("Fd: %d\n", fd);
     m->err = 0;
     m->file_size = st.st_size;
     m->ready = 1;
+    m->map = NULL;
+    m->map_len = 0;
+    m->io_engine = MBOX_IO_ENGINE_AUTO;
+    m->stream = NULL;
+    m->runtime = NULL;
+    m->io_group = NULL;
+    m->parse_group = NULL;
+    m->balance_mode = MBOX_BALANCE_ADAPTIVE;
+    m->lane = MBOX_WORKER_BULK;
+    mboxBalanceInit(&m->balance, m->balance_mode, 1, 1);
+    m->next_range = 0;
+    m->backlog_limit = MBOX_BACKLOG_LIMIT;
+    m->backlog_bytes = 0;
+    m->completed_io = NULL;
+    m->completed_parse = NULL;
+    m->contexts = NULL;
+    m->context_len = 0;
+    m->gzip = 0;
+    m->gz_index = NULL;
+    m->gz_checkpoint = NULL;
+    m->async = NULL;
+    m->cancel = 0;
+    m->progress = 0;
+    m->id = __atomic_fetch_add(&mbox_next_id, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&m->arena_lock, NULL);
+    m->arenas = mboxListNew();
+    mboxListSetFreedata(m->arenas, mboxThreadArenaRelease);
+    m->senders = mboxInternNew();
+    m->lazy = 0;
 
     return m;
 }
 
+mbox *
+mboxReadOpen(char *file_path, int perms)
+{
+    return mboxOpen(file_path, perms);
+}
+
+/* Map the whole file in, parsing then works on views into the mapping rather
+ * than reading into and copying out of buffers.
+ *
+ * The parser expects the byte after what it has read to be '\0' and will
+ * write one there. So we reserve an extra page of anonymous memory and place
+ * the file over the front of it, the file's last page is zero filled by the
+ * kernel and the spare page soaks up the rest. If anything fails the mbox is
+ * left unmapped and is read as normal */
+static void
+mboxMapFile(mbox *m)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *reserve = NULL;
+    void *file = NULL;
+
+    if (m->map) {
+        munmap(m->map, m->map_len);
+        m->map = NULL;
+        m->map_len = 0;
+    }
+
+    if (m->file_size == 0) {
+        return;
+    }
+
+    m->map_len = ((m->file_size + page - 1) & ~(page - 1)) + page;
+    reserve = mmap(NULL, m->map_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (reserve == MAP_FAILED) {
+        loggerDebug("Failed to reserve mapping: %s\n", strerror(errno));
+        m->map_len = 0;
+        return;
+    }
+
+    file = mmap(reserve, m->file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+            m->readfd, 0);
+
+    if (file == MAP_FAILED) {
+        loggerDebug("Failed to map file: %s\n", strerror(errno));
+        munmap(reserve, m->map_len);
+        m->map_len = 0;
+        return;
+    }
+
+    madvise(file, m->file_size, MADV_SEQUENTIAL);
+    m->map = (mboxChar *)file;
+}
+
+mbox *
+mboxReadOpenMapped(char *file_path, int perms)
+{
+    mbox *m = mboxOpen(file_path, perms);
+
+    if (m) {
+        mboxMapFile(m);
+    }
+    return m;
+}
+
+/* For a one off scan of a big cold file, reading it through the page cache
+ * would only push out everything else on the box. If the filesystem won't do
+ * O_DIRECT we quietly read as normal */
+mbox *
+mboxReadOpenDirect(char *file_path, int perms)
+{
+    mbox *m = mboxOpen(file_path, perms);
+
+    if (m == NULL) {
+        return NULL;
+    }
+
+#ifdef O_DIRECT
+    m->directfd = open(file_path, O_RDONLY | O_DIRECT);
+    if (m->directfd == -1) {
+        loggerDebug("Failed to open with O_DIRECT: %s\n", strerror(errno));
+    }
+#endif
+    return m;
+}
+
+/* Offsets are into the inflated data so nothing past the reads knows the
+ * difference. Without checkpoints inflating can only go from the start so
+ * the whole file is one range, with them it is cut up like any other file.
+ * If `checkpoint_path` is given checkpoints are loaded from it, or recorded
+ * while parsing and saved there for next time */
+mbox *
+mboxReadOpenGzip(char *file_path, char *checkpoint_path, int perms)
+{
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+    mbox *m = mboxOpen(file_path, perms);
+
+    if (m == NULL) {
+        return NULL;
+    }
+
+    m->gzip = 1;
+    m->file_size = SSIZE_MAX;
+    if (checkpoint_path) {
+        m->gz_checkpoint = strdup(checkpoint_path);
+        m->gz_index = mboxGzIndexLoad(checkpoint_path, m->readfd);
+        if (m->gz_index) {
+            m->file_size = mboxGzIndexSize(m->gz_index);
+        }
+    }
+    return m;
+#else
+    (void)file_path;
+    (void)checkpoint_path;
+    (void)perms;
+    loggerDebug("Built without zlib\n");
+    return NULL;
+#endif
+}
+
+void
+mboxSetIOEngine(mbox *m, int engine)
+{
+    m->io_engine = engine;
+}
+
+void
+mboxSetBalance(mbox *m, int balance)
+{
+    m->balance_mode = balance;
+}
+
+void
+mboxSetBacklogLimit(mbox *m, size_t bytes)
+{
+    m->backlog_limit = bytes;
+}
+
+void
+mboxSetPriority(mbox *m, int priority)
+{
+    m->lane = priority;
+    if (m->io_group) {
+        mboxWorkerGroupSetLane(m->io_group, priority);
+        mboxWorkerGroupSetLane(m->parse_group, priority);
+    }
+}
+
+void
+mboxSetRuntime(mbox *m, mboxRuntime *rt)
+{
+    /* Groups are tied to a pool, the next parse makes new ones */
+    mboxWorkerGroupRelease(m->io_group);
+    mboxWorkerGroupRelease(m->parse_group);
+    m->io_group = NULL;
+    m->parse_group = NULL;
+    m->runtime = rt;
+}
+
+mboxIntern *
+mboxSenders(mbox *m)
+{
+    return m->senders;
+}
+
+void
+mboxSetLazy(mbox *m, int lazy)
+{
+    m->lazy = lazy;
+}
+
+/* Decode the field from the file, NULL if the message doesn't have it */
+static mboxBuf *
+mboxReadFieldRaw(mbox *m, mboxMsgLite *msg, int field)
+{
+    mboxMsgSpan *span = &msg->spans[field];
+    size_t offset = msg->start + span->offset;
+    mboxChar buffer[1024];
+    mboxChar *raw = buffer;
+    mboxBuf *decoded = NULL;
+    size_t got = 0;
+
+    if (span->len == 0) {
+        return NULL;
+    }
+
+    if (m->map) {
+        return mboxMsgFieldDecode(field, m->map + offset, span->len);
+    }
+
+    if (span->len > sizeof(buffer)) {
+        raw = (mboxChar *)malloc(span->len);
+    }
+    while (got < span->len) {
+        ssize_t rbytes = pread(m->readfd, raw + got, span->len - got,
+                offset + got);
+        if (rbytes <= 0) {
+            if (rbytes == -1 && errno == EINTR) {
+                continue;
+            }
+            loggerDebug("Failed to read field at %zu: %s\n", offset,
+                    strerror(errno));
+            break;
+        }
+        got += rbytes;
+    }
+
+    if (got == span->len) {
+        decoded = mboxMsgFieldDecode(field, raw, span->len);
+    }
+    if (raw != buffer) {
+        free(raw);
+    }
+    return decoded;
+}
+
+mboxBuf *
+mboxMsgLiteReadField(mbox *m, mboxMsgLite *msg, int field)
+{
+    mboxBuf **slot = mboxMsgLiteFieldSlot(msg, field);
+    mboxBuf *cached = NULL;
+
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    cached = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (cached || msg->spans == NULL) {
+        return mboxBufMaybeDup(cached);
+    }
+    return mboxReadFieldRaw(m, msg, field);
+}
+
+mboxBuf *
+mboxMsgLiteField(mbox *m, mboxMsgLite *msg, int field)
+{
+    mboxBuf **slot = mboxMsgLiteFieldSlot(msg, field);
+    mboxBuf *cached = NULL;
+    mboxBuf *decoded = NULL;
+    mboxBuf *expected = NULL;
+
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    cached = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (cached || msg->spans == NULL) {
+        return cached;
+    }
+
+    decoded = mboxReadFieldRaw(m, msg, field);
+    if (decoded == NULL) {
+        return NULL;
+    }
+
+    /* Goes when the message does, so into this thread's arena if that is
+     * where the message is */
+    if (msg->in_arena) {
+        mboxArena *arena = mboxParseArena(m);
+        mboxBuf *dupe = (mboxBuf *)mboxArenaAlloc(arena, sizeof(mboxBuf));
+        dupe->data = (mboxChar *)mboxArenaAlloc(arena, decoded->len + 1);
+        memcpy(dupe->data, decoded->data, decoded->len);
+        dupe->data[decoded->len] = '\0';
+        dupe->len = dupe->capacity = decoded->len;
+        dupe->offset = 0;
+        mboxBufRelease(decoded);
+        decoded = dupe;
+    }
+
+    /* Another thread may have got there first, what it decoded is the same.
+     * A loser in an arena is left for the arena to free */
+    if (!__atomic_compare_exchange_n(slot, &expected, decoded, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (!msg->in_arena) {
+            mboxBufRelease(decoded);
+        }
+        return expected;
+    }
+    return decoded;
+}
+
+static void
+mboxRangeInit(mbox *m, size_t i, size_t start, size_t end)
+{
+    mboxParserCtx *ctx = &m->contexts[i];
+
+    ctx->id = i;
+    ctx->parsed = 0;
+    ctx->err = MBOX_IO_OK;
+    ctx->ioctx = NULL;
+    ctx->gz = NULL;
+    ctx->first_msg = MBOX_PARSE_NO_OFFSET;
+    ctx->tail_msg = MBOX_PARSE_NO_OFFSET;
+    ctx->range_start = start;
+    ctx->range_end = end;
+    ctx->results = mboxListNew();
+    m->read_refcount++;
+    loggerDebug("[%zu]range: %zu-%zu\n", i, start, end);
+}
+
+/* A range per checkpoint. Finding where the range starts reads from the
+ * byte before it, so the ranges start one past the checkpoint to make that
+ * the checkpoint itself */
 static void
-mboxSetAllOffsets(mbox *m)
+mboxSetGzipOffsets(mbox *m)
 {
-    size_t io_thread_count = m->io_pool->worker_count;
-    size_t chunk_size = m->file_size / io_thread_count;
-    size_t non_null = 0;
-    ssize_t offset = 0;
-    mboxParserCtx *ctx = NULL;
-    mboxParserCtx *ctx_prev = NULL;
+    size_t len = mboxGzIndexLen(m->gz_index);
+    size_t start = 0;
 
-    m->context_len = io_thread_count;
+    free(m->contexts);
+    m->context_len = len > 0 ? len : 1;
     m->contexts = (mboxParserCtx *)malloc(
-            sizeof(mboxParserCtx) * io_thread_count);
+            sizeof(mboxParserCtx) * m->context_len);
 
-    /* Find the offests for each context */
-    for (size_t i = 0; i < io_thread_count; ++i) {
-        offset = (ssize_t)(i * chunk_size);
-        ctx = &m->contexts[i];
-        mboxParserCtxInit(ctx, i, m->readfd, m->file_size);
-        ctx->ioctx->fd = m->readfd;
-        mboxIOSetStartOffset(ctx->ioctx, offset);
-        mboxIOSetOffset(ctx->ioctx, offset);
-        mboxIOSetFileOffset(ctx->ioctx, offset);
-        mboxIOSetFileSize(ctx->ioctx, m->file_size);
-        mboxWorkerPoolEnqueue(m->io_pool, mboxParserCtxSeekStartCallback, ctx);
+    for (size_t i = 0; i < m->context_len; ++i) {
+        size_t end = m->file_size;
+        if (i + 1 < len) {
+            end = mboxGzIndexOffset(m->gz_index, i + 1) + 1;
+        }
+        mboxRangeInit(m, i, start, end);
+        start = end;
     }
+}
 
-    mboxWorkerPoolWait(m->io_pool);
+/* Cut [start, file_size) into ranges */
+static void
+mboxSetAllOffsets(mbox *m, size_t start)
+{
+    size_t range_size = (m->file_size - start) /
+            (m->thread_count * MBOX_RANGES_PER_THREAD);
+    size_t range_count = 0;
 
-    /* Set all of the offsets */
-    for (size_t i = 1; i < io_thread_count; ++i) {
-        ctx = &m->contexts[i];
-        ctx_prev = &m->contexts[i - 1];
-        ctx_prev->ioctx->end_offset = ctx->ioctx->start_offset;
-        /* reset the offset which is used for bookending messages */
-        mboxIOSetOffset(ctx->ioctx, ctx->ioctx->start_offset);
+    if (m->gzip) {
+        if (m->gz_index) {
+            mboxSetGzipOffsets(m);
+            return;
+        }
+        /* Can only inflate from the start */
+        range_size = m->file_size;
+    } else if (range_size > MBOX_RANGE_MAX_SIZE) {
+        range_size = MBOX_RANGE_MAX_SIZE;
+    } else if (range_size < MBOX_RANGE_MIN_SIZE) {
+        range_size = MBOX_RANGE_MIN_SIZE;
     }
+    range_count = (m->file_size - start + range_size - 1) / range_size;
 
-    /* Set the last ones offset to the length of the file */
-    ctx = &m->contexts[io_thread_count - 1];
-    ctx->ioctx->end_offset = ctx->ioctx->file_size;
-    ctx->ioctx->offset = ctx->ioctx->start_offset;
+    /* From a previous parse, the io contexts are long gone */
+    free(m->contexts);
+    m->context_len = range_count;
+    m->contexts = (mboxParserCtx *)malloc(
+            sizeof(mboxParserCtx) * range_count);
 
-    /* filter out and release any contexts that would have parsed nothing */
-    for (size_t i = 0; i < io_thread_count; ++i) {
-        ctx = &m->contexts[i];
-        if (ctx->ioctx->end_offset - ctx->ioctx->start_offset <= 0) {
-            continue;
-        } else {
-            ctx->id = non_null;
-            m->read_refcount++;
-            loggerDebug("[%zu]start offset: %zd\n", non_null,
-                    ctx->ioctx->start_offset);
-            memmove(m->contexts + non_null, &m->contexts[i],
-                    sizeof(mboxParserCtx));
-            non_null++;
+    /* Nothing is read here, each range finds its own first message when it
+     * gets picked up */
+    for (size_t i = 0; i < range_count; ++i) {
+        size_t range_start = start + i * range_size;
+        size_t range_end = range_start + range_size;
+        if (range_end > m->file_size) {
+            range_end = m->file_size;
         }
+        mboxRangeInit(m, i, range_start, range_end);
     }
-    m->context_len = non_null;
 }
 
 static void
 mboxParseAllMessages(mbox *m)
 {
-    for (size_t i = 0; i < m->context_len; ++i) {
+    void **ranges = (void **)malloc(sizeof(void *) * m->context_len);
+    /* When streaming the caller sets the pace, and readers waiting on it for
+     * room would look slow */
+    int mode = m->stream && m->balance_mode == MBOX_BALANCE_ADAPTIVE ?
+            MBOX_BALANCE_FIXED :
+            m->balance_mode;
+    size_t readers = mboxBalanceInit(&m->balance, mode, m->thread_count,
+            m->context_len);
+    size_t tails = 0;
+
+    for (size_t i = 0; i < readers; ++i) {
+        ranges[i] = NULL;
+    }
+    m->next_range = 0;
+    mboxWorkerGroupEnqueueBatch(m->io_group, mboxRangeReaderCallback, ranges,
+            readers);
+
+    mboxWorkerGroupWait(m->io_group);
+
+    /* Every range now knows where its first message is, which is where the
+     * message running off the end of the range before it stops */
+    for (size_t i = 0; i < m->context_len && !mboxCancelled(m); ++i) {
         mboxParserCtx *ctx = &m->contexts[i];
-        mboxWorkerPoolEnqueue(m->io_pool, mboxParserCtxGetNextMessageCallback,
-                ctx);
+        if (ctx->tail_msg != MBOX_PARSE_NO_OFFSET) {
+            ranges[tails++] = ctx;
+        }
     }
+    mboxWorkerGroupEnqueueBatch(m->io_group, mboxParserCtxStitchCallback,
+            ranges, tails);
+
+    mboxWorkerGroupWait(m->io_group);
+    mboxWorkerGroupWait(m->parse_group);
 
-    mboxWorkerPoolWait(m->io_pool);
-    mboxWorkerPoolWait(m->parse_pool);
+    /* Ranges are in file order and so is each one's results */
+    for (size_t i = 0; i < m->context_len; ++i) {
+        mboxListAppendListTail(m->completed_parse, m->contexts[i].results);
+        m->contexts[i].results = NULL;
+    }
+    free(ranges);
 }
 
+/* The threads belong to the runtime, `thread_count` is how much of it this
+ * parse tries to use, split between reading and parsing by the balance. 0
+ * for all of it */
 static void
 mboxParserInit(mbox *m, size_t thread_count)
 {
-    m->thread_count = thread_count;
+    if (m->runtime == NULL) {
+        m->runtime = mboxRuntimeDefault();
+    }
     if (thread_count == 0) {
-        m->ready = 1;
-        return;
+        thread_count = mboxRuntimeThreadCount(m->runtime);
     }
 
-    int io_threads = thread_count / 2;
-    int parser_threads = thread_count / 2;
-    m->context_len = io_threads;
-    m->completed_io = mboxListNew();
+    m->thread_count = thread_count;
     m->completed_parse = mboxListNew();
-    m->io_pool = mboxWorkerPoolNew(io_threads);
-    m->parse_pool = mboxWorkerPoolNew(parser_threads);
+    m->cancel = 0;
+    m->progress = 0;
+    /* The groups are kept for any further parses of the same file */
+    if (m->io_group == NULL) {
+        if (m->completed_io == NULL) {
+            m->completed_io = mboxListNew();
+        }
+        m->io_group = mboxWorkerGroupNew(m->runtime->pool, m);
+        m->parse_group = mboxWorkerGroupNew(m->runtime->pool, m);
+        mboxWorkerGroupSetLane(m->io_group, m->lane);
+        mboxWorkerGroupSetLane(m->parse_group, m->lane);
+    }
     m->ready = 1;
 }
 
 static void
-mboxMain(mbox *m)
+mboxMain(mbox *m, size_t start)
 {
-    mboxSetAllOffsets(m);
-    mboxWorkerPoolSetPrivData(m->io_pool, m);
-    mboxWorkerPoolSetPrivData(m->parse_pool, m);
+    mboxSetAllOffsets(m, start);
     mboxParseAllMessages(m);
 }
 
@@ -216,12 +975,257 @@ mboxList *
 mboxParse(mbox *m, size_t thread_count)
 {
     mboxParserInit(m, thread_count);
-    mboxMain(m);
+    mboxMain(m, 0);
     mboxListSetFreedata(m->completed_parse,
             (mboxListFreeData *)mboxMsgLiteRelease);
     return m->completed_parse;
 }
 
+/* Only the messages starting at or after `*offset`, the ranges are laid over
+ * the new part of the file and the first one seeks forward to the first
+ * 'From ' line like any other */
+mboxList *
+mboxParseAppended(mbox *m, size_t *offset, size_t thread_count)
+{
+    mboxList *previous = NULL;
+    mboxList *appended = NULL;
+    struct stat st;
+
+    /* Appending to a gzip file is a new member we would have to find */
+    if (m->gzip) {
+        return NULL;
+    }
+
+    if (fstat(m->readfd, &st) != 0) {
+        loggerDebug("Failed to fstat file: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    /* Truncated or rewritten, the offset means nothing any more */
+    if ((size_t)st.st_size < *offset) {
+        return NULL;
+    }
+
+    /* The messages live in our arenas, the caller only has the list */
+    if ((size_t)st.st_size == *offset) {
+        return mboxListNew();
+    }
+
+    if ((size_t)st.st_size != m->file_size) {
+        m->file_size = st.st_size;
+        if (m->map) {
+            mboxMapFile(m);
+        }
+    }
+
+    previous = m->completed_parse;
+    mboxParserInit(m, thread_count);
+    mboxMain(m, *offset);
+    appended = m->completed_parse;
+    m->completed_parse = previous;
+
+    *offset = m->file_size;
+    return appended;
+}
+
+static void *
+mboxParseStreamMain(void *argv)
+{
+    mbox *m = (mbox *)argv;
+    mboxMain(m, 0);
+    /* Everything has been pushed, let the reader run dry */
+    mboxQueueClose(m->stream);
+    return NULL;
+}
+
+/* The parse runs on its own thread and fills the queue as fast as the reader
+ * empties it */
+int
+mboxParseIterOpen(mbox *m, size_t thread_count)
+{
+    mboxParserInit(m, thread_count);
+    m->stream = mboxQueueNew(MBOX_STREAM_QUEUE_LEN);
+
+    if (pthread_create(&m->stream_thread, NULL, mboxParseStreamMain, m) !=
+            0) {
+        loggerDebug("Failed to start stream: %s\n", strerror(errno));
+        mboxQueueRelease(m->stream);
+        m->stream = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+mboxMsgLite *
+mboxParseIterNext(mbox *m)
+{
+    return (mboxMsgLite *)mboxQueuePop(m->stream);
+}
+
+/* Safe to call before the iterator has run dry, anything still in flight is
+ * dropped and the parse winds down early */
+void
+mboxParseIterClose(mbox *m)
+{
+    mboxMsgLite *lite = NULL;
+
+    if (m->stream == NULL) {
+        return;
+    }
+
+    mboxQueueClose(m->stream);
+    while ((lite = mboxQueuePop(m->stream)) != NULL) {
+        mboxMsgLiteRelease(lite);
+    }
+    pthread_join(m->stream_thread, NULL);
+    mboxQueueRelease(m->stream);
+    m->stream = NULL;
+}
+
+size_t
+mboxParseStream(mbox *m, size_t thread_count,
+        mboxParseStreamCallback *callback, void *ctx)
+{
+    mboxMsgLite *lite = NULL;
+    size_t count = 0;
+
+    if (!mboxParseIterOpen(m, thread_count)) {
+        return 0;
+    }
+
+    while ((lite = mboxParseIterNext(m)) != NULL) {
+        count++;
+        if (callback(ctx, lite) != 0) {
+            break;
+        }
+    }
+
+    mboxParseIterClose(m);
+    return count;
+}
+
+static void *
+mboxParseAsyncMain(void *argv)
+{
+    mboxAsync *async = (mboxAsync *)argv;
+    mbox *m = async->m;
+    int state = MBOX_ASYNC_DONE;
+
+    mboxMain(m, 0);
+
+    if (mboxCancelled(m)) {
+        /* Full of holes where messages were dropped, no use to anyone */
+        mboxListRelease(m->completed_parse);
+        m->completed_parse = NULL;
+        state = MBOX_ASYNC_CANCELLED;
+    } else {
+        mboxListSetFreedata(m->completed_parse,
+                (mboxListFreeData *)mboxMsgLiteRelease);
+    }
+
+    __atomic_store_n(&async->state, state, __ATOMIC_RELEASE);
+    mboxNotifySignal(&async->notify);
+    return NULL;
+}
+
+/* Like the iterator the parse is driven from a thread of its own, which
+ * helps out on the runtime while it waits on each stage */
+mboxAsync *
+mboxParseAsync(mbox *m, size_t thread_count)
+{
+    mboxAsync *async = (mboxAsync *)malloc(sizeof(mboxAsync));
+
+    async->m = m;
+    async->state = MBOX_ASYNC_RUNNING;
+    async->total = m->gzip && m->gz_index == NULL ? 0 : m->file_size;
+    if (!mboxNotifyInit(&async->notify)) {
+        free(async);
+        return NULL;
+    }
+
+    mboxParserInit(m, thread_count);
+    m->async = async;
+
+    if (pthread_create(&async->thread, NULL, mboxParseAsyncMain, async) !=
+            0) {
+        loggerDebug("Failed to start parse: %s\n", strerror(errno));
+        m->async = NULL;
+        mboxNotifyClose(&async->notify);
+        free(async);
+        return NULL;
+    }
+    return async;
+}
+
+int
+mboxAsyncFd(mboxAsync *async)
+{
+    return async->notify.rfd;
+}
+
+int
+mboxAsyncPoll(mboxAsync *async, size_t *done, size_t *total)
+{
+    mbox *m = async->m;
+    int state = MBOX_ASYNC_RUNNING;
+    size_t size = async->total;
+    size_t read = 0;
+
+    /* Before looking, so anything signalled after leaves it readable */
+    mboxNotifyDrain(&async->notify);
+
+    state = __atomic_load_n(&async->state, __ATOMIC_ACQUIRE);
+    read = __atomic_load_n(&m->progress, __ATOMIC_RELAXED);
+    if (state == MBOX_ASYNC_DONE) {
+        /* Inflating to the end may have found out */
+        if (m->file_size != SSIZE_MAX) {
+            size = m->file_size;
+        }
+        read = size;
+    } else if (read > size) {
+        read = size;
+    }
+    if (done) {
+        *done = read;
+    }
+    if (total) {
+        *total = size;
+    }
+    return state;
+}
+
+void
+mboxAsyncCancel(mboxAsync *async)
+{
+    __atomic_store_n(&async->m->cancel, 1, __ATOMIC_RELAXED);
+}
+
+mboxList *
+mboxAsyncResult(mboxAsync *async)
+{
+    if (__atomic_load_n(&async->state, __ATOMIC_ACQUIRE) != MBOX_ASYNC_DONE) {
+        return NULL;
+    }
+    return async->m->completed_parse;
+}
+
+void
+mboxAsyncRelease(mboxAsync *async)
+{
+    if (async == NULL) {
+        return;
+    }
+
+    if (__atomic_load_n(&async->state, __ATOMIC_ACQUIRE) ==
+            MBOX_ASYNC_RUNNING) {
+        mboxAsyncCancel(async);
+    }
+    pthread_join(async->thread, NULL);
+    async->m->async = NULL;
+    mboxNotifyClose(&async->notify);
+    free(async);
+}
+
 static void
 mboxRemoveContext(mbox *m, int id)
 {
@@ -237,17 +1241,30 @@ mboxRemoveContext(mbox *m, int id)
     } else {
         m->write_refcount--;
     }
-    mboxBufRelease(m->contexts[id].ioctx->buf);
+    mboxIORelease(m->contexts[id].ioctx);
+    mboxGzReaderRelease(m->contexts[id].gz);
 }
 
 void
 mboxRelease(mbox *m)
 {
     mboxListRelease(m->completed_parse);
-    mboxWorkerPoolRelease(m->io_pool);
-    mboxWorkerPoolRelease(m->parse_pool);
+    /* All of the messages at once */
+    mboxListRelease(m->arenas);
+    pthread_mutex_destroy(&m->arena_lock);
+    mboxInternRelease(m->senders);
+    mboxWorkerGroupRelease(m->io_group);
+    mboxWorkerGroupRelease(m->parse_group);
     for (size_t i = 0; i < m->context_len; ++i) {
         mboxRemoveContext(m, i);
     }
     free(m->contexts);
+    if (m->map) {
+        munmap(m->map, m->map_len);
+    }
+    if (m->directfd != -1) {
+        close(m->directfd);
+    }
+    mboxGzIndexRelease(m->gz_index);
+    free(m->gz_checkpoint);
 }
@@ -9,7 +9,14 @@
 
 #include <stddef.h>
 
+#include "mbox-balance.h"
+#include "mbox-intern.h"
+#include "mbox-io.h"
 #include "mbox-list.h"
+#include "mbox-msg.h"
+#include "mbox-runtime.h"
+#include "mbox-table.h"
+#include "mbox-watch.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,7 +27,142 @@ typedef struct mbox mbox;
 
 mbox *mboxReadOpen(char *file_path, int perms);
 
+/* Same as mboxReadOpen but memory maps the file, messages are parsed straight
+ * out of the mapping without being copied */
+mbox *mboxReadOpenMapped(char *file_path, int perms);
+
+/* Same as mboxReadOpen but reads with O_DIRECT, bypassing the page cache. For
+ * one off scans of large files that would otherwise evict everything else
+ * from the cache. Falls back to normal reads if the filesystem refuses */
+mbox *mboxReadOpenDirect(char *file_path, int perms);
+
+/* Open a gzipped mbox. Without checkpoints it can only be inflated from the
+ * start so is parsed by one io thread. If `checkpoint_path` is given the
+ * first parse saves checkpoints there and later opens use them to parse in
+ * parallel. Returns NULL if built without zlib */
+mbox *mboxReadOpenGzip(char *file_path, char *checkpoint_path, int perms);
+
+/* How the file is read when parsing, one of MBOX_IO_ENGINE_PREAD,
+ * MBOX_IO_ENGINE_URING or MBOX_IO_ENGINE_AUTO (the default) which uses io_uring
+ * if the kernel supports it */
+void mboxSetIOEngine(mbox *m, int engine);
+
+/* How a parse splits its threads between reading and parsing headers, one of
+ * MBOX_BALANCE_ADAPTIVE (the default) which moves threads to whichever is
+ * falling behind as it goes, MBOX_BALANCE_FIXED for half of each or
+ * MBOX_BALANCE_FUSED where every thread parses what it has just read */
+void mboxSetBalance(mbox *m, int balance);
+
+/* Most bytes of messages read and waiting to be parsed, 64MB by default or 0
+ * for no limit. When the parsers fall behind the threads reading parse what
+ * they find themselves until it drops, so the memory a parse needs does not
+ * grow with the size of the file */
+void mboxSetBacklogLimit(mbox *m, size_t bytes);
+
+/* Which lane of the runtime a parse runs in. Threads run anything
+ * MBOX_PRIORITY_INTERACTIVE before any MBOX_PRIORITY_BULK (the default), and
+ * long bulk jobs stop between messages to let it in. For searching one
+ * mailbox while others are being indexed in the background. Must not be
+ * called while a parse is running */
+#define MBOX_PRIORITY_INTERACTIVE (MBOX_WORKER_INTERACTIVE)
+#define MBOX_PRIORITY_BULK (MBOX_WORKER_BULK)
+void mboxSetPriority(mbox *m, int priority);
+
+/* Parse on `rt`'s threads rather than the default runtime's. Must not be
+ * called while a parse is running */
+void mboxSetRuntime(mbox *m, mboxRuntime *rt);
+
+/* Every sender address and domain parsed from the file so far, each parsed
+ * message's sender_id and domain_id are in here. Lives as long as the mbox */
+mboxIntern *mboxSenders(mbox *m);
+
+/* With `lazy` set parsing only finds where the From, Subject, Date and
+ * Message-ID headers, the from line and the preview are in each message and
+ * leaves them in the file. Messages then have those fields NULL and their
+ * spans set, only unix_timestamp is worked out up front. Fetch the fields
+ * with mboxMsgLiteField, as nothing is decoded the senders are not interned
+ * while parsing. Ignored for a gzipped mbox which is always parsed in full.
+ * Must not be called while a parse is running */
+void mboxSetLazy(mbox *m, int lazy);
+
+/* One of a message's MBOX_FIELD_*, decoded from the file the first time it is
+ * asked for and then kept on the message. Safe to call for the same message
+ * from more than one thread. For a message that wasn't parsed lazily this is
+ * the field as it is. NULL if the message doesn't have it, the buf belongs to
+ * the message */
+mboxBuf *mboxMsgLiteField(mbox *m, mboxMsgLite *msg, int field);
+
+/* The same but the message is left alone and a copy of the field is
+ * returned for the caller to release, for one off reads of messages that
+ * are not going to be looked at again */
+mboxBuf *mboxMsgLiteReadField(mbox *m, mboxMsgLite *msg, int field);
+
+/* `thread_count` is how many of the runtime's threads this parse tries to
+ * keep busy, 0 for all of them */
 mboxList *mboxParse(mbox *m, size_t thread_count);
+
+/* Parse only the messages starting at or after `*offset`, which is usually
+ * the end offset of the last message already seen (see mboxMsgListEndOffset,
+ * works for lists from an index too) or what the last call set it to. Sets
+ * `*offset` to the size of the file that was parsed and returns a list of just
+ * the new messages. The list is the caller's to release, the messages belong
+ * to `m` and are freed with it. Returns NULL if the file has shrunk since, it
+ * needs a full parse */
+mboxList *mboxParseAppended(mbox *m, size_t *offset, size_t thread_count);
+
+/* Called with each message as soon as it has been parsed, the message is
+ * the callee's to release with mboxMsgLiteRelease. Return non-zero to stop
+ * the parse early */
+typedef int mboxParseStreamCallback(void *ctx, mboxMsgLite *msg);
+
+/* Parse without holding every message in memory, the callback is called
+ * from the calling thread in no particular order. Only a fixed number of
+ * messages are ever in flight, the parse waits for the callback if it falls
+ * behind. Returns how many messages were delivered */
+size_t mboxParseStream(mbox *m, size_t thread_count,
+        mboxParseStreamCallback *callback, void *ctx);
+
+/* The same as a pull iterator, mboxParseIterNext blocks until the next
+ * message is parsed and returns NULL once they have all been seen. Close
+ * must always be called and can be called early */
+int mboxParseIterOpen(mbox *m, size_t thread_count);
+mboxMsgLite *mboxParseIterNext(mbox *m);
+void mboxParseIterClose(mbox *m);
+
+/* A parse running in the background, for event loops that can't block for
+ * the length of mboxParse */
+typedef struct mboxAsync mboxAsync;
+
+#define MBOX_ASYNC_RUNNING (0)
+#define MBOX_ASYNC_DONE (1)
+#define MBOX_ASYNC_CANCELLED (2)
+
+/* Start parsing and return straight away, NULL if the parse couldn't be
+ * started. Nothing else may be done with `m` until it is released */
+mboxAsync *mboxParseAsync(mbox *m, size_t thread_count);
+
+/* Becomes readable each time the parse gets further through the file and
+ * once more when it is over. An eventfd, or a pipe where there are none, to
+ * go in a poll or epoll set. mboxAsyncPoll makes it unreadable again */
+int mboxAsyncFd(mboxAsync *async);
+
+/* Returns MBOX_ASYNC_*. If given `done` is set to how many bytes of the file
+ * have been read and `total` to its size, 0 for a gzipped file whose size
+ * isn't known yet */
+int mboxAsyncPoll(mboxAsync *async, size_t *done, size_t *total);
+
+/* Stop early. Readers stop at their next message and messages waiting to be
+ * parsed are dropped, the state becomes MBOX_ASYNC_CANCELLED once every
+ * thread has let go */
+void mboxAsyncCancel(mboxAsync *async);
+
+/* The messages in the same way as mboxParse returns them, NULL until the
+ * state is MBOX_ASYNC_DONE */
+mboxList *mboxAsyncResult(mboxAsync *async);
+
+/* Cancels the parse if it is still running and waits for it to stop */
+void mboxAsyncRelease(mboxAsync *async);
+
 void mboxRelease(mbox *m);
 
 #ifdef __cplusplus
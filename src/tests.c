@@ -11,8 +11,13 @@
 #include "macros.h"
 #include "mbox-buf.h"
 #include "mbox-date.h"
+#include "mbox-intern.h"
 #include "mbox-logger.h"
+#include "mbox-msg.h"
+#include "mbox-parser.h"
 #include "mbox-redblacktree.h"
+#include "mbox-scan.h"
+#include "mbox-table.h"
 
 #define date_fmt_1 "%a, %d %b %Y %H:%M:%S %z"
 /* We will use this format in the emails and remove the %c%c%c,<space> for
@@ -170,10 +175,304 @@ mboxBufTestWrite(void)
             total);
 }
 
+typedef struct mboxScanTest {
+    char *string;
+    size_t expected; /* -1 being no match */
+} mboxScanTest;
+
+mboxScanTest scanTests[] = {
+    { "From 1@xxx\nSubject: hi\n\nbody\nFrom 2@xxx\n", 28 },
+    { "no from line in here at all, just a lot of text to get past 32 bytes",
+            -1 },
+    { "\nFrom the top", 0 },
+    { "\nFrom", -1 },
+    { "\nFrom:not a from line\nFrom  but this is", 21 },
+    { "0123456789012345678901234567890\nFrom straddles the first block", 31 },
+    { "\nFrm \nFrom \nFrom ", 5 },
+};
+
+/* Every implementation of the scanner should agree with the scalar one, the
+ * strings are copied to different alignments so the vector code hits both
+ * the block and tail paths */
+static void
+mboxScanTestSuite(void)
+{
+    int total = static_sizeof(scanTests);
+    int passed = 0;
+    mboxScanFn *impls[] = { mboxScanFromLineScalar, mboxScanGetSSE2(),
+        mboxScanGetAVX2(), mboxScanFromLine };
+    int impl_count = static_sizeof(impls);
+    char buf[256];
+
+    for (int i = 0; i < total; ++i) {
+        mboxScanTest *t = &scanTests[i];
+        size_t len = strlen(t->string);
+        int ok = 1;
+
+        for (int shift = 0; shift < 40; ++shift) {
+            memset(buf, 'x', shift);
+            memcpy(buf + shift, t->string, len + 1);
+
+            for (int j = 0; j < impl_count; ++j) {
+                if (impls[j] == NULL) {
+                    continue;
+                }
+                size_t got = impls[j]((mboxChar *)buf, shift, shift + len);
+                size_t want = t->expected == (size_t)-1 ? shift + len :
+                                                          shift + t->expected;
+                if (got != want) {
+                    printf("[%d] impl %d shift %d: expected %zu got %zu\n", i,
+                            j, shift, want, got);
+                    ok = 0;
+                }
+            }
+        }
+        passed += ok;
+    }
+
+    printf("MBOX SCAN TEST SUITE: mboxScanFromLine(%s) --  passed:%d of:%d\n",
+            mboxScanImplName(), passed, total);
+    if (passed != total) {
+        printf("MBOX SCAN TEST SUITE: FAILED\n");
+        exit(1);
+    }
+}
+
+typedef struct mboxTableTest {
+    char *from; /* NULL for no From header */
+    long unix_timestamp;
+} mboxTableTest;
+
+mboxTableTest tableTests[] = {
+    { "Alice <alice@example.com>", 100 },
+    { NULL, 200 },
+    { "bob@EXAMPLE.com", 300 },
+    { "carol@example.org", 400 },
+    { "", 500 },
+};
+
+/* The columns should give back what went in and the scans should pick out
+ * the same rows as looking at each message would */
+static void
+mboxMsgTableTestSuite(void)
+{
+    int total = static_sizeof(tableTests);
+    int passed = 0;
+    mboxMsgTable *t = mboxMsgTableNew();
+    size_t rows[static_sizeof(tableTests)];
+    size_t count;
+
+    for (int i = 0; i < total; ++i) {
+        mboxBuf from = { .data = (mboxChar *)tableTests[i].from, .offset = 0,
+            .len = tableTests[i].from ? strlen(tableTests[i].from) : 0 };
+        mboxMsgLite msg = { .from = tableTests[i].from ? &from : NULL,
+            .unix_timestamp = tableTests[i].unix_timestamp,
+            .start = i * 10, .end = i * 10 + 10 };
+        mboxMsgTableAdd(t, &msg);
+    }
+
+    for (int i = 0; i < total; ++i) {
+        const char *from = mboxMsgTableFrom(t, i);
+        int ok = mboxMsgTableStart(t, i) == (size_t)i * 10 &&
+                 mboxMsgTableEnd(t, i) == (size_t)i * 10 + 10 &&
+                 mboxMsgTableTimestamp(t, i) == tableTests[i].unix_timestamp &&
+                 mboxMsgTableSubject(t, i) == NULL;
+        if (tableTests[i].from == NULL) {
+            ok = ok && from == NULL;
+        } else {
+            ok = ok && from && !strcmp(from, tableTests[i].from);
+        }
+        passed += ok;
+    }
+
+    count = mboxMsgTableFilterByDate(t, 200, 400, rows);
+    total++;
+    passed += count == 2 && rows[0] == 1 && rows[1] == 2;
+
+    count = mboxMsgTableFilterBySender(t, "example.com", rows);
+    total++;
+    passed += count == 2 && rows[0] == 0 && rows[1] == 2;
+
+    count = mboxMsgTableFilterBySender(t, "@Example.COM", rows);
+    total++;
+    passed += count == 2 && rows[0] == 0 && rows[1] == 2;
+
+    mboxMsgTableRelease(t);
+
+    printf("MBOX TABLE TEST SUITE: mboxMsgTable --  passed:%d of:%d\n", passed,
+            total);
+    if (passed != total) {
+        printf("MBOX TABLE TEST SUITE: FAILED\n");
+        exit(1);
+    }
+}
+
+typedef struct mboxInternTest {
+    char *from;
+    char *address;
+    char *domain; /* NULL for none */
+} mboxInternTest;
+
+mboxInternTest internTests[] = {
+    { "Alice <Alice@Example.COM>", "alice@example.com", "example.com" },
+    { "alice@example.com", "alice@example.com", "example.com" },
+    { " \"Bob\" <bob@example.org> ", "bob@example.org", "example.org" },
+    { "carol@example.org (Carol)", "carol@example.org", "example.org" },
+    { "no-domain", "no-domain", NULL },
+};
+
+/* The same address however it is written gets the same id, and every
+ * address and domain is only in the dictionary once */
+static void
+mboxInternTestSuite(void)
+{
+    int total = static_sizeof(internTests);
+    int passed = 0;
+    mboxIntern *d = mboxInternNew();
+    uint64_t *matched = NULL;
+
+    for (int i = 0; i < total; ++i) {
+        mboxInternTest *t = &internTests[i];
+        mboxBuf from = { .data = (mboxChar *)t->from, .offset = 0,
+            .len = strlen(t->from) };
+        mboxMsgLite msg = { .from = &from, .sender_id = MBOX_INTERN_NONE,
+            .domain_id = MBOX_INTERN_NONE };
+        const char *address = NULL;
+        const char *domain = NULL;
+
+        mboxMsgLiteIntern(&msg, d);
+        address = mboxInternGet(d, msg.sender_id);
+        domain = mboxInternGet(d, msg.domain_id);
+
+        int ok = address && !strcmp(address, t->address) &&
+                 msg.sender_id == mboxInternFind(d, t->address,
+                         strlen(t->address));
+        if (t->domain) {
+            ok = ok && domain && !strcmp(domain, t->domain);
+        } else {
+            ok = ok && msg.domain_id == MBOX_INTERN_NONE;
+        }
+        if (!ok) {
+            printf("[%d] %s: got %s and %s\n", i, t->from, address, domain);
+        }
+        passed += ok;
+    }
+
+    /* Three addresses with a domain, their two domains and no-domain */
+    total++;
+    passed += mboxInternLen(d) == 6;
+
+    total++;
+    matched = mboxInternMatch(d, "EXAMPLE.ORG");
+    passed += mboxInternBit(matched, mboxInternFind(d, "bob@example.org", 15)) &&
+              !mboxInternBit(matched, mboxInternFind(d, "alice@example.com",
+                      17));
+    free(matched);
+    mboxInternRelease(d);
+
+    printf("MBOX INTERN TEST SUITE: mboxIntern --  passed:%d of:%d\n", passed,
+            total);
+    if (passed != total) {
+        printf("MBOX INTERN TEST SUITE: FAILED\n");
+        exit(1);
+    }
+}
+
+static char *lazyTestMsg =
+        "From alice@example.com Mon Feb 27 07:30:00 +0000 2023\r\n"
+        "X-Mailer: test\r\n"
+        "Subject: A subject that carries\r\n"
+        " on to the next line\r\n"
+        "From: Alice <alice@example.com>\r\n"
+        "Date: 27 Feb 2023 07:30:00 +0000\r\n"
+        "Subject: Not this one\r\n"
+        "Message-ID:<1@example.com>\r\n"
+        "\r\n"
+        "Hello there\r\n";
+
+typedef struct mboxLazyTest {
+    int field;
+    char *value; /* NULL if the message doesn't have it */
+} mboxLazyTest;
+
+mboxLazyTest lazyTests[] = {
+    { MBOX_FIELD_FROM_LINE,
+            "From alice@example.com Mon Feb 27 07:30:00 +0000 2023" },
+    { MBOX_FIELD_FROM, "Alice <alice@example.com>" },
+    { MBOX_FIELD_SUBJECT, "A subject that carries on to the next line" },
+    { MBOX_FIELD_DATE, "27 Feb 2023 07:30:00 +0000" },
+    /* No space after the ':' */
+    { MBOX_FIELD_MSG_ID, "1@example.com>" },
+    { MBOX_FIELD_PREVIEW, "Hello there\r\n" },
+};
+
+/* Fields found by mboxParseHeaderSpans decode to what the eager parse
+ * would have given */
+static void
+mboxLazyTestSuite(void)
+{
+    int total = static_sizeof(lazyTests);
+    int passed = 0;
+    size_t len = strlen(lazyTestMsg);
+    mboxBuf buf = { .data = (mboxChar *)lazyTestMsg, .offset = 0, .len = len };
+    mboxMsgLite *lazy = NULL;
+    mboxMsgLite *eager = NULL;
+    mboxBuf *copy = NULL;
+
+    lazy = mboxMsgLiteFromBufferLazy(&buf, 0, len, NULL);
+
+    for (int i = 0; i < total; ++i) {
+        mboxLazyTest *t = &lazyTests[i];
+        mboxMsgSpan *span = &lazy->spans[t->field];
+        mboxBuf *value = mboxMsgFieldDecode(t->field,
+                buf.data + span->offset, span->len);
+        int ok = value && !strcmp((char *)value->data, t->value);
+
+        if (!ok) {
+            printf("[%d] field %d: got %s\n", i, t->field,
+                    value ? (char *)value->data : "(NIL)");
+        }
+        passed += ok;
+        mboxBufRelease(value);
+    }
+
+    total++;
+    copy = mboxBufDupRaw(buf.data, len, len);
+    eager = mboxMsgLiteFromBuffer(copy, 0, len, NULL);
+    passed += lazy->unix_timestamp != 0 &&
+              lazy->unix_timestamp == eager->unix_timestamp &&
+              lazy->from == NULL && eager->spans == NULL;
+
+    /* Without headers everything after the from line is preview */
+    total++;
+    buf.data = (mboxChar *)"From a\n\nbody";
+    buf.len = 12;
+    mboxParseHeaderSpans(&buf, lazy->spans);
+    passed += lazy->spans[MBOX_FIELD_FROM].len == 0 &&
+              lazy->spans[MBOX_FIELD_FROM_LINE].len == 6 &&
+              lazy->spans[MBOX_FIELD_PREVIEW].offset == 8 &&
+              lazy->spans[MBOX_FIELD_PREVIEW].len == 4;
+
+    mboxMsgLiteRelease(lazy);
+    mboxMsgLiteRelease(eager);
+    mboxBufRelease(copy);
+
+    printf("MBOX LAZY TEST SUITE: mboxParseHeaderSpans --  passed:%d of:%d\n",
+            passed, total);
+    if (passed != total) {
+        printf("MBOX LAZY TEST SUITE: FAILED\n");
+        exit(1);
+    }
+}
+
 int
 main(void)
 {
     dateTestSuite();
     mboxBufTestSuite();
     mboxBufTestWrite();
+    mboxScanTestSuite();
+    mboxMsgTableTestSuite();
+    mboxInternTestSuite();
+    mboxLazyTestSuite();
 }